@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "mock_broker.h"
+
+/**
+* cstomp-bench [-H host] [-p port] [-n msgs] [-s send|recv|rtt|parse]
+* Without -H an in-process mock broker on loopback is used, so numbers are the client cost plus
+* a thin broker, not a real broker. Every run covers body sizes x header counts x thread counts.
+*
+* send : each thread owns a session and SENDs, latency is one cstmp_send call, a RECEIPT at the
+*        end makes sure the broker read everything before the clock stops
+* recv : producers threads SEND to a destination one consumer subscribed, latency is end to end
+*        from the ts header stamped before the send
+* rtt  : one SEND with receipt then wait the RECEIPT, latency is the round trip
+* parse: MESSAGE frames already in memory through cstmp_parser_feed in 64K chunks, no socket,
+*        latency is the parse time of one frame, from the end of the previous one
+**/
+
+#define BENCH_DEST_SEND  "/queue/cstomp.bench.send"
+#define BENCH_DEST_RECV  "/queue/cstomp.bench.recv"
+#define BENCH_MAX_BYTES  (256UL << 20)
+#define BENCH_TIMEOUT    1000
+#define BENCH_MAX_IDLE   10
+#define BENCH_PARSE_CHUNK (64 * 1024)
+
+static const size_t body_sizes[] = { 16, 256, 4096, 65536 };
+static const size_t header_counts[] = { 0, 16, 64 };
+static const size_t thread_counts[] = { 1, 4 };
+
+#define BENCH_NELTS(a) (sizeof(a) / sizeof((a)[0]))
+
+typedef struct {
+    const char *host;
+    int port;
+    size_t msgs;
+    cstmp_codec_t codec; /* -z, body compression of the bench sessions */
+} bench_conf_t;
+
+typedef struct {
+    const bench_conf_t *conf;
+    const char *dest;
+    size_t body_size;
+    size_t nheaders;
+    size_t nmsgs; /* per thread */
+    u_char *body;
+    pthread_barrier_t *start;
+    cstmp_hist_t *lat;
+    int failed;
+} bench_job_t;
+
+typedef struct {
+    size_t msgs;
+    uint64_t elapsed_ns;
+    cstmp_hist_t lat;
+} bench_result_t;
+
+static uint64_t
+bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static cstmp_session_t*
+bench_open(const bench_conf_t *conf) {
+    cstmp_session_t *sess;
+    if ((sess = cstmp_connect_t(conf->host, conf->port, BENCH_TIMEOUT, BENCH_TIMEOUT)) == NULL) {
+        return NULL;
+    }
+    if (!cstmp_stomp_connect(sess, NULL, NULL, NULL, 3) ||
+            (conf->codec != CSTMP_CODEC_NONE && !cstmp_set_compression(sess, conf->codec, 0, 512, NULL, 0))) {
+        cstmp_disconnect(sess);
+        return NULL;
+    }
+    return sess;
+}
+
+/** SEND with nheaders extra headers, the body is copied into the frame like a real caller would **/
+static void
+bench_build(bench_job_t *job, cstmp_frame_t *fr, const char *receipt) {
+    char key[32], val[32];
+    size_t i;
+
+    cstmp_reset_frame(fr);
+    cstmp_set_cmd(fr, CSTMP_CMD_SEND);
+    cstmp_add_header(fr, "destination", job->dest);
+    cstmp_add_header(fr, "content-type", "application/octet-stream");
+    for (i = 0; i < job->nheaders; i++) {
+        sprintf(key, "x-bench-%zu", i);
+        sprintf(val, "value-%zu", i);
+        cstmp_add_header(fr, key, val);
+    }
+    if (receipt) {
+        cstmp_add_header(fr, "receipt", receipt);
+    }
+    sprintf(val, "%llu", (unsigned long long) bench_now_ns());
+    cstmp_add_header(fr, "ts", val);
+    cstmp_add_body_content_and_len(fr, job->body, job->body_size);
+}
+
+static int
+bench_wait_receipt(cstmp_session_t *sess, cstmp_frame_t *fr) {
+    int idle = 0;
+    while (idle < BENCH_MAX_IDLE) {
+        if (!cstmp_recv(sess, fr, 1)) {
+            idle++;
+            continue;
+        }
+        if (fr->cmd_id == CSTMP_CMD_RECEIPT) {
+            return 1;
+        }
+        if (fr->cmd_id == CSTMP_CMD_ERROR) {
+            cstmp_dump_frame_pretty(fr);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+static void*
+bench_send_run(void *arg) {
+    bench_job_t *job = arg;
+    cstmp_session_t *sess;
+    cstmp_frame_t *fr;
+    uint64_t t0;
+    size_t i;
+
+    if ((sess = bench_open(job->conf)) == NULL || (fr = cstmp_new_frame()) == NULL) {
+        job->failed = 1;
+        pthread_barrier_wait(job->start);
+        if (sess)
+            cstmp_disconnect(sess);
+        return NULL;
+    }
+    pthread_barrier_wait(job->start);
+
+    for (i = 0; i < job->nmsgs; i++) {
+        bench_build(job, fr, i + 1 == job->nmsgs ? "bench-end" : NULL);
+        t0 = bench_now_ns();
+        if (!cstmp_send(sess, fr, 3)) {
+            job->failed = 1;
+            break;
+        }
+        cstmp_hist_record(job->lat, bench_now_ns() - t0);
+    }
+    if (!job->failed && !bench_wait_receipt(sess, fr)) {
+        job->failed = 1;
+    }
+
+    cstmp_destroy_frame(fr);
+    cstmp_disconnect(sess);
+    return NULL;
+}
+
+static void*
+bench_rtt_run(void *arg) {
+    bench_job_t *job = arg;
+    cstmp_session_t *sess;
+    cstmp_frame_t *fr;
+    uint64_t t0;
+    size_t i;
+
+    if ((sess = bench_open(job->conf)) == NULL || (fr = cstmp_new_frame()) == NULL) {
+        job->failed = 1;
+        pthread_barrier_wait(job->start);
+        if (sess)
+            cstmp_disconnect(sess);
+        return NULL;
+    }
+    pthread_barrier_wait(job->start);
+
+    for (i = 0; i < job->nmsgs; i++) {
+        bench_build(job, fr, "bench-rtt");
+        t0 = bench_now_ns();
+        if (!cstmp_send(sess, fr, 3) || !bench_wait_receipt(sess, fr)) {
+            job->failed = 1;
+            break;
+        }
+        cstmp_hist_record(job->lat, bench_now_ns() - t0);
+    }
+
+    cstmp_destroy_frame(fr);
+    cstmp_disconnect(sess);
+    return NULL;
+}
+
+typedef struct {
+    size_t got;
+    uint64_t last; /* when the previous frame was done */
+    cstmp_hist_t *lat;
+} bench_parse_t;
+
+static int
+bench_parse_frame(cstmp_frame_t *fr, void *arg) {
+    bench_parse_t *bp = arg;
+    uint64_t now = bench_now_ns();
+    cstmp_hist_record(bp->lat, now - bp->last);
+    bp->last = now;
+    bp->got++;
+    return 1;
+}
+
+static int
+bench_parse(size_t nmsgs, size_t body_size, size_t nheaders, bench_result_t *res) {
+    cstmp_parser_t *parser;
+    bench_parse_t bp;
+    u_char *stream, *p;
+    size_t i, j, head_max, off, chunk;
+    uint64_t t0;
+
+    head_max = 128 + nheaders * 32;
+    if (nmsgs * (head_max + body_size + 2) > BENCH_MAX_BYTES / 4) {
+        nmsgs = BENCH_MAX_BYTES / 4 / (head_max + body_size + 2);
+    }
+    if ((stream = malloc(nmsgs * (head_max + body_size + 2))) == NULL) {
+        return 0;
+    }
+    for (i = 0, p = stream; i < nmsgs; i++) {
+        p += sprintf((char*) p, "MESSAGE\nsubscription:bench\nmessage-id:m-%zu\ndestination:%s\ncontent-length:%zu\n",
+                     i, BENCH_DEST_RECV, body_size);
+        for (j = 0; j < nheaders; j++) {
+            p += sprintf((char*) p, "x-bench-%zu:value-%zu\n", j, j);
+        }
+        *p++ = '\n';
+        memset(p, 'x', body_size);
+        p += body_size;
+        *p++ = '\0';
+        *p++ = '\n';
+    }
+    bp.got = 0;
+    bp.lat = &res->lat;
+    if ((parser = cstmp_parser_create(bench_parse_frame, &bp)) == NULL) {
+        free(stream);
+        return 0;
+    }
+
+    t0 = bp.last = bench_now_ns();
+    for (off = 0; off < (size_t) (p - stream); off += chunk) {
+        chunk = (size_t) (p - stream) - off < BENCH_PARSE_CHUNK ? (size_t) (p - stream) - off : BENCH_PARSE_CHUNK;
+        if (cstmp_parser_feed(parser, stream + off, chunk) < 0) {
+            break;
+        }
+    }
+    res->elapsed_ns = bench_now_ns() - t0;
+    res->msgs = bp.got;
+
+    cstmp_parser_destroy(parser);
+    free(stream);
+    return bp.got == nmsgs;
+}
+
+static int
+bench_one(const bench_conf_t *conf, const char *scenario, size_t body_size, size_t nheaders, size_t nthreads,
+          bench_result_t *res) {
+    bench_job_t jobs[64];
+    pthread_barrier_t start;
+    cstmp_session_t *consumer = NULL;
+    cstmp_frame_t *fr = NULL;
+    cstmp_frame_val_t ts;
+    cstmp_hist_t *scratch = NULL;
+    pthread_t tids[64];
+    u_char *body;
+    size_t i, per_thread, got = 0;
+    uint64_t t0;
+    int idle = 0, success = 1, is_recv = strcmp(scenario, "recv") == 0;
+
+    per_thread = conf->msgs;
+    if (per_thread * body_size > BENCH_MAX_BYTES) {
+        per_thread = BENCH_MAX_BYTES / body_size;
+    }
+    if (strcmp(scenario, "rtt") == 0) {
+        per_thread = per_thread / 5 ? per_thread / 5 : 1;
+    }
+    per_thread = per_thread / nthreads ? per_thread / nthreads : 1;
+
+    if (strcmp(scenario, "parse") == 0) {
+        bzero(res, sizeof(bench_result_t));
+        return bench_parse(per_thread, body_size, nheaders, res);
+    }
+    if ((body = malloc(body_size)) == NULL || (scratch = calloc(1, sizeof(cstmp_hist_t))) == NULL) {
+        free(body);
+        return 0;
+    }
+    memset(body, 'x', body_size);
+    bzero(res, sizeof(bench_result_t));
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+
+    if (is_recv) {
+        if ((consumer = bench_open(conf)) == NULL || (fr = cstmp_new_frame()) == NULL) {
+            success = 0;
+            goto BENCH_DONE;
+        }
+        cstmp_set_cmd(fr, CSTMP_CMD_SUBSCRIBE);
+        cstmp_add_header(fr, "destination", BENCH_DEST_RECV);
+        cstmp_add_header(fr, "id", "bench");
+        cstmp_add_header(fr, "ack", "auto");
+        cstmp_add_header(fr, "receipt", "bench-sub");
+        if (!cstmp_send(consumer, fr, 3) || !bench_wait_receipt(consumer, fr)) {
+            success = 0;
+            goto BENCH_DONE;
+        }
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        bzero(&jobs[i], sizeof(bench_job_t));
+        jobs[i].conf = conf;
+        jobs[i].dest = is_recv ? BENCH_DEST_RECV : BENCH_DEST_SEND;
+        jobs[i].body_size = body_size;
+        jobs[i].nheaders = nheaders;
+        jobs[i].nmsgs = per_thread;
+        jobs[i].body = body;
+        jobs[i].start = &start;
+        /* recv measures end to end on the consumer side, the senders latency is not reported */
+        jobs[i].lat = is_recv ? scratch : &res->lat;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tids[i], NULL, strcmp(scenario, "rtt") == 0 ? bench_rtt_run : bench_send_run, &jobs[i]) != 0) {
+            fprintf(stderr, "%s\n", "bench: unable to create thread");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&start);
+    t0 = bench_now_ns();
+
+    if (is_recv) {
+        while (got < per_thread * nthreads && idle < BENCH_MAX_IDLE) {
+            if (!cstmp_recv(consumer, fr, 1)) {
+                idle++;
+                continue;
+            }
+            if (fr->cmd_id == CSTMP_CMD_MESSAGE) {
+                /* ts is not NUL terminated but always followed by the header LF */
+                if (cstmp_get_header(fr, "ts", &ts)) {
+                    cstmp_hist_record(&res->lat, bench_now_ns() - strtoull((char*) ts.data, NULL, 10));
+                }
+                got++;
+                idle = 0;
+            }
+        }
+        success = got == per_thread * nthreads;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        success &= !jobs[i].failed;
+    }
+    res->elapsed_ns = bench_now_ns() - t0;
+    res->msgs = per_thread * nthreads;
+
+BENCH_DONE:
+    pthread_barrier_destroy(&start);
+    if (fr)
+        cstmp_destroy_frame(fr);
+    if (consumer)
+        cstmp_disconnect(consumer);
+    free(scratch);
+    free(body);
+    return success;
+}
+
+static void
+bench_report(const char *scenario, size_t body_size, size_t nheaders, size_t nthreads, const bench_result_t *res) {
+    double secs = (double) res->elapsed_ns / 1e9;
+    printf("%-5s %7zu %5zu %4zu %9zu %12.0f %9.1f %10.1f %10.1f %10.1f\n",
+           scenario, body_size, nheaders, nthreads, res->msgs,
+           (double) res->msgs / secs, (double) res->msgs * (double) body_size / secs / 1e6,
+           (double) cstmp_hist_percentile(&res->lat, 0.5) / 1e3,
+           (double) cstmp_hist_percentile(&res->lat, 0.99) / 1e3,
+           (double) cstmp_hist_percentile(&res->lat, 0.999) / 1e3);
+    fflush(stdout);
+}
+
+int
+main(int argc, char *argv[]) {
+    static const char *scenarios[] = { "send", "recv", "rtt", "parse" };
+    bench_conf_t conf = { "127.0.0.1", 0, 100000, CSTMP_CODEC_NONE };
+    mock_broker_t *broker = NULL;
+    bench_result_t *res;
+    const char *only = NULL;
+    size_t s, b, h, t;
+    int opt, status = 0;
+
+    while ((opt = getopt(argc, argv, "H:p:n:s:z:")) != -1) {
+        switch (opt) {
+        case 'H':
+            conf.host = optarg;
+            break;
+        case 'p':
+            conf.port = atoi(optarg);
+            break;
+        case 'n':
+            conf.msgs = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            only = optarg;
+            break;
+        case 'z':
+            conf.codec = strcmp(optarg, "zstd") == 0 ? CSTMP_CODEC_ZSTD : CSTMP_CODEC_LZ4;
+            if (!cstmp_codec_available(conf.codec)) {
+                fprintf(stderr, "bench: %s is not built in\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-H host] [-p port] [-n msgs] [-s send|recv|rtt|parse] [-z lz4|zstd]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (conf.msgs == 0) {
+        conf.msgs = 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    if (conf.port == 0) {
+        if ((broker = mock_broker_start(0)) == NULL) {
+            return 1;
+        }
+        conf.port = mock_broker_port(broker);
+    }
+    if ((res = malloc(sizeof(bench_result_t))) == NULL) {
+        return 1;
+    }
+
+    printf("# %s:%d%s\n", conf.host, conf.port, broker ? " (mock broker)" : "");
+    printf("%-5s %7s %5s %4s %9s %12s %9s %10s %10s %10s\n",
+           "mode", "body", "hdrs", "thr", "msgs", "msgs/s", "MB/s", "p50(us)", "p99(us)", "p999(us)");
+
+    for (s = 0; s < BENCH_NELTS(scenarios); s++) {
+        if (only && strcmp(only, scenarios[s]) != 0) {
+            continue;
+        }
+        for (b = 0; b < BENCH_NELTS(body_sizes); b++) {
+            for (h = 0; h < BENCH_NELTS(header_counts); h++) {
+                for (t = 0; t < BENCH_NELTS(thread_counts); t++) {
+                    /* one outstanding request per session, more threads only measures the broker */
+                    if ((strcmp(scenarios[s], "rtt") == 0 || strcmp(scenarios[s], "parse") == 0) && thread_counts[t] != 1) {
+                        continue;
+                    }
+                    if (!bench_one(&conf, scenarios[s], body_sizes[b], header_counts[h], thread_counts[t], res)) {
+                        fprintf(stderr, "%s body=%zu headers=%zu threads=%zu failed\n",
+                                scenarios[s], body_sizes[b], header_counts[h], thread_counts[t]);
+                        status = 1;
+                        continue;
+                    }
+                    bench_report(scenarios[s], body_sizes[b], header_counts[h], thread_counts[t], res);
+                }
+            }
+        }
+    }
+
+    free(res);
+    mock_broker_stop(broker);
+    return status;
+}
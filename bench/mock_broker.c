@@ -0,0 +1,344 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "mock_broker.h"
+
+#define MOCK_RECV_TIMEOUT   200
+#define MOCK_SEND_TIMEOUT   3000
+
+static char*
+_mock_strndup(const u_char *data, size_t len) {
+    char *s = malloc(len + 1);
+    if (s) {
+        memcpy(s, data, len);
+        s[len] = '\0';
+    }
+    return s;
+}
+
+#define _mock_hdr_is(line, len, key) \
+((len) >= sizeof(key) - 1 && memcmp(line, key, sizeof(key) - 1) == 0)
+
+static int
+_mock_conn_send(mock_conn_t *conn, cstmp_frame_t *fr) {
+    int success;
+    pthread_mutex_lock(&conn->wlock);
+    success = cstmp_send(conn->sess, fr, 1);
+    pthread_mutex_unlock(&conn->wlock);
+    return success;
+}
+
+static void
+_mock_subscribe(mock_conn_t *conn, cstmp_frame_t *fr) {
+    mock_broker_t *broker = conn->broker;
+    cstmp_frame_val_t id, dest, ack;
+    mock_sub_t *sub;
+
+    if (!cstmp_get_header(fr, "id", &id) || !cstmp_get_header_by_id(fr, CSTMP_HDR_DESTINATION, &dest)) {
+        fprintf(stderr, "%s\n", "mock broker: SUBSCRIBE without id or destination");
+        return;
+    }
+    if ((sub = calloc(1, sizeof(mock_sub_t))) == NULL) {
+        return;
+    }
+    sub->conn = conn;
+    sub->id = _mock_strndup(id.data, id.len);
+    sub->destination = _mock_strndup(dest.data, dest.len);
+    sub->client_ack = cstmp_get_header_by_id(fr, CSTMP_HDR_ACK, &ack) && !(ack.len == 4 && memcmp(ack.data, "auto", 4) == 0);
+
+    pthread_rwlock_wrlock(&broker->lock);
+    sub->next = broker->subs;
+    broker->subs = sub;
+    pthread_rwlock_unlock(&broker->lock);
+}
+
+/** id NULL removes every subscription of the connection **/
+static void
+_mock_unsubscribe(mock_conn_t *conn, const cstmp_frame_val_t *id) {
+    mock_broker_t *broker = conn->broker;
+    mock_sub_t **pp, *sub;
+
+    pthread_rwlock_wrlock(&broker->lock);
+    for (pp = &broker->subs; (sub = *pp) != NULL; ) {
+        if (sub->conn == conn && (!id || (strlen(sub->id) == id->len && memcmp(sub->id, id->data, id->len) == 0))) {
+            *pp = sub->next;
+            free(sub->id);
+            free(sub->destination);
+            free(sub);
+        } else {
+            pp = &sub->next;
+        }
+    }
+    pthread_rwlock_unlock(&broker->lock);
+}
+
+/** user headers go along with the MESSAGE as they came, still escaped **/
+static void
+_mock_copy_headers(cstmp_frame_t *out, cstmp_frame_t *fr) {
+    u_char *line = fr->headers.start, *end = fr->headers.last, *eol;
+    size_t len;
+
+    for (; line < end; line = eol + 1) {
+        if ((eol = memchr(line, '\n', end - line)) == NULL) {
+            eol = end;
+        }
+        len = eol - line;
+        if (len > 0 && line[len - 1] == '\r') {
+            len--;
+        }
+        if (len == 0 || _mock_hdr_is(line, len, "destination:") || _mock_hdr_is(line, len, "receipt:") ||
+                _mock_hdr_is(line, len, "content-length:") || _mock_hdr_is(line, len, "transaction:")) {
+            continue;
+        }
+        cstmp_add_header_str_and_len(out, line, len);
+    }
+}
+
+/** MESSAGE to every subscriber of the destination, the body is not copied **/
+static void
+_mock_fanout(mock_conn_t *conn, cstmp_frame_t *fr, cstmp_frame_t *out) {
+    mock_broker_t *broker = conn->broker;
+    cstmp_frame_val_t dest, body;
+    char msg_id[32];
+    mock_sub_t *sub;
+
+    __atomic_fetch_add(&broker->sends, 1, __ATOMIC_RELAXED);
+    if (!cstmp_get_header_by_id(fr, CSTMP_HDR_DESTINATION, &dest)) {
+        return;
+    }
+    cstmp_get_body(fr, &body);
+
+    pthread_rwlock_rdlock(&broker->lock);
+    for (sub = broker->subs; sub; sub = sub->next) {
+        if (strlen(sub->destination) != dest.len || memcmp(sub->destination, dest.data, dest.len) != 0) {
+            continue;
+        }
+        sprintf(msg_id, "m-%llu", (unsigned long long) __atomic_add_fetch(&broker->next_msg_id, 1, __ATOMIC_RELAXED));
+        cstmp_reset_frame(out);
+        cstmp_set_cmd(out, CSTMP_CMD_MESSAGE);
+        cstmp_add_header(out, "subscription", sub->id);
+        cstmp_add_header(out, "message-id", msg_id);
+        cstmp_add_header(out, "destination", sub->destination);
+        if (sub->client_ack) {
+            cstmp_add_header(out, "ack", msg_id);
+        }
+        _mock_copy_headers(out, fr);
+        cstmp_set_body_mapped(out, body.data, body.len);
+        _mock_conn_send(sub->conn, out);
+    }
+    pthread_rwlock_unlock(&broker->lock);
+}
+
+static void
+_mock_receipt(mock_conn_t *conn, cstmp_frame_t *fr, cstmp_frame_t *out) {
+    cstmp_frame_val_t receipt;
+    char *id;
+    if (!cstmp_get_header(fr, "receipt", &receipt) || (id = _mock_strndup(receipt.data, receipt.len)) == NULL) {
+        return;
+    }
+    cstmp_reset_frame(out);
+    cstmp_set_cmd(out, CSTMP_CMD_RECEIPT);
+    cstmp_add_header(out, "receipt-id", id);
+    _mock_conn_send(conn, out);
+    free(id);
+}
+
+/** cstmp_recv does not tell a timeout from a closed peer, peek when it failed **/
+static int
+_mock_conn_closed(mock_conn_t *conn) {
+    char c;
+    ssize_t n = recv(conn->sess->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+static void*
+_mock_conn_run(void *arg) {
+    mock_conn_t *conn = arg, **pp;
+    mock_broker_t *broker = conn->broker;
+    cstmp_frame_t *fr = cstmp_new_frame(), *out = cstmp_new_frame();
+    cstmp_frame_val_t id;
+    int running = fr && out;
+
+    while (running && !broker->stopping) {
+        if (!cstmp_recv(conn->sess, fr, 0)) {
+            running = !_mock_conn_closed(conn);
+            continue;
+        }
+        switch (fr->cmd_id) {
+        case CSTMP_CMD_CONNECT:
+        case CSTMP_CMD_STOMP:
+            cstmp_reset_frame(out);
+            cstmp_set_cmd(out, CSTMP_CMD_CONNECTED);
+            cstmp_add_header(out, "version", "1.2");
+            cstmp_add_header(out, "heart-beat", "0,0");
+            cstmp_add_header(out, "server", "cstomp-mock");
+            _mock_conn_send(conn, out);
+            continue;
+        case CSTMP_CMD_SUBSCRIBE:
+            _mock_subscribe(conn, fr);
+            break;
+        case CSTMP_CMD_UNSUBSCRIBE:
+            if (cstmp_get_header(fr, "id", &id)) {
+                _mock_unsubscribe(conn, &id);
+            }
+            break;
+        case CSTMP_CMD_SEND:
+            _mock_fanout(conn, fr, out);
+            break;
+        case CSTMP_CMD_ACK:
+        case CSTMP_CMD_NACK:
+            __atomic_fetch_add(&broker->acks, 1, __ATOMIC_RELAXED);
+            break;
+        case CSTMP_CMD_DISCONNECT:
+            running = 0;
+            break;
+        default:
+            break;
+        }
+        _mock_receipt(conn, fr, out);
+    }
+
+    _mock_unsubscribe(conn, NULL);
+    pthread_rwlock_wrlock(&broker->lock);
+    for (pp = &broker->conns; *pp; pp = &(*pp)->next) {
+        if (*pp == conn) {
+            *pp = conn->next;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&broker->lock);
+
+    if (fr)
+        cstmp_destroy_frame(fr);
+    if (out)
+        cstmp_destroy_frame(out);
+    cstmp_disconnect(conn->sess);
+    pthread_mutex_destroy(&conn->wlock);
+    free(conn);
+    return NULL;
+}
+
+static void*
+_mock_accept_run(void *arg) {
+    mock_broker_t *broker = arg;
+    mock_conn_t *conn;
+    pthread_t tid;
+    int fd, one = 1;
+
+    while (!broker->stopping) {
+        if ((fd = accept(broker->lfd, NULL, NULL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if ((conn = calloc(1, sizeof(mock_conn_t))) == NULL ||
+                (conn->sess = cstmp_session_from_fd(fd, MOCK_SEND_TIMEOUT, MOCK_RECV_TIMEOUT)) == NULL) {
+            free(conn);
+            close(fd);
+            continue;
+        }
+        /** a broker forwards compressed bodies untouched **/
+        cstmp_set_body_decoding(conn->sess, 0);
+        conn->broker = broker;
+        pthread_mutex_init(&conn->wlock, NULL);
+
+        pthread_rwlock_wrlock(&broker->lock);
+        conn->next = broker->conns;
+        broker->conns = conn;
+        pthread_rwlock_unlock(&broker->lock);
+
+        /** the thread frees conn when done, it may already be gone after the create **/
+        if (pthread_create(&tid, NULL, _mock_conn_run, conn) != 0) {
+            fprintf(stderr, "%s\n", "mock broker: unable to start connection thread");
+            _mock_conn_run(conn);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+mock_broker_t*
+mock_broker_start(int port) {
+    mock_broker_t *broker;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int one = 1;
+
+    if ((broker = calloc(1, sizeof(mock_broker_t))) == NULL) {
+        return NULL;
+    }
+    pthread_rwlock_init(&broker->lock, NULL);
+    if ((broker->lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        goto START_FAILED;
+    }
+    setsockopt(broker->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(broker->lfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(broker->lfd, 128) < 0 ||
+            getsockname(broker->lfd, (struct sockaddr*) &addr, &addrlen) < 0) {
+        fprintf(stderr, "mock broker: unable to listen on port %d: %s\n", port, strerror(errno));
+        close(broker->lfd);
+        goto START_FAILED;
+    }
+    broker->port = ntohs(addr.sin_port);
+    if (pthread_create(&broker->acceptor, NULL, _mock_accept_run, broker) != 0) {
+        close(broker->lfd);
+        goto START_FAILED;
+    }
+    return broker;
+
+START_FAILED:
+    pthread_rwlock_destroy(&broker->lock);
+    free(broker);
+    return NULL;
+}
+
+int
+mock_broker_port(mock_broker_t *broker) {
+    return broker ? broker->port : 0;
+}
+
+void
+mock_broker_stop(mock_broker_t *broker) {
+    mock_conn_t *conn;
+    int remaining;
+
+    if (!broker) {
+        return;
+    }
+    broker->stopping = 1;
+    shutdown(broker->lfd, SHUT_RDWR);
+    pthread_join(broker->acceptor, NULL);
+    close(broker->lfd);
+
+    /** connection threads free themselves, wake them and wait the list to drain **/
+    do {
+        pthread_rwlock_rdlock(&broker->lock);
+        for (conn = broker->conns; conn; conn = conn->next) {
+            shutdown(conn->sess->sock, SHUT_RDWR);
+        }
+        remaining = broker->conns != NULL;
+        pthread_rwlock_unlock(&broker->lock);
+        if (remaining) {
+            usleep(10 * 1000);
+        }
+    } while (remaining);
+
+    pthread_rwlock_destroy(&broker->lock);
+    free(broker);
+}
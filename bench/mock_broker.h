@@ -0,0 +1,48 @@
+#ifndef _MOCK_BROKER_H_
+#define _MOCK_BROKER_H_
+
+#include <cstomp.h>
+
+/**
+* Loopback STOMP broker for tests and benchmarks, one thread per connection.
+* CONNECT/STOMP, SUBSCRIBE/UNSUBSCRIBE, SEND fanned out as MESSAGE to the destination subscribers,
+* RECEIPT for any frame with a receipt header, ACK/NACK counted. Transactions are accepted but
+* not buffered, a SEND inside BEGIN/COMMIT is delivered right away. Nothing is persisted.
+**/
+typedef struct mock_sub_s {
+    struct mock_conn_s *conn;
+    char *id;
+    char *destination;
+    int client_ack;
+    struct mock_sub_s *next;
+} mock_sub_t;
+
+typedef struct mock_conn_s {
+    struct mock_broker_s *broker;
+    cstmp_session_t *sess;
+    pthread_mutex_t wlock; /* MESSAGEs come from the publishers threads */
+    struct mock_conn_s *next;
+} mock_conn_t;
+
+typedef struct mock_broker_s {
+    int lfd;
+    int port;
+    pthread_t acceptor;
+    pthread_rwlock_t lock; /* subs and conns */
+    mock_sub_t *subs;
+    mock_conn_t *conns;
+    /*Atomic*/uint64_t next_msg_id;
+    /*Atomic*/uint64_t sends;
+    /*Atomic*/uint64_t acks;
+    volatile int stopping;
+} mock_broker_t;
+
+/** Listen on 127.0.0.1:port, 0 picks a free port, see mock_broker_port **/
+extern mock_broker_t* mock_broker_start(int port);
+
+extern int mock_broker_port(mock_broker_t *broker);
+
+/** Close every connection and free the broker **/
+extern void mock_broker_stop(mock_broker_t *broker);
+
+#endif
@@ -0,0 +1,38 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include "mock_broker.h"
+
+/** cstomp-mock-broker [port], a local target for the examples, ctrl-c to stop **/
+
+static volatile sig_atomic_t running = 1;
+
+static void
+on_signal(int sig) {
+    running = 0;
+}
+
+int
+main(int argc, char *argv[]) {
+    mock_broker_t *broker;
+    int port = argc > 1 ? atoi(argv[1]) : 61613;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if ((broker = mock_broker_start(port)) == NULL) {
+        return 1;
+    }
+    printf("mock broker listening on 127.0.0.1:%d\n", mock_broker_port(broker));
+    fflush(stdout);
+
+    while (running) {
+        pause();
+    }
+
+    printf("sends=%llu acks=%llu\n", (unsigned long long) broker->sends, (unsigned long long) broker->acks);
+    mock_broker_stop(broker);
+    return 0;
+}
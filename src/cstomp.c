@@ -12,6 +12,30 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sched.h>
+#ifdef CSTOMP_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef CSTOMP_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CSTOMP_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define CSTOMP_SIMD_X86
+#endif
 #include "cstomp.h"
 
 typedef void* (*cstmp_malloc_fn)(void* arg, size_t sz);
@@ -33,6 +57,8 @@ static void* __stp_arg__ = NULL;
 
 #define cstmp_def_header_size 256
 #define cstmp_def_message_size 1024
+#define cstmp_def_read_buf_size 16384
+#define cstmp_max_cmd_size 16
 #define cstmp_cpymem(dst, src, n)   (((u_char *) memcpy(dst, src, n)) + (n))
 #define cstmp_buf_size(b) (size_t) (b->last - b->start)
 #define cstmp_buf_left(b) (size_t) ( (b->start + b->total_size) - b->last)
@@ -41,7 +67,12 @@ static void* __stp_arg__ = NULL;
 #define CRLF   (u_char*)"\r\n"
 #define C_STMP_POLL_ERR         (-1)
 #define C_STMP_POLL_EXPIRE      (0)
-#define C_STMP_WRITE_CTR_AT_LF(fd)  send(fd, "\0\n", 2, 0)
+#define C_STMP_FRAME_END       (u_char*) "\0\n"
+#define C_STMP_FRAME_IOV_MAX   7
+#define C_STMP_BATCH_STACK_IOV 448
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 /***
 *  Sharing the socket for read and write will make the things split up
@@ -59,30 +90,18 @@ static void* __stp_arg__ = NULL;
 #define CSTMP_RELEASE_WRITING
 #endif
 
-#define CHECK_ERROR(n) \
-if(n<0){\
-if (errno == EWOULDBLOCK || errno == EINTR) {\
-continue;\
-}else if (errno != EAGAIN){\
-fprintf(stderr, "Error while process socket read/write: %s\n",strerror(errno));\
-tries=0;success=0;/*FAIL*/\
-}}
-
-#define CHECK_OR_GOTO(n, __step) \
-if(n<0){\
-if ((errno == EWOULDBLOCK || errno == EINTR) && tries--) {\
-goto __step;\
-}else if (errno != EAGAIN){\
-fprintf(stderr, "Error while process socket read/write: %s\n",strerror(errno));\
-tries=0;success=0;/*FAIL*/\
-}}
+#define CSTMP_RECV_OK       1
+#define CSTMP_RECV_AGAIN    0
+#define CSTMP_RECV_ERROR    (-1)
 
 #define FRAME_READ_RETURN(success) \
 CSTMP_RELEASE_READING;\
-if(!success){\
+if(success == CSTMP_RECV_ERROR){\
 fprintf(stderr, "%s\n", "Error, Invalid frame IO reading");\
 }return success;
 
+#define CSTMP_METRIC_ADD(sess, field, v) \
+if ((sess)->metrics) __atomic_fetch_add(&(sess)->metrics->field, (v), __ATOMIC_RELAXED)
 
 static const u_char *__cstmp_commands[16] = {
     (u_char*)"SEND",
@@ -118,49 +137,312 @@ cstmp_set_malloc_management(void* (*stp_alloc)(void* arg, size_t sz), void (*stp
 
 #define ROLLBACK_SESSION(sess) __cstmp_free__(__stp_arg__, sess);
 
-/*Default*/
-cstmp_session_t*
-cstmp_connect(const char *hostname, int port ) {
-    return cstmp_connect_t(hostname, port, 3000, 3000);
+static uint64_t _cstmp_now_ns();
+static char* _cstmp_strdup(const char *str);
+
+/**
+* Resolved broker addresses, shared by the sessions connecting to the same host and port
+* until the ttl expires. An entry is dropped when none of its addresses could be connected.
+**/
+#define CSTMP_ADDR_MAX            8
+#define CSTMP_CONNECT_STAGGER_MS  250 /* next candidate starts when the previous one is this late */
+
+typedef struct cstmp_addr_entry_s {
+    char *host;
+    int port;
+    struct sockaddr_storage addrs[CSTMP_ADDR_MAX];
+    socklen_t addrlens[CSTMP_ADDR_MAX];
+    size_t naddrs;
+    uint64_t expires;
+    struct cstmp_addr_entry_s *next;
+} cstmp_addr_entry_t;
+
+static pthread_mutex_t _cstmp_addr_lock = PTHREAD_MUTEX_INITIALIZER;
+static cstmp_addr_entry_t *_cstmp_addr_cache = NULL;
+static int _cstmp_addr_ttl_ms = 30000;
+
+void
+cstmp_set_addr_cache_ttl(int ttl_ms) {
+    _cstmp_addr_ttl_ms = ttl_ms > 0 ? ttl_ms : 0;
+    if (ttl_ms <= 0) {
+        cstmp_addr_cache_flush();
+    }
 }
 
-cstmp_session_t*
-cstmp_connect_t(const char *hostname, int port, int send_timeout, int recv_timeout ) {
-    int       connfd;
-    struct sockaddr_in *servaddr;
-    size_t sizeofaddr;
-    struct hostent *hostip;
-    cstmp_session_t* sess = NULL;
+static void
+_cstmp_addr_entry_free(cstmp_addr_entry_t *ent) {
+    if (ent->host)
+        __cstmp_free__(__stp_arg__, ent->host);
+    __cstmp_free__(__stp_arg__, ent);
+}
 
-    sess = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_session_t));
+void
+cstmp_addr_cache_flush() {
+    cstmp_addr_entry_t *ent;
+    pthread_mutex_lock(&_cstmp_addr_lock);
+    while ((ent = _cstmp_addr_cache) != NULL) {
+        _cstmp_addr_cache = ent->next;
+        _cstmp_addr_entry_free(ent);
+    }
+    pthread_mutex_unlock(&_cstmp_addr_lock);
+}
 
-    if (sess == NULL) {
-        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+static void
+_cstmp_addr_evict(const char *hostname, int port) {
+    cstmp_addr_entry_t **pp, *ent;
+    pthread_mutex_lock(&_cstmp_addr_lock);
+    for (pp = &_cstmp_addr_cache; (ent = *pp) != NULL; pp = &ent->next) {
+        if (ent->port == port && strcmp(ent->host, hostname) == 0) {
+            *pp = ent->next;
+            _cstmp_addr_entry_free(ent);
+            break;
+        }
     }
+    pthread_mutex_unlock(&_cstmp_addr_lock);
+}
 
-    servaddr = &sess->addr;
-    sizeofaddr = sizeof(sess->addr);
+/** Copy of the cached addresses into out, 0 when missing or expired **/
+static int
+_cstmp_addr_lookup(const char *hostname, int port, cstmp_addr_entry_t *out) {
+    cstmp_addr_entry_t *ent;
+    uint64_t now = _cstmp_now_ns();
+    int found = 0;
+    pthread_mutex_lock(&_cstmp_addr_lock);
+    for (ent = _cstmp_addr_cache; ent; ent = ent->next) {
+        if (ent->port == port && strcmp(ent->host, hostname) == 0) {
+            if (now < ent->expires) {
+                memcpy(out->addrs, ent->addrs, sizeof(ent->addrs));
+                memcpy(out->addrlens, ent->addrlens, sizeof(ent->addrlens));
+                out->naddrs = ent->naddrs;
+                found = 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_cstmp_addr_lock);
+    return found;
+}
 
-    if ( ( connfd = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 ) {
-        fprintf( stderr, "%s\n", "Error: Unable to create socket");
-        ROLLBACK_SESSION(sess);
-        return NULL;
+static void
+_cstmp_addr_store(const char *hostname, int port, const cstmp_addr_entry_t *res) {
+    cstmp_addr_entry_t *ent, **pp;
+    if (_cstmp_addr_ttl_ms == 0 || (ent = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_addr_entry_t))) == NULL) {
+        return;
+    }
+    *ent = *res;
+    ent->port = port;
+    ent->expires = _cstmp_now_ns() + (uint64_t) _cstmp_addr_ttl_ms * 1000000ull;
+    if ((ent->host = _cstmp_strdup(hostname)) == NULL) {
+        __cstmp_free__(__stp_arg__, ent);
+        return;
+    }
+    pthread_mutex_lock(&_cstmp_addr_lock);
+    /** replace the expired one, if any **/
+    for (pp = &_cstmp_addr_cache; *pp; pp = &(*pp)->next) {
+        if ((*pp)->port == port && strcmp((*pp)->host, hostname) == 0) {
+            ent->next = (*pp)->next;
+            _cstmp_addr_entry_free(*pp);
+            *pp = ent;
+            pthread_mutex_unlock(&_cstmp_addr_lock);
+            return;
+        }
     }
+    ent->next = _cstmp_addr_cache;
+    _cstmp_addr_cache = ent;
+    pthread_mutex_unlock(&_cstmp_addr_lock);
+}
 
-    // initialize the address
-    bzero(servaddr, sizeofaddr);
-    servaddr->sin_family = AF_INET;
-    servaddr->sin_port = htons(port);
-    // inet_pton(AF_INET, argv[1], &servaddr.sin_addr);
-    /* Connect to NR Stomp server */
-    if (!(hostip = gethostbyname(hostname)))
-    {
+/** getaddrinfo results with the families interleaved, IPv6 first, as happy eyeballs does **/
+static int
+_cstmp_resolve(const char *hostname, int port, cstmp_addr_entry_t *out) {
+    struct addrinfo hints, *res, *ai;
+    struct addrinfo *v6[CSTMP_ADDR_MAX], *v4[CSTMP_ADDR_MAX];
+    size_t n6 = 0, n4 = 0, i;
+    char service[16];
+    int rc;
+
+    if (_cstmp_addr_lookup(hostname, port, out)) {
+        return 1;
+    }
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    sprintf(service, "%d", port);
+    if ((rc = getaddrinfo(hostname, service, &hints, &res)) != 0) {
+        fprintf(stderr, "Unable to determine IP address of host %s: %s\n", hostname, gai_strerror(rc));
+        return 0;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == AF_INET6 && n6 < CSTMP_ADDR_MAX)
+            v6[n6++] = ai;
+        else if (ai->ai_family == AF_INET && n4 < CSTMP_ADDR_MAX)
+            v4[n4++] = ai;
+    }
+    out->naddrs = 0;
+    for (i = 0; (i < n6 || i < n4) && out->naddrs < CSTMP_ADDR_MAX; i++) {
+        if (i < n6) {
+            memcpy(&out->addrs[out->naddrs], v6[i]->ai_addr, v6[i]->ai_addrlen);
+            out->addrlens[out->naddrs++] = v6[i]->ai_addrlen;
+        }
+        if (i < n4 && out->naddrs < CSTMP_ADDR_MAX) {
+            memcpy(&out->addrs[out->naddrs], v4[i]->ai_addr, v4[i]->ai_addrlen);
+            out->addrlens[out->naddrs++] = v4[i]->ai_addrlen;
+        }
+    }
+    freeaddrinfo(res);
+    if (out->naddrs == 0) {
         fprintf(stderr, "Unable to determine IP address of host %s\n", hostname);
-        ROLLBACK_SESSION(sess);
-        return NULL;
+        return 0;
+    }
+    _cstmp_addr_store(hostname, port, out);
+    return 1;
+}
+
+/**
+* Connect n sockets to the candidate addresses at once with non-blocking connects. Each socket starts on
+* the first address and races the next one when it is still pending after the stagger (or failed),
+* the first to complete wins. fds[i] is the connected socket (blocking mode) or -1, returns how many connected.
+* timeout_ms <= 0 waits until every socket connected or ran out of addresses, like a blocking connect.
+**/
+static size_t
+_cstmp_connect_race(const cstmp_addr_entry_t *ent, int *fds, int *which, size_t n, int timeout_ms) {
+    struct pollfd *pfds = NULL;
+    size_t *owner = NULL, *owner_addr = NULL, *next = NULL, *pending = NULL, npfd = 0, nconnected = 0, i, j, k;
+    uint64_t *next_at = NULL, now, deadline, wake;
+    int fd, err, wait_ms, flags;
+    socklen_t errlen;
+
+    for (i = 0; i < n; i++) {
+        fds[i] = -1;
+    }
+    if (!n || (pfds = __cstmp_alloc__(__stp_arg__, n * ent->naddrs * sizeof(struct pollfd))) == NULL ||
+            (owner = __cstmp_alloc__(__stp_arg__, n * ent->naddrs * sizeof(size_t))) == NULL ||
+            (owner_addr = __cstmp_alloc__(__stp_arg__, n * ent->naddrs * sizeof(size_t))) == NULL ||
+            (next = __cstmp_alloc__(__stp_arg__, n * sizeof(size_t))) == NULL ||
+            (pending = __cstmp_alloc__(__stp_arg__, n * sizeof(size_t))) == NULL ||
+            (next_at = __cstmp_alloc__(__stp_arg__, n * sizeof(uint64_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        goto RACE_DONE;
+    }
+    bzero(next, n * sizeof(size_t));
+    bzero(pending, n * sizeof(size_t));
+    bzero(next_at, n * sizeof(uint64_t));
+    now = _cstmp_now_ns();
+    deadline = timeout_ms > 0 ? now + (uint64_t) timeout_ms * 1000000ull : UINT64_MAX;
+
+    for (;;) {
+        /** start what is due: first attempts, staggered races and replacements of failed ones **/
+        wake = deadline;
+        for (i = 0; i < n; i++) {
+            while (fds[i] < 0 && next[i] < ent->naddrs && (pending[i] == 0 || now >= next_at[i])) {
+                j = next[i]++;
+                next_at[i] = now + CSTMP_CONNECT_STAGGER_MS * 1000000ull;
+                if ((fd = socket(ent->addrs[j].ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+                    continue;
+                }
+                if (connect(fd, (struct sockaddr*) &ent->addrs[j], ent->addrlens[j]) == 0) {
+                    fds[i] = fd;
+                    which[i] = (int) j;
+                    nconnected++;
+                } else if (errno == EINPROGRESS) {
+                    pfds[npfd].fd = fd;
+                    pfds[npfd].events = POLLOUT;
+                    pfds[npfd].revents = 0;
+                    owner[npfd] = i;
+                    owner_addr[npfd++] = j;
+                    pending[i]++;
+                } else {
+                    close(fd);
+                }
+            }
+            if (fds[i] < 0 && pending[i] && next[i] < ent->naddrs && next_at[i] < wake) {
+                wake = next_at[i];
+            }
+        }
+        if (nconnected == n || npfd == 0 || now >= deadline) {
+            break;
+        }
+
+        wait_ms = wake == UINT64_MAX ? -1 : (int) ((wake - now + 999999) / 1000000);
+        if (poll(pfds, npfd, wait_ms) < 0 && errno != EINTR) {
+            fprintf(stderr, "Error while connecting: %s\n", strerror(errno));
+            break;
+        }
+        now = _cstmp_now_ns();
+
+        for (k = 0; k < npfd; k++) {
+            i = owner[k];
+            if (fds[i] >= 0 || !pfds[k].revents) {
+                continue;
+            }
+            err = 0;
+            errlen = sizeof(err);
+            if (getsockopt(pfds[k].fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0) {
+                close(pfds[k].fd);
+            } else {
+                fds[i] = pfds[k].fd;
+                which[i] = (int) owner_addr[k];
+                nconnected++;
+            }
+            pfds[k].fd = -1;
+            pending[i]--;
+        }
+        /** drop the finished attempts and the ones which lost the race **/
+        for (j = k = 0; k < npfd; k++) {
+            if (pfds[k].fd >= 0) {
+                if (fds[owner[k]] >= 0) {
+                    close(pfds[k].fd);
+                    pending[owner[k]]--;
+                    continue;
+                }
+                pfds[j] = pfds[k];
+                owner[j] = owner[k];
+                owner_addr[j++] = owner_addr[k];
+            }
+        }
+        npfd = j;
+    }
+
+    for (k = 0; k < npfd; k++) {
+        if (pfds[k].fd >= 0)
+            close(pfds[k].fd);
     }
+    for (i = 0; i < n; i++) {
+        if (fds[i] >= 0 && ((flags = fcntl(fds[i], F_GETFL, 0)) < 0 || fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK) != 0)) {
+            fprintf(stderr, "Error setting blocking mode on socket: %s\n", strerror(errno));
+            close(fds[i]);
+            fds[i] = -1;
+            nconnected--;
+        }
+    }
+
+RACE_DONE:
+    if (pfds)
+        __cstmp_free__(__stp_arg__, pfds);
+    if (owner)
+        __cstmp_free__(__stp_arg__, owner);
+    if (owner_addr)
+        __cstmp_free__(__stp_arg__, owner_addr);
+    if (next)
+        __cstmp_free__(__stp_arg__, next);
+    if (pending)
+        __cstmp_free__(__stp_arg__, pending);
+    if (next_at)
+        __cstmp_free__(__stp_arg__, next_at);
+    return nconnected;
+}
 
-    servaddr->sin_addr = *(struct in_addr *)hostip->h_addr;
+/** Session over the connected socket, closes connfd on failure **/
+static cstmp_session_t*
+_cstmp_session_open(int connfd, const struct sockaddr_storage *addr, socklen_t addrlen, int send_timeout, int recv_timeout) {
+    cstmp_session_t* sess = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_session_t));
+
+    if (sess == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        close(connfd);
+        return NULL;
+    }
 
     struct timeval send_tmout_val;
     send_tmout_val.tv_sec = send_timeout / 1000; // Default 1 sec time out
@@ -176,171 +458,448 @@ cstmp_connect_t(const char *hostname, int port, int send_timeout, int recv_timeo
                     sizeof(recv_tmout_val)) < 0)
         fprintf(stderr, "%s\n", "setsockopt recv_tmout_val failed\n");
 
-    if ( connect( connfd, ( struct sockaddr *  )servaddr, sizeofaddr ) < 0 ) {
-        fprintf( stderr, "Error: unable to connect to %s:%d\n", hostname, port);
-        ROLLBACK_SESSION(sess);
-        return NULL;
-    }
-
+    memcpy(&sess->addr, addr, addrlen);
+    sess->addrlen = addrlen;
     sess->sock = connfd;
 #ifdef CSTOMP_READ_WRITE_SHR_LOCK
     sess->read_lock = 0;
     sess->write_lock = 0;
-    
 #else
-    fprintf(stderr, "%s\n", "Not allowed Read write sharing");   
+    fprintf(stderr, "%s\n", "Not allowed Read write sharing");
 #endif
     sess->send_timeout = send_timeout;
     sess->recv_timeout = recv_timeout;
+    bzero(&sess->rbuf, sizeof(cstmp_read_buf_t));
+    sess->nonblocking = 0;
+    sess->loop_conn = NULL;
+    sess->loop_drain = NULL;
+    sess->pool_slot = -1;
+    sess->writer = NULL;
+    sess->hb_send_ms = sess->hb_recv_ms = 0;
+    sess->hb_send_tfd = sess->hb_recv_tfd = -1;
+    sess->hb_sent = sess->hb_recvd = sess->hb_dead = 0;
+    sess->metrics = NULL;
+    sess->codec = NULL;
 
-    // int flags = fcntl(connfd, F_GETFL, 0);
-    // flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
-    // if (fcntl(connfd, F_SETFL, flags) != 0)
-    // {
-    //     fprintf(stderr, "Error setting non-blocking mode on socket: %s\n",
-    //             strerror(errno));
-    //     return NULL;
-    // }
+    return sess;
+}
 
-    // sess->pfds[0].fd = connfd;
-    // sess->pfds[0].events = POLLIN | POLLOUT;
+/*Default*/
+cstmp_session_t*
+cstmp_connect(const char *hostname, int port ) {
+    return cstmp_connect_t(hostname, port, 3000, 3000);
+}
 
-    return sess;
+/** The connect is bounded by send_timeout, as SO_SNDTIMEO did for the blocking connect **/
+cstmp_session_t*
+cstmp_connect_t(const char *hostname, int port, int send_timeout, int recv_timeout ) {
+    return cstmp_connect_tc(hostname, port, send_timeout, recv_timeout, send_timeout);
 }
 
-/**To create new socket, prevent concurrent issue**/
 cstmp_session_t*
-cstmp_new_session( cstmp_session_t* curr_sess ) {
-    int       connfd;
-    struct sockaddr_in *servaddr;
-    cstmp_session_t* sess = NULL;
-    int send_timeout = curr_sess->send_timeout,
-        recv_timeout = curr_sess->recv_timeout;
+cstmp_connect_tc(const char *hostname, int port, int send_timeout, int recv_timeout, int connect_timeout) {
+    cstmp_session_t *sess = NULL;
+    if (cstmp_connect_bulk(hostname, port, &sess, 1, send_timeout, recv_timeout, connect_timeout) != 1) {
+        return NULL;
+    }
+    return sess;
+}
 
-    sess = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_session_t));
+size_t
+cstmp_connect_bulk(const char *hostname, int port, cstmp_session_t **sessions, size_t n,
+                   int send_timeout, int recv_timeout, int connect_timeout) {
+    cstmp_addr_entry_t ent;
+    int *fds;
+    size_t i, nconnected;
 
-    if (sess == NULL) {
+    if (!hostname || !sessions || !n) {
+        fprintf(stderr, "%s\n", "Invalid connect arguments");
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        sessions[i] = NULL;
+    }
+    if (!_cstmp_resolve(hostname, port, &ent)) {
+        return 0;
+    }
+    /** socket and its winning address index **/
+    if ((fds = __cstmp_alloc__(__stp_arg__, 2 * n * sizeof(int))) == NULL) {
         fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return 0;
     }
+    if ((nconnected = _cstmp_connect_race(&ent, fds, fds + n, n, connect_timeout)) == 0) {
+        fprintf( stderr, "Error: unable to connect to %s:%d\n", hostname, port);
+        /** the cached addresses may be stale **/
+        _cstmp_addr_evict(hostname, port);
+    }
+    for (i = 0; i < n; i++) {
+        if (fds[i] >= 0 &&
+                (sessions[i] = _cstmp_session_open(fds[i], &ent.addrs[fds[n + i]], ent.addrlens[fds[n + i]], send_timeout, recv_timeout)) == NULL) {
+            nconnected--;
+        }
+    }
+    __cstmp_free__(__stp_arg__, fds);
+    return nconnected;
+}
 
+/**To create new socket, prevent concurrent issue**/
+cstmp_session_t*
+cstmp_new_session( cstmp_session_t* curr_sess ) {
+    cstmp_addr_entry_t ent;
+    int connfd, which;
 
-    if ( ( connfd = socket( AF_INET, SOCK_STREAM, 0 ) ) == -1 ) {
-        fprintf( stderr, "%s\n", "Error: Unable to create socket");
-        ROLLBACK_SESSION(sess);
+    ent.naddrs = 1;
+    ent.addrs[0] = curr_sess->addr;
+    ent.addrlens[0] = curr_sess->addrlen;
+    if (_cstmp_connect_race(&ent, &connfd, &which, 1, curr_sess->send_timeout) != 1) {
+        fprintf( stderr, "Error: unable to connect while creating new session\n");
         return NULL;
     }
+    return _cstmp_session_open(connfd, &curr_sess->addr, curr_sess->addrlen, curr_sess->send_timeout, curr_sess->recv_timeout);
+}
 
+/** Session over an already connected socket (accepted, socketpair...), the session owns fd from now on **/
+cstmp_session_t*
+cstmp_session_from_fd(int fd, int send_timeout, int recv_timeout) {
+    cstmp_session_t* sess;
+    socklen_t addrlen;
+    struct timeval tmout_val;
 
-    if ( connect( connfd, ( struct sockaddr *  )&curr_sess->addr, sizeof(curr_sess->addr) ) < 0 ) {
-        fprintf( stderr, "Error: unable to connect while creating new session\n");
-        ROLLBACK_SESSION(sess);
+    if (fd < 0) {
+        fprintf( stderr, "%s\n", "Error: Invalid socket");
         return NULL;
     }
+    if ((sess = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_session_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(sess, sizeof(cstmp_session_t));
+    addrlen = sizeof(sess->addr);
+    getpeername(fd, (struct sockaddr*) &sess->addr, &addrlen);
+    sess->addrlen = addrlen;
 
-    struct timeval send_tmout_val;
-    send_tmout_val.tv_sec = send_timeout / 1000; // Default 1 sec time out
-    send_tmout_val.tv_usec = (send_timeout % 1000) * 1000 ;
-    if (setsockopt (connfd, SOL_SOCKET, SO_SNDTIMEO, &send_tmout_val,
-                    sizeof(send_tmout_val)) < 0)
+    tmout_val.tv_sec = send_timeout / 1000;
+    tmout_val.tv_usec = (send_timeout % 1000) * 1000 ;
+    if (setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tmout_val, sizeof(tmout_val)) < 0)
         fprintf(stderr, "%s\n", "setsockopt send_tmout_val failed\n");
-
-    struct timeval recv_tmout_val;
-    recv_tmout_val.tv_sec = recv_timeout / 1000; // Default 1 sec time out
-    recv_tmout_val.tv_usec = (recv_timeout % 1000) * 1000 ;
-    if (setsockopt (connfd, SOL_SOCKET, SO_RCVTIMEO, &recv_tmout_val,
-                    sizeof(recv_tmout_val)) < 0)
+    tmout_val.tv_sec = recv_timeout / 1000;
+    tmout_val.tv_usec = (recv_timeout % 1000) * 1000 ;
+    if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tmout_val, sizeof(tmout_val)) < 0)
         fprintf(stderr, "%s\n", "setsockopt recv_tmout_val failed\n");
 
-    sess->addr = sess->addr;
-    sess->sock = connfd;
-#ifdef CSTOMP_READ_WRITE_SHR_LOCK
-    sess->read_lock = 0;
-    sess->write_lock = 0;
-#else
-    fprintf(stderr, "%s\n", "Not allowed Read write sharing");    
-#endif
+    sess->sock = fd;
     sess->send_timeout = send_timeout;
     sess->recv_timeout = recv_timeout;
-
+    sess->pool_slot = -1;
+    sess->hb_send_tfd = sess->hb_recv_tfd = -1;
     return sess;
 }
 
+static void _cstmp_codec_free(struct cstmp_codec_s *c);
+
 /** Do take note that if you disc the session, the frame instance is not longer valid **/
 void
 cstmp_disconnect(cstmp_session_t* stp_sess) {
     if (stp_sess) {
+        if (stp_sess->writer)
+            cstmp_writer_stop(stp_sess);
+        if (stp_sess->hb_send_ms > 0)
+            close(stp_sess->hb_send_tfd);
+        if (stp_sess->hb_recv_ms > 0)
+            close(stp_sess->hb_recv_tfd);
+        if (stp_sess->loop_drain)
+            ((cstmp_loop_conn_t*) stp_sess->loop_drain)->sess = NULL;
         shutdown(stp_sess->sock, SHUT_RDWR);
         close(stp_sess->sock);
+        if (stp_sess->rbuf.start)
+            __cstmp_free__(__stp_arg__, stp_sess->rbuf.start);
+        if (stp_sess->rbuf.scan.hidx.elts)
+            __cstmp_free__(__stp_arg__, stp_sess->rbuf.scan.hidx.elts);
+        if (stp_sess->metrics)
+            __cstmp_free__(__stp_arg__, stp_sess->metrics);
+        if (stp_sess->codec)
+            _cstmp_codec_free(stp_sess->codec);
         __cstmp_free__(__stp_arg__, stp_sess);
     }
 }
 
+/** Frame struct, header and body buffer come in one allocation, the inline buffers are never freed alone **/
+#define cstmp_frame_inline_hdr(fr)  ((u_char*) ((fr) + 1))
+#define cstmp_frame_inline_body(fr) (cstmp_frame_inline_hdr(fr) + cstmp_def_header_size)
+#define cstmp_buf_free(b) if ((b)->start && !((b)->flags & (CSTMP_BUF_LENT|CSTMP_BUF_INLINE))) __cstmp_free__(__stp_arg__, (b)->start)
+
+static void
+_cstmp_frame_inline_hdr(cstmp_frame_t *fr) {
+    fr->headers.start = fr->headers.last = cstmp_frame_inline_hdr(fr);
+    fr->headers.total_size = cstmp_def_header_size;
+    fr->headers.flags = CSTMP_BUF_INLINE;
+    *fr->headers.start = '\0';
+}
+
+static void
+_cstmp_frame_inline_body(cstmp_frame_t *fr) {
+    fr->body.start = fr->body.last = cstmp_frame_inline_body(fr);
+    fr->body.total_size = cstmp_def_message_size;
+    fr->body.flags = CSTMP_BUF_INLINE;
+    *fr->body.start = '\0';
+}
+
 cstmp_frame_t*
 cstmp_new_frame() {
-    cstmp_frame_buf_t *headers, *body;
-
-    cstmp_frame_t *fr =  __cstmp_alloc__(__stp_arg__, sizeof(cstmp_frame_t));
+    cstmp_frame_t *fr =  __cstmp_alloc__(__stp_arg__, sizeof(cstmp_frame_t) +
+                                         (cstmp_def_header_size + cstmp_def_message_size) * sizeof(u_char));
     if (fr == NULL) {
         return NULL;
     }
     fr->cmd = "";
-    headers = &fr->headers;
-    body = &fr->body;
-    headers->start = headers->last = __cstmp_alloc__(__stp_arg__, cstmp_def_header_size * sizeof(u_char));
-    if (headers->start == NULL) {
+    fr->cmd_id = CSTMP_CMD_UNKNOWN;
+    fr->sess = NULL;
+    fr->body_file.fd = -1;
+    bzero(&fr->hidx, sizeof(cstmp_header_index_t));
+    bzero(&fr->hdr_esc, sizeof(cstmp_frame_buf_t));
+    bzero(&fr->body_own, sizeof(cstmp_frame_buf_t));
+    _cstmp_frame_inline_hdr(fr);
+    _cstmp_frame_inline_body(fr);
+    return fr;
+}
+
+/** Extra malloc and free customization **/
+void
+cstmp_destroy_frame(cstmp_frame_t *fr) {
+    if (fr) {
+        cstmp_buf_free(&fr->headers);
+        if (fr->body.flags & CSTMP_BUF_LENT)
+            fr->body = fr->body_own;
+        cstmp_buf_free(&fr->body);
+        if (fr->hidx.elts)
+            __cstmp_free__(__stp_arg__, fr->hidx.elts);
+        if (fr->hidx.slots)
+            __cstmp_free__(__stp_arg__, fr->hidx.slots);
+        cstmp_buf_free(&fr->hdr_esc);
         __cstmp_free__(__stp_arg__, fr);
-        return NULL;
     }
-    headers->total_size = cstmp_def_header_size;
+}
 
-    body->start = body->last = __cstmp_alloc__(__stp_arg__, cstmp_def_message_size * sizeof(u_char));
-    if (body->start == NULL) {
-        __cstmp_free__(__stp_arg__, headers->start );
-        __cstmp_free__(__stp_arg__, fr);
+/** Give back grown buffers so a cached frame holds at most trim_size per buffer **/
+static void
+_cstmp_frame_trim(cstmp_frame_t *fr, size_t trim_size) {
+    if (fr->headers.total_size > trim_size && !(fr->headers.flags & CSTMP_BUF_INLINE)) {
+        cstmp_buf_free(&fr->headers);
+        _cstmp_frame_inline_hdr(fr);
+    }
+    if (fr->body.total_size > trim_size && !(fr->body.flags & CSTMP_BUF_INLINE)) {
+        cstmp_buf_free(&fr->body);
+        _cstmp_frame_inline_body(fr);
+    }
+    if (fr->hdr_esc.total_size > trim_size) {
+        cstmp_buf_free(&fr->hdr_esc);
+        bzero(&fr->hdr_esc, sizeof(cstmp_frame_buf_t));
+    }
+    if (fr->hidx.nalloc * sizeof(cstmp_header_t) > trim_size) {
+        __cstmp_free__(__stp_arg__, fr->hidx.elts);
+        if (fr->hidx.slots)
+            __cstmp_free__(__stp_arg__, fr->hidx.slots);
+        bzero(&fr->hidx, sizeof(cstmp_header_index_t));
+    }
+}
+
+/** Move frames from a thread cache to the shared list, the ones over max_cached are destroyed **/
+static void
+_cstmp_frame_pool_spill(cstmp_frame_pool_t *pool, cstmp_frame_pool_cache_t *cache, size_t n) {
+    pthread_mutex_lock(&pool->lock);
+    while (n-- && cache->count) {
+        cstmp_frame_t *fr = cache->frames[--cache->count];
+        if (pool->nshared < pool->max_cached) {
+            pool->shared[pool->nshared++] = fr;
+        } else {
+            cstmp_destroy_frame(fr);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void
+_cstmp_frame_pool_unlink(cstmp_frame_pool_t *pool, cstmp_frame_pool_cache_t *cache) {
+    pthread_mutex_lock(&pool->lock);
+    if (cache->prev) cache->prev->next = cache->next;
+    else pool->caches = cache->next;
+    if (cache->next) cache->next->prev = cache->prev;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/** thread exit, hand the cached frames to the shared list **/
+static void
+_cstmp_frame_pool_tls_destroy(void *arg) {
+    cstmp_frame_pool_cache_t *cache = arg;
+    cstmp_frame_pool_t *pool = cache->pool;
+    _cstmp_frame_pool_spill(pool, cache, cache->count);
+    _cstmp_frame_pool_unlink(pool, cache);
+    __cstmp_free__(__stp_arg__, cache);
+}
+
+static cstmp_frame_pool_cache_t*
+_cstmp_frame_pool_cache(cstmp_frame_pool_t *pool) {
+    cstmp_frame_pool_cache_t *cache = pthread_getspecific(pool->tls_key);
+    if (cache == NULL) {
+        if ((cache = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_frame_pool_cache_t))) == NULL) {
+            return NULL;
+        }
+        cache->pool = pool;
+        cache->count = 0;
+        cache->prev = NULL;
+        pthread_mutex_lock(&pool->lock);
+        if ((cache->next = pool->caches) != NULL) {
+            cache->next->prev = cache;
+        }
+        pool->caches = cache;
+        pthread_mutex_unlock(&pool->lock);
+        pthread_setspecific(pool->tls_key, cache);
+    }
+    return cache;
+}
+
+cstmp_frame_pool_t*
+cstmp_frame_pool_create(size_t max_cached, size_t trim_size) {
+    cstmp_frame_pool_t *pool = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_frame_pool_t));
+    if (pool == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    pool->max_cached = max_cached ? max_cached : 1024;
+    pool->trim_size = trim_size ? trim_size : cstmp_def_read_buf_size;
+    pool->nshared = 0;
+    pool->caches = NULL;
+    if ((pool->shared = __cstmp_alloc__(__stp_arg__, pool->max_cached * sizeof(cstmp_frame_t*))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        __cstmp_free__(__stp_arg__, pool);
+        return NULL;
+    }
+    if (pthread_key_create(&pool->tls_key, _cstmp_frame_pool_tls_destroy) != 0) {
+        fprintf( stderr, "%s\n", "Error: Unable to create frame pool thread key");
+        __cstmp_free__(__stp_arg__, pool->shared);
+        __cstmp_free__(__stp_arg__, pool);
         return NULL;
     }
-    body->total_size = cstmp_def_message_size;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
 
-    return fr;
+cstmp_frame_t*
+cstmp_frame_pool_acquire(cstmp_frame_pool_t *pool) {
+    cstmp_frame_pool_cache_t *cache;
+    size_t n;
+
+    if ((cache = _cstmp_frame_pool_cache(pool)) == NULL) {
+        return cstmp_new_frame();
+    }
+    if (cache->count == 0) {
+        /** refill half of the cache in one lock **/
+        pthread_mutex_lock(&pool->lock);
+        for (n = CSTMP_FRAME_POOL_TLS_CACHE / 2; n && pool->nshared; n--) {
+            cache->frames[cache->count++] = pool->shared[--pool->nshared];
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (cache->count == 0) {
+            return cstmp_new_frame();
+        }
+    }
+    return cache->frames[--cache->count];
 }
 
-/** Extra malloc and free customization **/
 void
-cstmp_destroy_frame(cstmp_frame_t *fr) {
-    if (fr) {
-        if (fr->headers.start)
-            __cstmp_free__(__stp_arg__, fr->headers.start);
-        if (fr->body.start)
-            __cstmp_free__(__stp_arg__, fr->body.start);
-        __cstmp_free__(__stp_arg__, fr);
+cstmp_frame_pool_release(cstmp_frame_pool_t *pool, cstmp_frame_t *fr) {
+    cstmp_frame_pool_cache_t *cache;
+
+    if (!fr) {
+        return;
+    }
+    cstmp_reset_frame(fr);
+    _cstmp_frame_trim(fr, pool->trim_size);
+
+    if ((cache = _cstmp_frame_pool_cache(pool)) == NULL) {
+        cstmp_destroy_frame(fr);
+        return;
+    }
+    if (cache->count == CSTMP_FRAME_POOL_TLS_CACHE) {
+        _cstmp_frame_pool_spill(pool, cache, CSTMP_FRAME_POOL_TLS_CACHE / 2);
+    }
+    cache->frames[cache->count++] = fr;
+}
+
+void
+cstmp_frame_pool_destroy(cstmp_frame_pool_t *pool) {
+    cstmp_frame_pool_cache_t *cache, *next;
+    if (pool) {
+        pthread_setspecific(pool->tls_key, NULL);
+        pthread_key_delete(pool->tls_key);
+        for (cache = pool->caches; cache; cache = next) {
+            next = cache->next;
+            while (cache->count) {
+                cstmp_destroy_frame(cache->frames[--cache->count]);
+            }
+            __cstmp_free__(__stp_arg__, cache);
+        }
+        while (pool->nshared) {
+            cstmp_destroy_frame(pool->shared[--pool->nshared]);
+        }
+        pthread_mutex_destroy(&pool->lock);
+        __cstmp_free__(__stp_arg__, pool->shared);
+        __cstmp_free__(__stp_arg__, pool);
     }
 }
 
+static uint64_t _cstmp_buf_grows;
+
 static int
 _cstmp_reload_buf_size (cstmp_frame_buf_t * buf, size_t needed_size) {
-    size_t new_size = buf->total_size;
+    size_t new_size = buf->total_size ? buf->total_size : cstmp_def_message_size;
     do {
         new_size *= 2;
     } while (new_size < needed_size);
 
     u_char *last, *start =  __cstmp_alloc__(__stp_arg__, new_size * sizeof(u_char) );
-    last = cstmp_cpymem(start, buf->start, cstmp_buf_size(buf));
-    __cstmp_free__(__stp_arg__, buf->start ); // remove the old buf
+    if (start == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return 0;
+    }
+    last = buf->start ? cstmp_cpymem(start, buf->start, cstmp_buf_size(buf)) : start;
+    cstmp_buf_free(buf); // remove the old buf
+    __atomic_fetch_add(&_cstmp_buf_grows, 1, __ATOMIC_RELAXED);
     buf->start = start;
     buf->last = last;
     buf->total_size = new_size;
+    buf->flags = 0;
     return 1;
 }
 
 static int
-_cstmp_add_buf(cstmp_frame_buf_t * buf, const u_char *val, size_t val_len) {
-    if ( ( cstmp_buf_size(buf) + val_len) >  buf->total_size ) {
-        _cstmp_reload_buf_size(buf, cstmp_buf_size(buf) + val_len/*for : and LF and \0*/);
+_cstmp_buf_reserve(cstmp_frame_buf_t *buf, size_t needed_size) {
+    if (needed_size > buf->total_size) {
+        return _cstmp_reload_buf_size(buf, needed_size);
     }
-    buf->last = cstmp_cpymem(buf->last, val, val_len);
     return 1;
 }
 
+/** Body goes to the lent buffer if it fits, otherwise back to the frame own buffer **/
+static int
+_cstmp_body_reserve(cstmp_frame_t *fr, size_t needed_size) {
+    if (needed_size <= fr->body.total_size) {
+        return 1;
+    }
+    if (fr->body.flags & CSTMP_BUF_LENT) {
+        /** keep what is already in the lent buffer **/
+        u_char *lent = fr->body.start;
+        size_t lent_len = cstmp_buf_size((&fr->body));
+        fr->body = fr->body_own;
+        if (!_cstmp_buf_reserve(&fr->body, needed_size)) {
+            return 0;
+        }
+        fr->body.last = cstmp_cpymem(fr->body.start, lent, lent_len);
+        return 1;
+    }
+    return _cstmp_buf_reserve(&fr->body, needed_size);
+}
+
 int
 cstmp_add_header_str(cstmp_frame_t *fr, const u_char *keyval) {
     cstmp_frame_buf_t *headers;
@@ -417,11 +976,12 @@ cstmp_add_body_content(cstmp_frame_t *fr, u_char* content) {
     body_len = strlen(content);
     body = &fr->body;
 
-    if ( ( cstmp_buf_size(body) + body_len ) >  body->total_size ) {
-        _cstmp_reload_buf_size(body, cstmp_buf_size(body) + body_len);
+    if (!_cstmp_body_reserve(fr, cstmp_buf_size(body) + body_len + 1)) {
+        return 0;
     }
 
     body->last = cstmp_cpymem(body->last, content, body_len);
+    *body->last = '\0';
     return 1;
 }
 
@@ -433,11 +993,12 @@ cstmp_add_body_content_and_len(cstmp_frame_t *fr, u_char* content, size_t conten
 
     body = &fr->body;
 
-    if ( ( cstmp_buf_size(body) + content_len ) >  body->total_size ) {
-        _cstmp_reload_buf_size(body, cstmp_buf_size(body) + content_len);
+    if (!_cstmp_body_reserve(fr, cstmp_buf_size(body) + content_len + 1)) {
+        return 0;
     }
 
     body->last = cstmp_cpymem(body->last, content, content_len);
+    *body->last = '\0';
     return 1;
 }
 
@@ -449,45 +1010,421 @@ cstmp_get_cmd(cstmp_frame_t *fr) {
     return "";
 }
 
-int
-cstmp_get_header(cstmp_frame_t *fr, const u_char *key, cstmp_frame_val_t *hdr_val) {
-    size_t klen = key ? strlen(key) : 0;
-    u_char *ret = fr->headers.start;
-    while ( ret = strstr(ret, key) ) {
-        ret = ret + klen;
-        if ( *ret == ':' ) break;
+#define cstmp_hash_init         2166136261u
+#define cstmp_hash(h, c)        (((h) ^ (u_char) (c)) * 16777619u)
+
+static uint32_t
+cstmp_hash_key(const u_char *key, size_t len) {
+    uint32_t h = cstmp_hash_init;
+    while (len--) {
+        h = cstmp_hash(h, *key++);
     }
+    return h;
+}
 
-    if (ret) {
-        hdr_val->data = ++ret;
-        hdr_val->len = ((u_char*)strchr(hdr_val->data, LF_CHAR)) - hdr_val->data;
-        return 1;
-    } else {
-        hdr_val->data = NULL;
-        hdr_val->len = 0;
-        return 0;
+/**
+* Header delimiter scan, first LF or ':' in [p, end). SSE2 takes 16 bytes and AVX2 32 bytes per compare,
+* picked once at runtime, the scalar one covers the tails and non x86 builds.
+**/
+static u_char*
+_cstmp_scan_delim_scalar(u_char *p, u_char *end) {
+    for (; p < end; p++) {
+        if (*p == LF_CHAR || *p == ':') {
+            return p;
+        }
     }
+    return NULL;
 }
 
-void
-cstmp_get_body(cstmp_frame_t *fr, cstmp_frame_val_t *body_val) {
-    body_val->data = fr->body.start;
-    body_val->len = cstmp_buf_size((&fr->body));
+#ifdef CSTOMP_SIMD_X86
+static u_char*
+_cstmp_scan_delim_sse2(u_char *p, u_char *end) {
+    const __m128i lf = _mm_set1_epi8('\n'), colon = _mm_set1_epi8(':');
+    __m128i v;
+    int m;
+    while (end - p >= 16) {
+        v = _mm_loadu_si128((const __m128i*) p);
+        m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, colon)));
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+        p += 16;
+    }
+    return _cstmp_scan_delim_scalar(p, end);
 }
 
-static void
-cstmp_parse_cmd(cstmp_frame_t *fr, u_char* cmd) {
-    static size_t cmd_size = sizeof(__cstmp_commands) / sizeof(u_char*) - 1;
-    u_char **cmds = (u_char**) __cstmp_commands;
-    int i;
-    fr->cmd = ""; // empty cmd by default
+__attribute__((target("avx2")))
+static u_char*
+_cstmp_scan_delim_avx2(u_char *p, u_char *end) {
+    const __m256i lf = _mm256_set1_epi8('\n'), colon = _mm256_set1_epi8(':');
+    __m256i v;
+    unsigned m;
+    while (end - p >= 32) {
+        v = _mm256_loadu_si256((const __m256i*) p);
+        m = (unsigned) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, colon)));
+        if (m) {
+            return p + __builtin_ctz(m);
+        }
+        p += 32;
+    }
+    return _cstmp_scan_delim_sse2(p, end);
+}
+#endif
 
-    /***only 15 valid commands*/
-    for (i = 0; i < cmd_size; i++) {
-        if (strcmp(cmds[i], cmd) == 0) {
-            fr->cmd = cmds[i];
-            break;
+static u_char* _cstmp_scan_delim_init(u_char *p, u_char *end);
+static u_char* (*_cstmp_scan_delim)(u_char *p, u_char *end) = _cstmp_scan_delim_init;
+
+static u_char*
+_cstmp_scan_delim_init(u_char *p, u_char *end) {
+    u_char* (*scan)(u_char *p, u_char *end) = _cstmp_scan_delim_scalar;
+#ifdef CSTOMP_SIMD_X86
+    __builtin_cpu_init();
+    scan = __builtin_cpu_supports("avx2") ? _cstmp_scan_delim_avx2 : _cstmp_scan_delim_sse2;
+#endif
+    __atomic_store_n(&_cstmp_scan_delim, scan, __ATOMIC_RELAXED);
+    return scan(p, end);
+}
+
+/** Returns the LF ending the header line which starts at line, *colon gets its first ':' or NULL **/
+static u_char*
+_cstmp_scan_line(u_char *line, u_char *end, u_char **colon) {
+    u_char *d = __atomic_load_n(&_cstmp_scan_delim, __ATOMIC_RELAXED)(line, end);
+    *colon = NULL;
+    if (d && *d == ':') {
+        *colon = d;
+        /** the rest of the line only needs the LF, values may hold raw colons **/
+        d = memchr(d + 1, LF_CHAR, (size_t) (end - d - 1));
+    }
+    return d;
+}
+
+/** Entries are dropped, the slots are cleared on the next lookup **/
+#define cstmp_hidx_reset(hidx) (hidx)->nelts = (hidx)->indexed = (hidx)->nhashed = 0
+
+static cstmp_header_t*
+_cstmp_header_index_push(cstmp_header_index_t *hidx) {
+    size_t nalloc;
+    cstmp_header_t *elts;
+    if (hidx->nelts == hidx->nalloc) {
+        nalloc = hidx->nalloc ? hidx->nalloc * 2 : 16;
+        if ((elts = __cstmp_alloc__(__stp_arg__, nalloc * sizeof(cstmp_header_t))) == NULL) {
+            fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+            return NULL;
+        }
+        if (hidx->nelts) {
+            memcpy(elts, hidx->elts, hidx->nelts * sizeof(cstmp_header_t));
+        }
+        if (hidx->elts) {
+            __cstmp_free__(__stp_arg__, hidx->elts);
+        }
+        hidx->elts = elts;
+        hidx->nalloc = nalloc;
+    }
+    return &hidx->elts[hidx->nelts++];
+}
+
+#define cstmp_hdr_is(key, len, lit)  ((len) == sizeof(lit) - 1 && memcmp(key, lit, sizeof(lit) - 1) == 0)
+
+/** Intern the well known keys by length and first byte, anything else is CSTMP_HDR_OTHER **/
+static cstmp_header_id_t
+cstmp_header_id(const u_char *key, size_t len) {
+    switch (len) {
+    case 3:
+        return cstmp_hdr_is(key, len, "ack") ? CSTMP_HDR_ACK : CSTMP_HDR_OTHER;
+    case 10:
+        if (key[0] == 'm')
+            return cstmp_hdr_is(key, len, "message-id") ? CSTMP_HDR_MESSAGE_ID : CSTMP_HDR_OTHER;
+        return cstmp_hdr_is(key, len, "receipt-id") ? CSTMP_HDR_RECEIPT_ID : CSTMP_HDR_OTHER;
+    case 11:
+        return cstmp_hdr_is(key, len, "destination") ? CSTMP_HDR_DESTINATION : CSTMP_HDR_OTHER;
+    case 12:
+        if (key[0] == 's')
+            return cstmp_hdr_is(key, len, "subscription") ? CSTMP_HDR_SUBSCRIPTION : CSTMP_HDR_OTHER;
+        return cstmp_hdr_is(key, len, "content-type") ? CSTMP_HDR_CONTENT_TYPE : CSTMP_HDR_OTHER;
+    case 14:
+        return cstmp_hdr_is(key, len, "content-length") ? CSTMP_HDR_CONTENT_LENGTH : CSTMP_HDR_OTHER;
+    default:
+        return CSTMP_HDR_OTHER;
+    }
+}
+
+/** Index one header line [line, line+line_len) without the EOL, base is the header block start, colon from the scan **/
+static cstmp_header_t*
+_cstmp_header_index_line(cstmp_header_index_t *hidx, u_char *base, u_char *line, size_t line_len, u_char *colon) {
+    cstmp_header_t *h;
+
+    if ((h = _cstmp_header_index_push(hidx)) == NULL) {
+        return NULL;
+    }
+    h->key_off = (uint32_t) (line - base);
+    h->key_len = (uint32_t) (colon ? (size_t) (colon - line) : line_len);
+    h->val_off = h->key_off + h->key_len + (colon ? 1 : 0);
+    h->val_len = (uint32_t) (colon ? line_len - h->key_len - 1 : 0);
+    h->hash = cstmp_hash_key(line, h->key_len);
+    h->id = (uint16_t) cstmp_header_id(line, h->key_len);
+    h->flags = (h->val_len && memchr(base + h->val_off, '\\', h->val_len)) ? CSTMP_HDR_ESCAPED : 0;
+    return h;
+}
+
+/** Index the header lines appended since the last lookup, outgoing frame headers are indexed lazily **/
+static int
+_cstmp_header_index_pending(cstmp_frame_t *fr) {
+    cstmp_header_index_t *hidx = &fr->hidx;
+    u_char *base = fr->headers.start, *line, *nl, *colon, *end = fr->headers.last;
+    size_t line_len;
+
+    line = base + hidx->indexed;
+    while (line < end && (nl = _cstmp_scan_line(line, end, &colon)) != NULL) {
+        line_len = (size_t) (nl - line);
+        if (line_len && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        if (line_len && !_cstmp_header_index_line(hidx, base, line, line_len, colon)) {
+            return 0;
+        }
+        line = nl + 1;
+    }
+    hidx->indexed = (size_t) (line - base);
+    return 1;
+}
+
+/** STOMP 1.2 escapes (\\r \\n \\c \\\\) are decoded into hdr_esc, CONNECT and CONNECTED frames are not escaped **/
+static int
+_cstmp_header_decode(cstmp_frame_t *fr, cstmp_header_t *h) {
+    cstmp_frame_buf_t *esc = &fr->hdr_esc;
+    cstmp_cmd_t cmd_id = cstmp_get_cmd_id(fr);
+    u_char *src, *end, *dst;
+
+    if (cmd_id == CSTMP_CMD_CONNECT || cmd_id == CSTMP_CMD_CONNECTED) {
+        h->flags &= ~CSTMP_HDR_ESCAPED;
+        return 1;
+    }
+
+    if (esc->start == NULL) {
+        if ((esc->start = esc->last = __cstmp_alloc__(__stp_arg__, cstmp_def_header_size * sizeof(u_char))) == NULL) {
+            fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+            return 0;
+        }
+        esc->total_size = cstmp_def_header_size;
+    }
+    if (!_cstmp_buf_reserve(esc, cstmp_buf_size(esc) + h->val_len + 1)) {
+        return 0;
+    }
+
+    src = fr->headers.start + h->val_off;
+    end = src + h->val_len;
+    dst = esc->last;
+    while (src < end) {
+        if (*src == '\\' && src + 1 < end) {
+            switch (*++src) {
+            case 'n': *dst++ = '\n'; break;
+            case 'r': *dst++ = '\r'; break;
+            case 'c': *dst++ = ':'; break;
+            default: *dst++ = *src; break;
+            }
+            src++;
+        } else {
+            *dst++ = *src++;
+        }
+    }
+    h->val_off = (uint32_t) (esc->last - esc->start);
+    h->val_len = (uint32_t) (dst - esc->last);
+    h->flags = (h->flags & ~CSTMP_HDR_ESCAPED) | CSTMP_HDR_DECODED;
+    *dst++ = '\0';
+    esc->last = dst;
+    return 1;
+}
+
+#define cstmp_hdr_key_eq(base, h, key, len) \
+    ((h)->key_len == (len) && memcmp((base) + (h)->key_off, key, len) == 0)
+
+/**
+* Put the entries indexed since the last lookup into the hash slots (linear probing, load at most 1/2)
+* and by_id. A repeated key is not inserted, the first occurrence is the one that counts.
+**/
+static int
+_cstmp_header_hash_pending(cstmp_header_index_t *hidx, u_char *base) {
+    cstmp_header_t *h, *o;
+    uint32_t *slots;
+    size_t i, k, mask, nslots;
+
+    if (hidx->nhashed == hidx->nelts) {
+        return 1;
+    }
+    if (hidx->nelts * 2 > hidx->nslots) {
+        for (nslots = hidx->nslots ? hidx->nslots : 32; nslots < hidx->nelts * 2; nslots *= 2);
+        if ((slots = __cstmp_alloc__(__stp_arg__, nslots * sizeof(uint32_t))) == NULL) {
+            fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+            return 0;
+        }
+        if (hidx->slots) {
+            __cstmp_free__(__stp_arg__, hidx->slots);
+        }
+        hidx->slots = slots;
+        hidx->nslots = nslots;
+        hidx->nhashed = 0;
+    }
+    if (hidx->nhashed == 0) {
+        bzero(hidx->slots, hidx->nslots * sizeof(uint32_t));
+        bzero(hidx->by_id, sizeof(hidx->by_id));
+    }
+    mask = hidx->nslots - 1;
+    for (i = hidx->nhashed; i < hidx->nelts; i++) {
+        h = &hidx->elts[i];
+        for (k = h->hash & mask; hidx->slots[k]; k = (k + 1) & mask) {
+            o = &hidx->elts[hidx->slots[k] - 1];
+            if (o->hash == h->hash && cstmp_hdr_key_eq(base, o, base + h->key_off, h->key_len)) {
+                break;
+            }
         }
+        if (!hidx->slots[k]) {
+            hidx->slots[k] = (uint32_t) i + 1;
+        }
+        if (h->id != CSTMP_HDR_OTHER && h->id < CSTMP_HDR_IDS && !hidx->by_id[h->id]) {
+            hidx->by_id[h->id] = (uint32_t) i + 1;
+        }
+    }
+    hidx->nhashed = hidx->nelts;
+    return 1;
+}
+
+/** One hash and, barring a collision, one probe and one key compare **/
+static cstmp_header_t*
+_cstmp_header_find(cstmp_header_index_t *hidx, u_char *base, const u_char *key, size_t key_len) {
+    uint32_t hash = cstmp_hash_key(key, key_len);
+    cstmp_header_t *h;
+    size_t k, mask;
+
+    if (!hidx->nelts || !_cstmp_header_hash_pending(hidx, base)) {
+        return NULL;
+    }
+    mask = hidx->nslots - 1;
+    for (k = hash & mask; hidx->slots[k]; k = (k + 1) & mask) {
+        h = &hidx->elts[hidx->slots[k] - 1];
+        if (h->hash == hash && cstmp_hdr_key_eq(base, h, key, key_len)) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+int
+cstmp_get_header_and_len(cstmp_frame_t *fr, const u_char *key, size_t key_len, cstmp_frame_val_t *hdr_val) {
+    cstmp_header_t *h;
+
+    hdr_val->data = NULL;
+    hdr_val->len = 0;
+
+    if (!fr || !key || !_cstmp_header_index_pending(fr)) {
+        return 0;
+    }
+
+    if ((h = _cstmp_header_find(&fr->hidx, fr->headers.start, key, key_len)) == NULL) {
+        return 0;
+    }
+
+    if ((h->flags & CSTMP_HDR_ESCAPED) && !_cstmp_header_decode(fr, h)) {
+        return 0;
+    }
+
+    hdr_val->data = ((h->flags & CSTMP_HDR_DECODED) ? fr->hdr_esc.start : fr->headers.start) + h->val_off;
+    hdr_val->len = h->val_len;
+    return 1;
+}
+
+int
+cstmp_get_header(cstmp_frame_t *fr, const u_char *key, cstmp_frame_val_t *hdr_val) {
+    return cstmp_get_header_and_len(fr, key, key ? strlen(key) : 0, hdr_val);
+}
+
+int
+cstmp_get_header_by_id(cstmp_frame_t *fr, cstmp_header_id_t id, cstmp_frame_val_t *hdr_val) {
+    cstmp_header_t *h;
+
+    hdr_val->data = NULL;
+    hdr_val->len = 0;
+
+    if (!fr || id == CSTMP_HDR_OTHER || !_cstmp_header_index_pending(fr)) {
+        return 0;
+    }
+
+    if (id >= CSTMP_HDR_IDS || !fr->hidx.nelts || !_cstmp_header_hash_pending(&fr->hidx, fr->headers.start) ||
+            !fr->hidx.by_id[id]) {
+        return 0;
+    }
+    h = &fr->hidx.elts[fr->hidx.by_id[id] - 1];
+    if ((h->flags & CSTMP_HDR_ESCAPED) && !_cstmp_header_decode(fr, h)) {
+        return 0;
+    }
+    hdr_val->data = ((h->flags & CSTMP_HDR_DECODED) ? fr->hdr_esc.start : fr->headers.start) + h->val_off;
+    hdr_val->len = h->val_len;
+    return 1;
+}
+
+void
+cstmp_get_body(cstmp_frame_t *fr, cstmp_frame_val_t *body_val) {
+    body_val->data = fr->body.start;
+    body_val->len = cstmp_buf_size((&fr->body));
+}
+
+/** Command by length and first bytes, at most one memcmp per frame **/
+static cstmp_cmd_t
+cstmp_cmd_lookup(const u_char *cmd, size_t len) {
+    cstmp_cmd_t id;
+    switch (len) {
+    case 3:
+        id = CSTMP_CMD_ACK;
+        break;
+    case 4:
+        id = cmd[0] == 'S' ? CSTMP_CMD_SEND : CSTMP_CMD_NACK;
+        break;
+    case 5:
+        id = cmd[0] == 'B' ? CSTMP_CMD_BEGIN : cmd[0] == 'A' ? CSTMP_CMD_ABORT :
+             cmd[0] == 'S' ? CSTMP_CMD_STOMP : CSTMP_CMD_ERROR;
+        break;
+    case 6:
+        id = CSTMP_CMD_COMMIT;
+        break;
+    case 7:
+        id = cmd[0] == 'C' ? CSTMP_CMD_CONNECT : cmd[0] == 'M' ? CSTMP_CMD_MESSAGE : CSTMP_CMD_RECEIPT;
+        break;
+    case 9:
+        id = cmd[0] == 'S' ? CSTMP_CMD_SUBSCRIBE : CSTMP_CMD_CONNECTED;
+        break;
+    case 10:
+        id = CSTMP_CMD_DISCONNECT;
+        break;
+    case 11:
+        id = CSTMP_CMD_UNSUBSCRIBE;
+        break;
+    default:
+        return CSTMP_CMD_UNKNOWN;
+    }
+    return memcmp(__cstmp_commands[id - 1], cmd, len) == 0 ? id : CSTMP_CMD_UNKNOWN;
+}
+
+static void
+cstmp_parse_cmd(cstmp_frame_t *fr, u_char* cmd, size_t len) {
+    fr->cmd_id = cstmp_cmd_lookup(cmd, len);
+    fr->cmd = fr->cmd_id ? (u_char*) __cstmp_commands[fr->cmd_id - 1] : (u_char*) ""; // empty cmd by default
+}
+
+cstmp_cmd_t
+cstmp_get_cmd_id(cstmp_frame_t *fr) {
+    if (!fr) {
+        return CSTMP_CMD_UNKNOWN;
+    }
+    if (fr->cmd_id == CSTMP_CMD_UNKNOWN && fr->cmd && *fr->cmd) {
+        fr->cmd_id = cstmp_cmd_lookup(fr->cmd, strlen(fr->cmd));
+    }
+    return fr->cmd_id;
+}
+
+void
+cstmp_set_cmd(cstmp_frame_t *fr, cstmp_cmd_t cmd_id) {
+    if (fr) {
+        fr->cmd_id = cmd_id > CSTMP_CMD_UNKNOWN && cmd_id <= CSTMP_CMD_ERROR ? cmd_id : CSTMP_CMD_UNKNOWN;
+        fr->cmd = fr->cmd_id ? (u_char*) __cstmp_commands[fr->cmd_id - 1] : (u_char*) "";
     }
 }
 
@@ -532,150 +1469,4715 @@ void
 cstmp_reset_frame(cstmp_frame_t *fr) {
     if (fr) {
         fr->cmd = "";
-        memset(fr->headers.start, 0, cstmp_buf_size((&fr->headers)));
-        memset(fr->body.start, 0, cstmp_buf_size((&fr->body)));
+        fr->cmd_id = CSTMP_CMD_UNKNOWN;
+        fr->body_file.fd = -1;
+        if (fr->body.flags & CSTMP_BUF_LENT) {
+            /** lending ends with the frame reuse **/
+            fr->body = fr->body_own;
+        }
+        /** O(1), only rewind, the buffers are kept NUL terminated instead of zeroed **/
         fr->headers.last = fr->headers.start;
         fr->body.last = fr->body.start;
+        *fr->headers.start = '\0';
+        *fr->body.start = '\0';
+        cstmp_hidx_reset(&fr->hidx);
+        fr->hdr_esc.last = fr->hdr_esc.start;
     }
 }
 
-int
-cstmp_send_direct(cstmp_session_t *sess, const u_char *frame_str, int tries) {
-    int success = 0, connfd, rv;
-    if (sess) {
-        connfd = sess->sock;
-        CSTMP_LOCK_WRITING;
-        do {
-            if ( (rv = send(connfd, frame_str, strlen(frame_str), 0)) < 0 ||
-                    (rv = C_STMP_WRITE_CTR_AT_LF(connfd)) < 0) {
-                CHECK_ERROR(rv);
-            } else {
-                success = 1;
-                tries = 0;
+static uint64_t
+_cstmp_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/** Bucket of v, values below 8 are exact, above it 8 linear sub buckets per power of two **/
+static size_t
+_cstmp_hist_index(uint64_t v) {
+    int msb;
+    if (v < (1u << CSTMP_HIST_SUB_BITS)) {
+        return (size_t) v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    return ((size_t) (msb - CSTMP_HIST_SUB_BITS + 1) << CSTMP_HIST_SUB_BITS) +
+           (size_t) ((v >> (msb - CSTMP_HIST_SUB_BITS)) & ((1u << CSTMP_HIST_SUB_BITS) - 1));
+}
+
+/** Highest value falling into bucket i **/
+static uint64_t
+_cstmp_hist_upper(size_t i) {
+    size_t e = i >> CSTMP_HIST_SUB_BITS, sub = i & ((1u << CSTMP_HIST_SUB_BITS) - 1);
+    int shift;
+    if (e == 0) {
+        return (uint64_t) i;
+    }
+    shift = (int) e - 1;
+    return ((((uint64_t) 1 << CSTMP_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void
+cstmp_hist_record(cstmp_hist_t *h, uint64_t v) {
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->counts[_cstmp_hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+    while (v > max && !__atomic_compare_exchange_n(&h->max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void
+_cstmp_metrics_frame(cstmp_session_t *sess, cstmp_hist_t *lat, uint64_t ns, size_t frame_bytes, int sent) {
+    cstmp_metrics_t *m = sess->metrics;
+    if (sent) {
+        __atomic_fetch_add(&m->frames_sent, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&m->frames_recv, 1, __ATOMIC_RELAXED);
+    }
+    cstmp_hist_record(lat, ns);
+    cstmp_hist_record(&m->frame_bytes, frame_bytes);
+}
+
+/**
+* Write the whole iovec array with sendmsg, partial writes continue from where the kernel stopped,
+* so a timeout retry never resend bytes which already on the wire. iov is modified.
+**/
+static int
+_cstmp_sendv(cstmp_session_t *sess, struct iovec *iov, size_t iovcnt, int tries) {
+    struct msghdr msg;
+    struct pollfd pfd;
+    ssize_t n;
+    int connfd = sess->sock;
+
+    /** skip the empty slot **/
+    while (iovcnt && iov->iov_len == 0) {
+        iov++;
+        iovcnt--;
+    }
+
+    while (iovcnt) {
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+
+        CSTMP_METRIC_ADD(sess, send_calls, 1);
+        if ((n = sendmsg(connfd, &msg, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-        } while (tries--); /*while try*/
-        CSTMP_RELEASE_WRITING;
+            CSTMP_METRIC_ADD(sess, send_retries, 1);
+            if ((errno == EWOULDBLOCK || errno == EAGAIN) && sess->nonblocking) {
+                /** socket driven by a loop, wait for room up to send_timeout **/
+                pfd.fd = connfd;
+                pfd.events = POLLOUT;
+                if (poll(&pfd, 1, sess->send_timeout) > 0 || tries-- > 0) {
+                    continue;
+                }
+                return 0;
+            }
+            if ((errno == EWOULDBLOCK || errno == EAGAIN) && tries-- > 0) {
+                continue;
+            }
+            if (errno != EWOULDBLOCK && errno != EAGAIN) {
+                fprintf(stderr, "Error while process socket read/write: %s\n", strerror(errno));
+            }
+            return 0;
+        }
+
+        CSTMP_METRIC_ADD(sess, bytes_sent, (uint64_t) n);
+        while (iovcnt && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (u_char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
-    return success;
+    sess->hb_sent = 1;
+    return 1;
 }
 
-int
-cstmp_send(cstmp_session_t *sess, cstmp_frame_t *fr, int tries) {
-    int success = 0, connfd, rv;
-    if (fr && sess) {
-        connfd = sess->sock;
-        const u_char* cmd = fr->cmd;
-        const size_t header_len = cstmp_buf_size((&fr->headers)), body_len = cstmp_buf_size((&fr->body));
-        CSTMP_LOCK_WRITING;
-        do {
-            if (
-                (rv = send(connfd, cmd , strlen(cmd), 0)) < 0 ||
-                (rv = send(connfd, LF, 1 * sizeof(u_char), 0)) < 0 ||
-                (header_len && (rv = send(connfd, fr->headers.start , header_len, 0)) < 0) ||
-                (rv = send(connfd, LF, 1 * sizeof(u_char), 0)) < 0 ||
-                (body_len && (rv = send(connfd, fr->body.start , body_len, 0)) < 0) ||
-                (rv = C_STMP_WRITE_CTR_AT_LF(connfd)) < 0
-            ) {
-                CHECK_ERROR(rv);
-            } else {
-                success = 1;
-                tries = 0;
+#define cstmp_set_iov(v, base, len) (v)->iov_base = (void*) (base); (v)->iov_len = (len)
+
+/**
+* Fill the frame wire format into iov, returns the number of iov used (at most C_STMP_FRAME_IOV_MAX).
+* extra (optional) are header lines added on the wire without touching the frame, e.g. the receipt header.
+**/
+static size_t
+_cstmp_frame_to_iov(cstmp_frame_t *fr, struct iovec *iov, const cstmp_frame_val_t *extra) {
+    struct iovec *v = iov;
+    const size_t header_len = cstmp_buf_size((&fr->headers)), body_len = cstmp_buf_size((&fr->body));
+
+    cstmp_set_iov(v, fr->cmd, strlen(fr->cmd)); v++;
+    cstmp_set_iov(v, LF, 1); v++;
+    if (header_len) {
+        cstmp_set_iov(v, fr->headers.start, header_len); v++;
+    }
+    if (extra && extra->len) {
+        cstmp_set_iov(v, extra->data, extra->len); v++;
+    }
+    cstmp_set_iov(v, LF, 1); v++;
+    if (fr->body_file.fd >= 0) {
+        /** file body and terminator follow with _cstmp_send_file_body **/
+        return (size_t) (v - iov);
+    }
+    if (body_len) {
+        cstmp_set_iov(v, fr->body.start, body_len); v++;
+    }
+    cstmp_set_iov(v, C_STMP_FRAME_END, 2); v++;
+    return (size_t) (v - iov);
+}
+
+/** sendfile the body after the head went out, partial sends continue from the offset reached **/
+static int
+_cstmp_send_file_body(cstmp_session_t *sess, cstmp_body_file_t *bf, int tries) {
+    struct iovec end;
+    struct pollfd pfd;
+    off_t offset = bf->offset;
+    size_t left = bf->len;
+    ssize_t n;
+
+    while (left) {
+        CSTMP_METRIC_ADD(sess, send_calls, 1);
+        if ((n = sendfile(sess->sock, bf->fd, &offset, left)) > 0) {
+            CSTMP_METRIC_ADD(sess, bytes_sent, (uint64_t) n);
+            left -= (size_t) n;
+            continue;
+        }
+        if (n == 0) {
+            fprintf(stderr, "%s\n", "Error, file body shorter than its length");
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno == EWOULDBLOCK || errno == EAGAIN) && sess->nonblocking) {
+            pfd.fd = sess->sock;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, sess->send_timeout) > 0 || tries-- > 0) {
+                continue;
             }
-        } while (tries--);/*while try*/
-        CSTMP_RELEASE_WRITING;
-    } else fprintf(stderr, "%s\n", "Invalid Frame or session type");
-    return success;
+            return 0;
+        }
+        if ((errno == EWOULDBLOCK || errno == EAGAIN) && tries-- > 0) {
+            continue;
+        }
+        if (errno != EWOULDBLOCK && errno != EAGAIN) {
+            fprintf(stderr, "Error while sending file body: %s\n", strerror(errno));
+        }
+        return 0;
+    }
+    cstmp_set_iov(&end, C_STMP_FRAME_END, 2);
+    return _cstmp_sendv(sess, &end, 1, tries);
 }
 
+/**
+* Body compression. The frame is left as built, every send path puts a view of it on the wire with the
+* compressed body and its headers rewritten, so the frame can be sent again or elsewhere.
+**/
+#define CSTMP_CODEC_MAX_BODY (256u << 20) /* original-length above this is refused on receive */
+
+typedef struct cstmp_codec_s {
+    cstmp_codec_t codec;
+    int level;
+    size_t min_size;
+    u_char *dict;
+    size_t dict_len;
+    int raw; /* received bodies left encoded, for relays */
+    pthread_mutex_t lock; /* encoder state, out and head, held until they are written or copied */
+    cstmp_frame_buf_t out; /* compressed body being sent */
+    cstmp_frame_buf_t head; /* its header block */
+    cstmp_frame_buf_t in; /* decompressed body, swapped with the frame body */
+#ifdef CSTOMP_WITH_LZ4
+    LZ4_stream_t *lz;
+#endif
+#ifdef CSTOMP_WITH_ZSTD
+    ZSTD_CCtx *zc;
+    ZSTD_DCtx *zd;
+    ZSTD_CDict *zcdict;
+    ZSTD_DDict *zddict;
+#endif
+} cstmp_codec_ctx_t;
+
+static const char *__cstmp_codec_names[] = { "", "lz4", "zstd" };
+
 int
-cstmp_recv(cstmp_session_t *sess, cstmp_frame_t *fr, int tries) {
-    int success = 0, connfd, content_len_i;
-    u_char* content_len_s;
-    if (fr && sess) {
-        u_char cmd_buff[1], cmd[12];
-        cstmp_reset_frame(fr);
-        connfd = sess->sock;
-        int n, i = 0;
-        CSTMP_LOCK_READING;
-        do {
-            /*Parse Cmd*/
-            while ( (n = recv( connfd , cmd_buff, 1, 0)) > 0) {
-                if (cmd_buff[0] == '\n') {
-                    cmd[i] = '\0';
-                    cstmp_parse_cmd(fr, cmd);
-                    break;
-                } else if (i == 12) {
-                    FRAME_READ_RETURN(0);
-                }
-                cmd[i++] = cmd_buff[0];
-            }
-            CHECK_ERROR(n);
-            /***parse Header ***/
-            u_char last_char = 0;
-            cstmp_frame_buf_t *headers = &fr->headers;
-
-            while ((n = recv( connfd , headers->last, 1, 0)) > 0) {
-                if (*headers->last == '\n' && last_char == '\n') {
-                    _cstmp_add_buf(headers, "\0", 1 * sizeof(u_char) );
-
-                    /***Add Body ***/
-                    cstmp_frame_buf_t *body = &fr->body;
-                    if ( content_len_s = strstr(headers->start, "content-length:") ) {
-                        content_len_i = atoi(content_len_s + 15 /* sizeof content-length: */ );
-                        if (content_len_i > cstmp_buf_left(body)) {
-                            _cstmp_reload_buf_size(body, (size_t) content_len_i);
-                        }
-REREAD_WHOLE_BODY:
-                        if ((n = recv( connfd , body->last, content_len_i, 0)) > 0) {
-                            body->last += n;
-                            char terminator_linecheck[2];
-                            if (((n = recv( connfd , terminator_linecheck, 2, 0)) > 1) &&
-                                    terminator_linecheck[0] == 0 && terminator_linecheck[1] == '\n') {
-                                FRAME_READ_RETURN(1);
-                            }
-                            FRAME_READ_RETURN(0);
-                        }
-                        CHECK_OR_GOTO(n, REREAD_WHOLE_BODY);
-                    } else {
-REREAD_BODY:
-                        while ((n = recv( connfd , body->last, 1, 0)) > 0) {
-                            if (*body->last == 0) {
-                                char recv_buff[1];
-                                /** Check the Frame Terminator**/
-                                if (((n = recv( connfd , recv_buff, 1, 0)) > 0)) {
-                                    if (recv_buff[0] != '\n') {
-                                        FRAME_READ_RETURN(0);
-                                    }
-                                    FRAME_READ_RETURN(1);
-                                }
-                            }
-                            *body->last++;
-                            if (cstmp_buf_size(body) == body->total_size) {
-                                _cstmp_reload_buf_size(body, body->total_size * 2);
-                            }
-                        }
-                        CHECK_OR_GOTO(n, REREAD_BODY);
-                    }
-                    FRAME_READ_RETURN(0);
-                }
-                last_char = *headers->last++; /*only plus 1*/
-                if (cstmp_buf_size(headers) == headers->total_size) {
-                    _cstmp_reload_buf_size(headers, headers->total_size * 2);
-                }
-            }
-            /** end of file **/
-            CHECK_ERROR(n);
-        } while (tries--);/*while try*/
-        CSTMP_RELEASE_READING;
-    } else fprintf(stderr, "%s\n", "Invalid Frame type");
-    return success; /*Failed*/
+cstmp_codec_available(cstmp_codec_t codec) {
+    switch (codec) {
+    case CSTMP_CODEC_NONE:
+        return 1;
+#ifdef CSTOMP_WITH_LZ4
+    case CSTMP_CODEC_LZ4:
+        return 1;
+#endif
+#ifdef CSTOMP_WITH_ZSTD
+    case CSTMP_CODEC_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
 }
 
-void
-cstmp_consume(cstmp_session_t *sess, cstmp_frame_t *fr, void (*callback)(cstmp_frame_t *), int *consuming) {
-    while (*consuming) {
-        if (cstmp_recv(sess, fr, 0)) {
-            callback(fr);
+static void
+_cstmp_codec_drop_dict(cstmp_codec_ctx_t *c) {
+#ifdef CSTOMP_WITH_ZSTD
+    if (c->zcdict) {
+        ZSTD_freeCDict(c->zcdict);
+        c->zcdict = NULL;
+    }
+    if (c->zddict) {
+        ZSTD_freeDDict(c->zddict);
+        c->zddict = NULL;
+    }
+#endif
+    if (c->dict) {
+        __cstmp_free__(__stp_arg__, c->dict);
+        c->dict = NULL;
+    }
+    c->dict_len = 0;
+}
+
+static void
+_cstmp_codec_free(cstmp_codec_ctx_t *c) {
+    if (c) {
+        _cstmp_codec_drop_dict(c);
+#ifdef CSTOMP_WITH_LZ4
+        if (c->lz)
+            LZ4_freeStream(c->lz);
+#endif
+#ifdef CSTOMP_WITH_ZSTD
+        if (c->zc)
+            ZSTD_freeCCtx(c->zc);
+        if (c->zd)
+            ZSTD_freeDCtx(c->zd);
+#endif
+        cstmp_buf_free((&c->out));
+        cstmp_buf_free((&c->head));
+        cstmp_buf_free((&c->in));
+        pthread_mutex_destroy(&c->lock);
+        __cstmp_free__(__stp_arg__, c);
+    }
+}
+
+static cstmp_codec_ctx_t*
+_cstmp_codec_ctx(cstmp_session_t *sess) {
+    cstmp_codec_ctx_t *c;
+    if (sess->codec) {
+        return sess->codec;
+    }
+    if ((c = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_codec_ctx_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(c, sizeof(cstmp_codec_ctx_t));
+    pthread_mutex_init(&c->lock, NULL);
+    /** the reader and a sender may both get here first **/
+    if (!__sync_bool_compare_and_swap(&sess->codec, NULL, c)) {
+        pthread_mutex_destroy(&c->lock);
+        __cstmp_free__(__stp_arg__, c);
+    }
+    return sess->codec;
+}
+
+int
+cstmp_set_compression(cstmp_session_t *sess, cstmp_codec_t codec, int level, size_t min_size,
+                      const void *dict, size_t dict_len) {
+    cstmp_codec_ctx_t *c;
+
+    if (!sess || (!dict && dict_len)) {
+        fprintf(stderr, "%s\n", "Invalid session or dictionary");
+        return 0;
+    }
+    if (!cstmp_codec_available(codec)) {
+        fprintf(stderr, "Codec %d is not built in\n", (int) codec);
+        return 0;
+    }
+    if ((c = _cstmp_codec_ctx(sess)) == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&c->lock);
+    _cstmp_codec_drop_dict(c);
+    if (dict_len) {
+        if ((c->dict = __cstmp_alloc__(__stp_arg__, dict_len)) == NULL) {
+            fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+            pthread_mutex_unlock(&c->lock);
+            return 0;
         }
+        memcpy(c->dict, dict, dict_len);
+        c->dict_len = dict_len;
     }
-}
\ No newline at end of file
+    c->level = level;
+    c->min_size = min_size;
+    c->codec = codec;
+    pthread_mutex_unlock(&c->lock);
+    return 1;
+}
+
+int
+cstmp_set_body_decoding(cstmp_session_t *sess, int on) {
+    cstmp_codec_ctx_t *c;
+    if (!sess || (c = _cstmp_codec_ctx(sess)) == NULL) {
+        return 0;
+    }
+    c->raw = !on;
+    return 1;
+}
+
+#if defined(CSTOMP_WITH_LZ4) || defined(CSTOMP_WITH_ZSTD)
+/** Compress src into out, c->lock held, 0 when it cannot be done or does not pay **/
+static int
+_cstmp_codec_compress(cstmp_codec_ctx_t *c, const u_char *src, size_t len, cstmp_frame_buf_t *out) {
+    size_t bound, n = 0;
+
+    switch (c->codec) {
+#ifdef CSTOMP_WITH_LZ4
+    case CSTMP_CODEC_LZ4: {
+        int rc;
+        if (len > LZ4_MAX_INPUT_SIZE) {
+            return 0;
+        }
+        bound = (size_t) LZ4_compressBound((int) len);
+        if (!_cstmp_buf_reserve(out, bound) || (c->lz == NULL && (c->lz = LZ4_createStream()) == NULL)) {
+            return 0;
+        }
+        /** a fresh dictionary each frame, frames are decoded on their own **/
+        LZ4_loadDict(c->lz, (const char*) c->dict, (int) c->dict_len);
+        rc = LZ4_compress_fast_continue(c->lz, (const char*) src, (char*) out->start, (int) len, (int) bound,
+                                        c->level > 0 ? c->level : 1);
+        n = rc > 0 ? (size_t) rc : 0;
+        break;
+    }
+#endif
+#ifdef CSTOMP_WITH_ZSTD
+    case CSTMP_CODEC_ZSTD:
+        bound = ZSTD_compressBound(len);
+        if (!_cstmp_buf_reserve(out, bound) || (c->zc == NULL && (c->zc = ZSTD_createCCtx()) == NULL)) {
+            return 0;
+        }
+        if (c->dict_len && c->zcdict == NULL &&
+                (c->zcdict = ZSTD_createCDict(c->dict, c->dict_len, c->level)) == NULL) {
+            return 0;
+        }
+        n = c->zcdict ? ZSTD_compress_usingCDict(c->zc, out->start, bound, src, len, c->zcdict)
+            : ZSTD_compressCCtx(c->zc, out->start, bound, src, len, c->level);
+        if (ZSTD_isError(n)) {
+            fprintf(stderr, "zstd compress failed: %s\n", ZSTD_getErrorName(n));
+            return 0;
+        }
+        break;
+#endif
+    default:
+        return 0;
+    }
+    if (n == 0 || n >= len) {
+        return 0;
+    }
+    out->last = out->start + n;
+    return 1;
+}
+#else
+#define _cstmp_codec_compress(c, src, len, out) 0
+#endif
+
+#if defined(CSTOMP_WITH_LZ4) || defined(CSTOMP_WITH_ZSTD)
+/** Decompress src into c->in, exactly orig bytes expected, c->lock held for the dictionary **/
+static int
+_cstmp_codec_decompress(cstmp_codec_ctx_t *c, cstmp_codec_t codec, const u_char *src, size_t len, size_t orig) {
+    size_t n = 0;
+
+    if (!_cstmp_buf_reserve(&c->in, orig + 1)) {
+        return 0;
+    }
+    switch (codec) {
+#ifdef CSTOMP_WITH_LZ4
+    case CSTMP_CODEC_LZ4: {
+        int rc;
+        if (len > INT_MAX || orig > INT_MAX) {
+            return 0;
+        }
+        rc = c->dict_len ? LZ4_decompress_safe_usingDict((const char*) src, (char*) c->in.start, (int) len, (int) orig,
+                                                         (const char*) c->dict, (int) c->dict_len)
+             : LZ4_decompress_safe((const char*) src, (char*) c->in.start, (int) len, (int) orig);
+        if (rc < 0) {
+            return 0;
+        }
+        n = (size_t) rc;
+        break;
+    }
+#endif
+#ifdef CSTOMP_WITH_ZSTD
+    case CSTMP_CODEC_ZSTD:
+        if (c->zd == NULL && (c->zd = ZSTD_createDCtx()) == NULL) {
+            return 0;
+        }
+        if (c->dict_len && c->zddict == NULL && (c->zddict = ZSTD_createDDict(c->dict, c->dict_len)) == NULL) {
+            return 0;
+        }
+        n = c->zddict ? ZSTD_decompress_usingDDict(c->zd, c->in.start, orig, src, len, c->zddict)
+            : ZSTD_decompressDCtx(c->zd, c->in.start, orig, src, len);
+        if (ZSTD_isError(n)) {
+            fprintf(stderr, "zstd decompress failed: %s\n", ZSTD_getErrorName(n));
+            return 0;
+        }
+        break;
+#endif
+    default:
+        return 0;
+    }
+    if (n != orig) {
+        return 0;
+    }
+    c->in.last = c->in.start + n;
+    *c->in.last = '\0';
+    return 1;
+}
+#else
+#define _cstmp_codec_decompress(c, codec, src, len, orig) 0
+#endif
+
+#define cstmp_hdr_line_is(p, n, key) ((n) > sizeof(key) - 1 && memcmp(p, key, sizeof(key) - 1) == 0)
+
+#define cstmp_codec_wants(c, len) ((c)->codec != CSTMP_CODEC_NONE && (len) && (len) >= (c)->min_size)
+
+/**
+* The view of fr to put on the wire when its body is worth compressing, c->lock held. The body goes into
+* out, the header block into head without content-length and with content-encoding, content-length and
+* original-length appended.
+**/
+static int
+_cstmp_body_encode(cstmp_session_t *sess, cstmp_frame_t *fr, cstmp_frame_t *wire,
+                   cstmp_frame_buf_t *head, cstmp_frame_buf_t *out) {
+    cstmp_codec_ctx_t *c = sess->codec;
+    cstmp_frame_val_t val;
+    const u_char *p, *nl, *end;
+    size_t len = cstmp_buf_size((&fr->body)), hlen = cstmp_buf_size((&fr->headers));
+    char lines[96];
+    int n;
+
+    if (!cstmp_codec_wants(c, len) || fr->body_file.fd >= 0 || cstmp_get_header(fr, (u_char*) "content-encoding", &val)) {
+        return 0;
+    }
+    if (!_cstmp_codec_compress(c, fr->body.start, len, out)) {
+        return 0;
+    }
+    n = snprintf(lines, sizeof(lines), "content-encoding:%s\ncontent-length:%zu\noriginal-length:%zu\n",
+                 __cstmp_codec_names[c->codec], cstmp_buf_size(out), len);
+    if (!_cstmp_buf_reserve(head, hlen + (size_t) n + 1)) {
+        return 0;
+    }
+    head->last = head->start;
+    for (p = fr->headers.start, end = fr->headers.last; p < end; p = nl) {
+        nl = memchr(p, '\n', (size_t) (end - p));
+        nl = nl ? nl + 1 : end;
+        if (cstmp_hdr_line_is(p, (size_t) (nl - p), "content-length:")) {
+            continue;
+        }
+        head->last = cstmp_cpymem(head->last, p, (size_t) (nl - p));
+    }
+    head->last = cstmp_cpymem(head->last, lines, (size_t) n);
+
+    *wire = *fr;
+    wire->headers = *head;
+    wire->body = *out;
+    CSTMP_METRIC_ADD(sess, body_bytes_raw, (uint64_t) len);
+    CSTMP_METRIC_ADD(sess, body_bytes_encoded, (uint64_t) cstmp_buf_size(out));
+    return 1;
+}
+
+/**
+* fr as it goes on the wire, its encoded view in *wire when the session compresses. *held is the codec
+* locked meanwhile, _cstmp_codec_done once the bytes are written or copied.
+**/
+static cstmp_frame_t*
+_cstmp_codec_wire(cstmp_session_t *sess, cstmp_frame_t *fr, cstmp_frame_t *wire, cstmp_codec_ctx_t **held) {
+    cstmp_codec_ctx_t *c = sess->codec;
+    *held = c;
+    if (c == NULL) {
+        return fr;
+    }
+    pthread_mutex_lock(&c->lock);
+    return _cstmp_body_encode(sess, fr, wire, &c->head, &c->out) ? wire : fr;
+}
+
+#define _cstmp_codec_done(held) if (held) pthread_mutex_unlock(&(held)->lock)
+
+/** The frame looks as never compressed afterwards, a relay forwarding its headers does not encode it twice **/
+static int
+_cstmp_body_decoded_headers(cstmp_frame_t *fr, size_t len) {
+    cstmp_frame_buf_t *headers = &fr->headers;
+    u_char *p, *nl, *dst;
+    char line[48];
+    int n;
+
+    for (p = dst = headers->start; p < headers->last; p = nl) {
+        nl = memchr(p, '\n', (size_t) (headers->last - p));
+        nl = nl ? nl + 1 : headers->last;
+        if (cstmp_hdr_line_is(p, (size_t) (nl - p), "content-encoding:") ||
+                cstmp_hdr_line_is(p, (size_t) (nl - p), "original-length:") ||
+                cstmp_hdr_line_is(p, (size_t) (nl - p), "content-length:")) {
+            continue;
+        }
+        memmove(dst, p, (size_t) (nl - p));
+        dst += nl - p;
+    }
+    headers->last = dst;
+    n = snprintf(line, sizeof(line), "content-length:%zu\n", len);
+    if (!_cstmp_buf_reserve(headers, cstmp_buf_size(headers) + (size_t) n + 1)) {
+        return 0;
+    }
+    headers->last = cstmp_cpymem(headers->last, line, (size_t) n);
+    *headers->last = '\0';
+    /** offsets moved, indexed again on the next lookup **/
+    cstmp_hidx_reset(&fr->hidx);
+    fr->hdr_esc.last = fr->hdr_esc.start;
+    return 1;
+}
+
+/**
+* Received body with a content-encoding built in is replaced by its decompressed bytes. An own heap
+* body is swapped with the session buffer, so both stay allocated for the next frames.
+**/
+static int
+_cstmp_body_decode(cstmp_session_t *sess, cstmp_frame_t *fr) {
+    cstmp_frame_val_t enc, olen;
+    cstmp_frame_buf_t tmp;
+    cstmp_codec_ctx_t *c;
+    cstmp_codec_t codec;
+    size_t orig;
+    int decoded;
+
+    if ((sess->codec && sess->codec->raw) || !cstmp_get_header(fr, (u_char*) "content-encoding", &enc)) {
+        return 1;
+    }
+    for (codec = CSTMP_CODEC_LZ4; codec <= CSTMP_CODEC_ZSTD; codec++) {
+        if (enc.len == strlen(__cstmp_codec_names[codec]) && memcmp(enc.data, __cstmp_codec_names[codec], enc.len) == 0) {
+            break;
+        }
+    }
+    if (codec > CSTMP_CODEC_ZSTD || !cstmp_codec_available(codec)) {
+        /** not ours, the application gets the body as is **/
+        return 1;
+    }
+    if (!cstmp_get_header(fr, (u_char*) "original-length", &olen) ||
+            (orig = strtoul((char*) olen.data, NULL, 10)) > CSTMP_CODEC_MAX_BODY) {
+        fprintf(stderr, "%s\n", "Error, compressed body without a valid original-length");
+        return 0;
+    }
+    if ((c = _cstmp_codec_ctx(sess)) == NULL) {
+        return 0;
+    }
+    /** cstmp_set_compression may replace the dictionary from another thread **/
+    pthread_mutex_lock(&c->lock);
+    decoded = _cstmp_codec_decompress(c, codec, fr->body.start, cstmp_buf_size((&fr->body)), orig);
+    pthread_mutex_unlock(&c->lock);
+    if (!decoded) {
+        fprintf(stderr, "Error, corrupted %s body\n", __cstmp_codec_names[codec]);
+        return 0;
+    }
+    if (fr->body.flags == 0) {
+        tmp = fr->body;
+        fr->body = c->in;
+        c->in = tmp;
+        c->in.last = c->in.start;
+    } else {
+        /** lent or inline body, copied over **/
+        fr->body.last = fr->body.start;
+        if (!_cstmp_body_reserve(fr, orig + 1)) {
+            return 0;
+        }
+        fr->body.last = cstmp_cpymem(fr->body.start, c->in.start, orig);
+        *fr->body.last = '\0';
+    }
+    return _cstmp_body_decoded_headers(fr, orig);
+}
+
+/** nframes whole frames on the wire, the write time is shared evenly in send_ns, write lock held by caller **/
+static int
+_cstmp_sendv_frames(cstmp_session_t *sess, struct iovec *iov, size_t iovcnt, size_t nframes, int tries) {
+    size_t i, bytes = 0;
+    uint64_t start, ns;
+
+    if (!sess->metrics || !nframes) {
+        return _cstmp_sendv(sess, iov, iovcnt, tries);
+    }
+    for (i = 0; i < iovcnt; i++) {
+        bytes += iov[i].iov_len;
+    }
+    start = _cstmp_now_ns();
+    if (!_cstmp_sendv(sess, iov, iovcnt, tries)) {
+        return 0;
+    }
+    ns = (_cstmp_now_ns() - start) / nframes;
+    for (i = 0; i < nframes; i++) {
+        _cstmp_metrics_frame(sess, &sess->metrics->send_ns, ns, bytes / nframes, 1);
+    }
+    return 1;
+}
+
+/** Whole frame on the wire, write lock held by caller **/
+static int
+_cstmp_send_frame(cstmp_session_t *sess, cstmp_frame_t *fr, const cstmp_frame_val_t *extra, int tries) {
+    struct iovec iov[C_STMP_FRAME_IOV_MAX];
+    cstmp_codec_ctx_t *held;
+    cstmp_frame_t wire;
+    size_t i, iovcnt, frame_bytes = 0;
+    uint64_t start = sess->metrics ? _cstmp_now_ns() : 0;
+    int success;
+
+    fr = _cstmp_codec_wire(sess, fr, &wire, &held);
+    iovcnt = _cstmp_frame_to_iov(fr, iov, extra);
+    if (sess->metrics) {
+        for (i = 0; i < iovcnt; i++) {
+            frame_bytes += iov[i].iov_len;
+        }
+        frame_bytes += fr->body_file.fd >= 0 ? fr->body_file.len + 2 : 0;
+    }
+    success = _cstmp_sendv(sess, iov, iovcnt, tries) &&
+              (fr->body_file.fd < 0 || _cstmp_send_file_body(sess, &fr->body_file, tries));
+    _cstmp_codec_done(held);
+    if (success && sess->metrics) {
+        _cstmp_metrics_frame(sess, &sess->metrics->send_ns, _cstmp_now_ns() - start, frame_bytes, 1);
+    }
+    return success;
+}
+
+static int
+_cstmp_body_content_length(cstmp_frame_t *fr, size_t len) {
+    cstmp_frame_val_t val;
+    char clen[32];
+    if (cstmp_get_header_by_id(fr, CSTMP_HDR_CONTENT_LENGTH, &val)) {
+        return 1;
+    }
+    sprintf(clen, "%zu", len);
+    return cstmp_add_header(fr, "content-length", clen);
+}
+
+int
+cstmp_set_body_file(cstmp_frame_t *fr, int fd, off_t offset, size_t len) {
+    if (!fr || fd < 0) {
+        fprintf(stderr, "%s\n", "Invalid Frame or file descriptor");
+        return 0;
+    }
+    if (!_cstmp_body_content_length(fr, len)) {
+        return 0;
+    }
+    fr->body.last = fr->body.start;
+    fr->body_file.fd = fd;
+    fr->body_file.offset = offset;
+    fr->body_file.len = len;
+    return 1;
+}
+
+int
+cstmp_set_body_mapped(cstmp_frame_t *fr, const u_char *data, size_t len) {
+    if (!fr || (!data && len)) {
+        fprintf(stderr, "%s\n", "Invalid Frame or body region");
+        return 0;
+    }
+    if (!_cstmp_body_content_length(fr, len)) {
+        return 0;
+    }
+    /** lent exactly sized, so an append switches to the own buffer instead of writing the region **/
+    if (!(fr->body.flags & CSTMP_BUF_LENT)) {
+        fr->body_own = fr->body;
+    }
+    fr->body.start = (u_char*) data;
+    fr->body.last = (u_char*) data + len;
+    fr->body.total_size = len;
+    fr->body.flags = CSTMP_BUF_LENT;
+    return 1;
+}
+
+int
+cstmp_send_direct(cstmp_session_t *sess, const u_char *frame_str, int tries) {
+    int success = 0;
+    struct iovec iov[2];
+    if (sess) {
+        cstmp_set_iov(&iov[0], frame_str, strlen(frame_str));
+        cstmp_set_iov(&iov[1], C_STMP_FRAME_END, 2);
+        CSTMP_LOCK_WRITING;
+        success = _cstmp_sendv_frames(sess, iov, 2, 1, tries);
+        CSTMP_RELEASE_WRITING;
+    }
+    return success;
+}
+
+int
+cstmp_send(cstmp_session_t *sess, cstmp_frame_t *fr, int tries) {
+    int success = 0;
+    if (fr && sess) {
+        CSTMP_LOCK_WRITING;
+        success = _cstmp_send_frame(sess, fr, NULL, tries);
+        CSTMP_RELEASE_WRITING;
+    } else fprintf(stderr, "%s\n", "Invalid Frame or session type");
+    return success;
+}
+
+int
+cstmp_send_batch(cstmp_session_t *sess, cstmp_frame_t **frames, size_t n, int tries) {
+    int success = 0;
+    struct iovec stack_iov[C_STMP_BATCH_STACK_IOV], *iov = stack_iov;
+    cstmp_codec_ctx_t *c = NULL;
+    cstmp_frame_t *wire = NULL;
+    cstmp_frame_buf_t *bufs = NULL; /* head and body of each encoded frame */
+    size_t i, iovcnt = 0;
+    if (sess && frames && n) {
+        if (n * C_STMP_FRAME_IOV_MAX > C_STMP_BATCH_STACK_IOV) {
+            if ((iov = __cstmp_alloc__(__stp_arg__, n * C_STMP_FRAME_IOV_MAX * sizeof(struct iovec))) == NULL) {
+                fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+                return 0;
+            }
+        }
+        if ((c = sess->codec) != NULL && c->codec != CSTMP_CODEC_NONE) {
+            if ((wire = __cstmp_alloc__(__stp_arg__, n * (sizeof(cstmp_frame_t) + 2 * sizeof(cstmp_frame_buf_t)))) == NULL) {
+                fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+                c = NULL;
+                goto BATCH_DONE;
+            }
+            bufs = (cstmp_frame_buf_t*) (wire + n);
+            bzero(bufs, 2 * n * sizeof(cstmp_frame_buf_t));
+            pthread_mutex_lock(&c->lock);
+        } else {
+            c = NULL;
+        }
+        for (i = 0; i < n; i++) {
+            if (!frames[i] || frames[i]->body_file.fd >= 0) {
+                fprintf(stderr, "%s\n", "Invalid Frame type, file bodies go with cstmp_send");
+                goto BATCH_DONE;
+            }
+            iovcnt += _cstmp_frame_to_iov(c && _cstmp_body_encode(sess, frames[i], &wire[i], &bufs[2 * i], &bufs[2 * i + 1])
+                                          ? &wire[i] : frames[i], iov + iovcnt, NULL);
+        }
+        if (c) {
+            pthread_mutex_unlock(&c->lock);
+            c = NULL;
+        }
+        CSTMP_LOCK_WRITING;
+        success = _cstmp_sendv_frames(sess, iov, iovcnt, n, tries);
+        CSTMP_RELEASE_WRITING;
+BATCH_DONE:
+        if (c) {
+            pthread_mutex_unlock(&c->lock);
+        }
+        if (wire) {
+            for (i = 0; i < 2 * n; i++) {
+                cstmp_buf_free((&bufs[i]));
+            }
+            __cstmp_free__(__stp_arg__, wire);
+        }
+        if (iov != stack_iov) {
+            __cstmp_free__(__stp_arg__, iov);
+        }
+    } else fprintf(stderr, "%s\n", "Invalid Frame or session type");
+    return success;
+}
+
+#define CSTMP_TEMPLATE_VARS_STACK   512
+
+cstmp_template_t*
+cstmp_template_create(cstmp_frame_t *fr, const char **var_keys, size_t nvars) {
+    cstmp_template_t *tpl;
+    size_t i, cmd_len, hdr_len, key_len;
+    u_char *p;
+
+    if (!fr || !fr->cmd || !*fr->cmd || (nvars && !var_keys)) {
+        fprintf(stderr, "%s\n", "Invalid Frame type");
+        return NULL;
+    }
+    cmd_len = strlen(fr->cmd);
+    hdr_len = cstmp_buf_size((&fr->headers));
+
+    if ((tpl = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_template_t) + nvars * sizeof(cstmp_frame_val_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    tpl->var_keys = (cstmp_frame_val_t*) (tpl + 1);
+    tpl->nvars = 0;
+    tpl->head_len = cmd_len + 1 + hdr_len;
+    if ((tpl->head = __cstmp_alloc__(__stp_arg__, tpl->head_len)) == NULL) {
+        goto CREATE_FAILED;
+    }
+    p = cstmp_cpymem(tpl->head, fr->cmd, cmd_len);
+    *p++ = LF_CHAR;
+    cstmp_cpymem(p, fr->headers.start, hdr_len);
+
+    for (i = 0; i < nvars; i++) {
+        key_len = strlen(var_keys[i]);
+        if ((tpl->var_keys[i].data = __cstmp_alloc__(__stp_arg__, key_len + 1)) == NULL) {
+            goto CREATE_FAILED;
+        }
+        *cstmp_cpymem(tpl->var_keys[i].data, var_keys[i], key_len) = ':';
+        tpl->var_keys[i].len = key_len + 1;
+        tpl->nvars++;
+    }
+    return tpl;
+
+CREATE_FAILED:
+    fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+    cstmp_template_destroy(tpl);
+    return NULL;
+}
+
+void
+cstmp_template_destroy(cstmp_template_t *tpl) {
+    size_t i;
+    if (tpl) {
+        for (i = 0; i < tpl->nvars; i++) {
+            __cstmp_free__(__stp_arg__, tpl->var_keys[i].data);
+        }
+        if (tpl->head) {
+            __cstmp_free__(__stp_arg__, tpl->head);
+        }
+        __cstmp_free__(__stp_arg__, tpl);
+    }
+}
+
+/** Variable header block, "key:val\n" of each var then content-length and the blank line **/
+static u_char*
+_cstmp_template_vars(cstmp_template_t *tpl, const cstmp_frame_val_t *vals, size_t body_len, u_char *p) {
+    u_char num[24], *n = num + sizeof(num);
+    size_t i;
+    for (i = 0; i < tpl->nvars; i++) {
+        if (vals[i].data) {
+            p = cstmp_cpymem(p, tpl->var_keys[i].data, tpl->var_keys[i].len);
+            p = cstmp_cpymem(p, vals[i].data, vals[i].len);
+            *p++ = LF_CHAR;
+        }
+    }
+    do {
+        *--n = (u_char) ('0' + body_len % 10);
+    } while (body_len /= 10);
+    p = cstmp_cpymem(p, "content-length:", sizeof("content-length:") - 1);
+    p = cstmp_cpymem(p, n, (size_t) (num + sizeof(num) - n));
+    *p++ = LF_CHAR;
+    *p++ = LF_CHAR;
+    return p;
+}
+
+int
+cstmp_template_send(cstmp_session_t *sess, cstmp_template_t *tpl, const cstmp_frame_val_t *vals,
+                    const u_char *body, size_t body_len, int tries) {
+    u_char stack_vars[CSTMP_TEMPLATE_VARS_STACK], *vars = stack_vars, *last;
+    struct iovec iov[4];
+    cstmp_codec_ctx_t *c;
+    size_t i, orig_len = 0, need = sizeof("content-length:") + 24 + 2;
+    int success = 0;
+
+    if (!sess || !tpl || (tpl->nvars && !vals) || (!body && body_len)) {
+        fprintf(stderr, "%s\n", "Invalid template or session type");
+        return 0;
+    }
+    for (i = 0; i < tpl->nvars; i++) {
+        need += tpl->var_keys[i].len + vals[i].len + 1;
+    }
+
+    CSTMP_LOCK_WRITING;
+    /** same encoding as _cstmp_body_encode, the content-length of the vars is the compressed one **/
+    if ((c = sess->codec) != NULL) {
+        pthread_mutex_lock(&c->lock);
+        if (cstmp_codec_wants(c, body_len) && !memmem(tpl->head, tpl->head_len, "\ncontent-encoding:", sizeof("\ncontent-encoding:") - 1) &&
+                _cstmp_codec_compress(c, body, body_len, &c->out)) {
+            CSTMP_METRIC_ADD(sess, body_bytes_raw, (uint64_t) body_len);
+            CSTMP_METRIC_ADD(sess, body_bytes_encoded, (uint64_t) cstmp_buf_size((&c->out)));
+            orig_len = body_len;
+            body = c->out.start;
+            body_len = cstmp_buf_size((&c->out));
+            need += sizeof("content-encoding:\noriginal-length:\n") + 8 + 24;
+        }
+    }
+    if (need > CSTMP_TEMPLATE_VARS_STACK && (vars = __cstmp_alloc__(__stp_arg__, need)) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        vars = stack_vars;
+        goto TEMPLATE_DONE;
+    }
+    last = _cstmp_template_vars(tpl, vals, body_len, vars);
+    if (orig_len) {
+        /** before the blank line **/
+        last += sprintf((char*) last - 1, "content-encoding:%s\noriginal-length:%zu\n\n", __cstmp_codec_names[c->codec], orig_len) - 1;
+    }
+
+    cstmp_set_iov(&iov[0], tpl->head, tpl->head_len);
+    cstmp_set_iov(&iov[1], vars, (size_t) (last - vars));
+    cstmp_set_iov(&iov[2], body, body_len);
+    cstmp_set_iov(&iov[3], C_STMP_FRAME_END, 2);
+    success = _cstmp_sendv_frames(sess, iov, 4, 1, tries);
+
+TEMPLATE_DONE:
+    _cstmp_codec_done(c);
+    CSTMP_RELEASE_WRITING;
+    if (vars != stack_vars) {
+        __cstmp_free__(__stp_arg__, vars);
+    }
+    return success;
+}
+
+enum {
+    CSTMP_SCAN_CMD = 0,
+    CSTMP_SCAN_HEADERS,
+    CSTMP_SCAN_BODY
+};
+
+#define CSTMP_SCAN_AGAIN    0
+#define CSTMP_SCAN_DONE     1
+#define CSTMP_SCAN_ERROR    (-1)
+
+static void
+_cstmp_scan_reset(cstmp_scan_t *sc) {
+    sc->state = CSTMP_SCAN_CMD;
+    sc->off = 0;
+    sc->cmd_len = 0;
+    sc->hdr_start = sc->hdr_end = sc->body_start = 0;
+    sc->content_len = -1;
+    sc->hidx.nelts = 0;
+}
+
+#define _cstmp_rbuf_reset_scan(rb) _cstmp_scan_reset(&(rb)->scan)
+
+/**
+* Make sure there are at least need free bytes at the end of the read buffer, the unparsed bytes
+* are moved to the front first, grow only if the pending frame is bigger than the buffer.
+* All scan offsets are relative to pos, so they stay valid.
+**/
+static int
+_cstmp_rbuf_reserve(cstmp_read_buf_t *rb, size_t need) {
+    size_t pending, new_size;
+    u_char *start;
+
+    if (rb->start == NULL) {
+        for (new_size = cstmp_def_read_buf_size; new_size < need; new_size *= 2);
+        if ((rb->start = __cstmp_alloc__(__stp_arg__, new_size * sizeof(u_char))) == NULL) {
+            fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+            return 0;
+        }
+        rb->pos = rb->last = rb->start;
+        rb->total_size = new_size;
+        if (rb->direct_fr == NULL) {
+            /** a direct body still needs its content-length from the scan **/
+            _cstmp_rbuf_reset_scan(rb);
+        }
+        return 1;
+    }
+
+    if ((size_t) (rb->start + rb->total_size - rb->last) >= need) {
+        return 1;
+    }
+
+    pending = (size_t) (rb->last - rb->pos);
+    if (rb->pos != rb->start && rb->total_size - pending >= need) {
+        memmove(rb->start, rb->pos, pending);
+        rb->pos = rb->start;
+        rb->last = rb->start + pending;
+        return 1;
+    }
+
+    for (new_size = rb->total_size * 2; new_size - pending < need; new_size *= 2);
+    if ((start = __cstmp_alloc__(__stp_arg__, new_size * sizeof(u_char))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return 0;
+    }
+    memcpy(start, rb->pos, pending);
+    __cstmp_free__(__stp_arg__, rb->start);
+    rb->start = rb->pos = start;
+    rb->last = start + pending;
+    rb->total_size = new_size;
+    rb->grows++;
+    return 1;
+}
+
+/** Drop an oversized read buffer once it is fully consumed, so one huge frame does not pin the memory **/
+static void
+_cstmp_rbuf_consumed(cstmp_read_buf_t *rb) {
+    if (rb->pos == rb->last) {
+        if (rb->total_size > cstmp_def_read_buf_size * 4) {
+            __cstmp_free__(__stp_arg__, rb->start);
+            rb->start = rb->pos = rb->last = NULL;
+            rb->total_size = 0;
+        } else {
+            rb->pos = rb->last = rb->start;
+        }
+    }
+}
+
+/**
+* Locate the next complete frame in [*pos, last), resuming from the last scanned offset.
+* Returns CSTMP_SCAN_DONE with *frame_len set, CSTMP_SCAN_AGAIN if more bytes needed.
+* Heart-beat EOLs in front of a frame are skipped by moving *pos.
+**/
+static int
+_cstmp_frame_scan(cstmp_scan_t *sc, u_char **pos, u_char *last, size_t *frame_len) {
+    u_char *p, *line, *nl, *colon, *end;
+    size_t len, line_len;
+    cstmp_header_t *h;
+
+    if (sc->state == CSTMP_SCAN_CMD && sc->off == 0) {
+        /** skip heart-beat EOLs between frames **/
+        while (*pos < last && (**pos == '\n' || **pos == '\r')) {
+            (*pos)++;
+        }
+    }
+
+    p = *pos;
+    len = (size_t) (last - p);
+
+    switch (sc->state) {
+    case CSTMP_SCAN_CMD:
+        if ((nl = memchr(p + sc->off, LF_CHAR, len - sc->off)) == NULL) {
+            sc->off = len;
+            if (len > cstmp_max_cmd_size) {
+                return CSTMP_SCAN_ERROR;
+            }
+            return CSTMP_SCAN_AGAIN;
+        }
+        sc->cmd_len = (size_t) (nl - p);
+        if (sc->cmd_len && p[sc->cmd_len - 1] == '\r') {
+            sc->cmd_len--;
+        }
+        if (sc->cmd_len > cstmp_max_cmd_size) {
+            return CSTMP_SCAN_ERROR;
+        }
+        sc->hdr_start = sc->off = (size_t) (nl - p) + 1;
+        sc->state = CSTMP_SCAN_HEADERS;
+    /* fall through */
+    case CSTMP_SCAN_HEADERS:
+        end = p + len;
+        line = p + sc->off;
+        while ((nl = _cstmp_scan_line(line, end, &colon)) != NULL) {
+            line_len = (size_t) (nl - line);
+            if (line_len && line[line_len - 1] == '\r') {
+                line_len--;
+            }
+            if (line_len == 0) {
+                sc->hdr_end = (size_t) (line - p);
+                sc->body_start = sc->off = (size_t) (nl - p) + 1;
+                sc->state = CSTMP_SCAN_BODY;
+                break;
+            }
+            if ((h = _cstmp_header_index_line(&sc->hidx, p + sc->hdr_start, line, line_len, colon)) == NULL) {
+                return CSTMP_SCAN_ERROR;
+            }
+            /** the first content-length wins, per STOMP repeated header rule **/
+            if (sc->content_len < 0 && h->id == CSTMP_HDR_CONTENT_LENGTH) {
+                sc->content_len = strtol((char*) p + sc->hdr_start + h->val_off, NULL, 10);
+            }
+            line = nl + 1;
+        }
+        if (sc->state != CSTMP_SCAN_BODY) {
+            sc->off = (size_t) (line - p);
+            return CSTMP_SCAN_AGAIN;
+        }
+    /* fall through */
+    case CSTMP_SCAN_BODY:
+        if (sc->content_len >= 0) {
+            if (sc->body_start + sc->content_len + 1 > len) {
+                return CSTMP_SCAN_AGAIN;
+            }
+            if (p[sc->body_start + sc->content_len] != '\0') {
+                return CSTMP_SCAN_ERROR;
+            }
+            *frame_len = sc->body_start + sc->content_len + 1;
+            return CSTMP_SCAN_DONE;
+        }
+        /** single byte search, libc memchr is already vectorized for it **/
+        if ((nl = memchr(p + sc->off, '\0', len - sc->off)) == NULL) {
+            sc->off = len;
+            return CSTMP_SCAN_AGAIN;
+        }
+        sc->content_len = (long) ((size_t) (nl - p) - sc->body_start);
+        *frame_len = (size_t) (nl - p) + 1;
+        return CSTMP_SCAN_DONE;
+    }
+    return CSTMP_SCAN_ERROR;
+}
+
+#define _cstmp_rbuf_scan(rb, frame_len) _cstmp_frame_scan(&(rb)->scan, &(rb)->pos, (rb)->last, frame_len)
+
+/** Copy command and headers of the scanned frame at p, and take over the header index built while scanning **/
+static int
+_cstmp_scan_deliver_head(cstmp_scan_t *sc, const u_char *p, cstmp_frame_t *fr) {
+    cstmp_frame_buf_t *headers = &fr->headers;
+    size_t hdr_len = sc->hdr_end - sc->hdr_start;
+
+    cstmp_parse_cmd(fr, (u_char*) p, sc->cmd_len);
+
+    if (!_cstmp_buf_reserve(headers, hdr_len + 1)) {
+        return 0;
+    }
+    headers->last = cstmp_cpymem(headers->start, p + sc->hdr_start, hdr_len);
+    *headers->last = '\0';
+
+    if (fr->hidx.nalloc < sc->hidx.nelts) {
+        if (fr->hidx.elts) {
+            __cstmp_free__(__stp_arg__, fr->hidx.elts);
+        }
+        if ((fr->hidx.elts = __cstmp_alloc__(__stp_arg__, sc->hidx.nalloc * sizeof(cstmp_header_t))) == NULL) {
+            fr->hidx.nalloc = 0;
+            cstmp_hidx_reset(&fr->hidx);
+            return 0;
+        }
+        fr->hidx.nalloc = sc->hidx.nalloc;
+    }
+    if (sc->hidx.nelts) {
+        memcpy(fr->hidx.elts, sc->hidx.elts, sc->hidx.nelts * sizeof(cstmp_header_t));
+    }
+    fr->hidx.nelts = sc->hidx.nelts;
+    fr->hidx.indexed = hdr_len;
+    fr->hidx.nhashed = 0;
+    return 1;
+}
+
+#define _cstmp_rbuf_deliver_head(rb, fr) _cstmp_scan_deliver_head(&(rb)->scan, (rb)->pos, fr)
+
+/** Copy the scanned frame at p into the frame, headers and body are NUL terminated **/
+static int
+_cstmp_scan_deliver(cstmp_scan_t *sc, const u_char *p, cstmp_frame_t *fr) {
+    cstmp_frame_buf_t *body;
+    size_t body_len = (size_t) sc->content_len;
+
+    if (!_cstmp_scan_deliver_head(sc, p, fr) || !_cstmp_body_reserve(fr, body_len + 1)) {
+        return 0;
+    }
+    body = &fr->body;
+    body->last = cstmp_cpymem(body->start, p + sc->body_start, body_len);
+    *body->last = '\0';
+    return 1;
+}
+
+/** Copy the scanned frame out of the read buffer and consume it **/
+static int
+_cstmp_rbuf_deliver(cstmp_read_buf_t *rb, cstmp_frame_t *fr, size_t frame_len) {
+    int success = _cstmp_scan_deliver(&rb->scan, rb->pos, fr);
+
+    rb->pos += frame_len;
+    _cstmp_rbuf_reset_scan(rb);
+    _cstmp_rbuf_consumed(rb);
+    return success;
+}
+
+/**
+* Large body with content-length, the headers are delivered now and the rest of the body
+* is received straight into the frame body (or lent buffer), skipping the read buffer.
+**/
+static int
+_cstmp_rbuf_begin_direct(cstmp_read_buf_t *rb, cstmp_frame_t *fr) {
+    cstmp_frame_buf_t *body;
+    size_t buffered = (size_t) (rb->last - rb->pos) - rb->scan.body_start;
+
+    if (!_cstmp_rbuf_deliver_head(rb, fr) || !_cstmp_body_reserve(fr, (size_t) rb->scan.content_len + 1)) {
+        return 0;
+    }
+    body = &fr->body;
+    body->last = cstmp_cpymem(body->start, rb->pos + rb->scan.body_start, buffered);
+    rb->pos = rb->last;
+    _cstmp_rbuf_consumed(rb);
+    rb->direct_fr = fr;
+    return 1;
+}
+
+static int
+_cstmp_recv_frame_io(cstmp_session_t *sess, cstmp_frame_t *fr, u_char *lend, size_t lend_size, int tries) {
+    int success = 0, connfd, rc;
+    ssize_t n;
+    size_t frame_len, want;
+    cstmp_read_buf_t *rb;
+    cstmp_frame_buf_t *body;
+    if (fr && sess) {
+        connfd = sess->sock;
+        rb = &sess->rbuf;
+        CSTMP_LOCK_READING;
+        if (rb->streaming) {
+            fprintf(stderr, "%s\n", "Error, streamed frame in progress, resume with cstmp_recv_stream");
+            CSTMP_RELEASE_READING;
+            return CSTMP_RECV_ERROR;
+        }
+        if (rb->direct_fr && rb->direct_fr != fr) {
+            /** partial body belongs to another frame, skip the rest of it and its NUL **/
+            fprintf(stderr, "%s\n", "Error, partial frame body dropped, resume with the same frame");
+            rb->skip = (size_t) rb->scan.content_len - cstmp_buf_size((&rb->direct_fr->body)) + 1;
+            rb->direct_fr = NULL;
+            _cstmp_rbuf_reset_scan(rb);
+        }
+        if (rb->direct_fr == NULL) {
+            cstmp_reset_frame(fr);
+            if (lend && lend_size) {
+                fr->body_own = fr->body;
+                fr->body.start = fr->body.last = lend;
+                fr->body.total_size = lend_size;
+                fr->body.flags = CSTMP_BUF_LENT;
+            }
+        }
+        for (;;) {
+            body = &fr->body;
+            if (rb->skip && rb->start) {
+                want = (size_t) (rb->last - rb->pos) < rb->skip ? (size_t) (rb->last - rb->pos) : rb->skip;
+                rb->pos += want;
+                rb->skip -= want;
+                _cstmp_rbuf_consumed(rb);
+            }
+            if (rb->direct_fr) {
+                if ((want = (size_t) rb->scan.content_len - cstmp_buf_size(body)) == 0) {
+                    /** body is complete, the frame terminator comes through the read buffer **/
+                    if (rb->start && rb->pos < rb->last) {
+                        rb->direct_fr = NULL;
+                        success = *rb->pos++ == '\0' ? CSTMP_RECV_OK : CSTMP_RECV_ERROR;
+                        *body->last = '\0';
+                        _cstmp_rbuf_reset_scan(rb);
+                        _cstmp_rbuf_consumed(rb);
+                        FRAME_READ_RETURN(success);
+                    }
+                } else {
+                    CSTMP_METRIC_ADD(sess, recv_calls, 1);
+                    if ((n = recv(connfd, body->last, want, 0)) > 0) {
+                        CSTMP_METRIC_ADD(sess, bytes_recv, (uint64_t) n);
+                        body->last += n;
+                        sess->hb_recvd = 1;
+                        continue;
+                    }
+                    goto RECV_CHECK;
+                }
+            } else if (!rb->skip && rb->start && (rc = _cstmp_rbuf_scan(rb, &frame_len)) != CSTMP_SCAN_AGAIN) {
+                if (rc == CSTMP_SCAN_ERROR) {
+                    /** stream is out of sync, drop what we have **/
+                    rb->pos = rb->last = rb->start;
+                    _cstmp_rbuf_reset_scan(rb);
+                    FRAME_READ_RETURN(CSTMP_RECV_ERROR);
+                }
+                success = _cstmp_rbuf_deliver(rb, fr, frame_len) ? CSTMP_RECV_OK : CSTMP_RECV_ERROR;
+                FRAME_READ_RETURN(success);
+            } else if (!rb->skip && rb->start && rb->scan.state == CSTMP_SCAN_BODY && rb->scan.content_len >= cstmp_def_read_buf_size) {
+                if (!_cstmp_rbuf_begin_direct(rb, fr)) {
+                    FRAME_READ_RETURN(CSTMP_RECV_ERROR);
+                }
+                continue;
+            }
+
+            if (!_cstmp_rbuf_reserve(rb, 1)) {
+                FRAME_READ_RETURN(CSTMP_RECV_ERROR);
+            }
+            CSTMP_METRIC_ADD(sess, recv_calls, 1);
+            n = recv(connfd, rb->last, (rb->start + rb->total_size) - rb->last, 0);
+            if (n > 0) {
+                CSTMP_METRIC_ADD(sess, bytes_recv, (uint64_t) n);
+                rb->last += n;
+                sess->hb_recvd = 1;
+                continue;
+            }
+RECV_CHECK:
+            if (n == 0) {
+                /** end of file **/
+                CSTMP_RELEASE_READING;
+                return CSTMP_RECV_ERROR;
+            }
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+                fprintf(stderr, "Error while process socket read/write: %s\n", strerror(errno));
+                FRAME_READ_RETURN(CSTMP_RECV_ERROR);
+            }
+            /** timeout or non-blocking, the partial frame stays in the read buffer (or frame body) for next call **/
+            if (errno != EINTR && !sess->nonblocking) {
+                CSTMP_METRIC_ADD(sess, recv_timeouts, 1);
+            }
+            if (errno != EINTR && (sess->nonblocking || tries-- <= 0)) {
+                break;
+            }
+        }
+        CSTMP_RELEASE_READING;
+    } else {
+        fprintf(stderr, "%s\n", "Invalid Frame type");
+        success = CSTMP_RECV_ERROR;
+    }
+    return success; /*Failed*/
+}
+
+/** Frame receive with the latency and size accounted when the session has metrics, compressed body decoded after **/
+static int
+_cstmp_recv_frame(cstmp_session_t *sess, cstmp_frame_t *fr, u_char *lend, size_t lend_size, int tries) {
+    uint64_t start;
+    int rc;
+    if (!sess || !sess->metrics) {
+        rc = _cstmp_recv_frame_io(sess, fr, lend, lend_size, tries);
+    } else {
+        start = _cstmp_now_ns();
+        if ((rc = _cstmp_recv_frame_io(sess, fr, lend, lend_size, tries)) == CSTMP_RECV_OK) {
+            _cstmp_metrics_frame(sess, &sess->metrics->recv_ns, _cstmp_now_ns() - start,
+                                 strlen(fr->cmd) + cstmp_buf_size((&fr->headers)) + cstmp_buf_size((&fr->body)) + 4, 0);
+        }
+    }
+    if (rc == CSTMP_RECV_OK) {
+        CSTMP_LOCK_READING;
+        if (!_cstmp_body_decode(sess, fr)) {
+            rc = CSTMP_RECV_ERROR;
+        }
+        CSTMP_RELEASE_READING;
+    }
+    return rc;
+}
+
+int
+cstmp_recv(cstmp_session_t *sess, cstmp_frame_t *fr, int tries) {
+    return _cstmp_recv_frame(sess, fr, NULL, 0, tries) == CSTMP_RECV_OK;
+}
+
+int
+cstmp_recv_into(cstmp_session_t *sess, cstmp_frame_t *fr, u_char *body_buf, size_t body_buf_size, int tries) {
+    return _cstmp_recv_frame(sess, fr, body_buf, body_buf_size, tries) == CSTMP_RECV_OK;
+}
+
+cstmp_parser_t*
+cstmp_parser_create(cstmp_parser_handler_pt on_frame, void *arg) {
+    cstmp_parser_t *parser;
+
+    if (!on_frame) {
+        fprintf(stderr, "%s\n", "Invalid parser frame handler");
+        return NULL;
+    }
+    if ((parser = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_parser_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(parser, sizeof(cstmp_parser_t));
+    if ((parser->fr = cstmp_new_frame()) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        __cstmp_free__(__stp_arg__, parser);
+        return NULL;
+    }
+    parser->on_frame = on_frame;
+    parser->arg = arg;
+    _cstmp_rbuf_reset_scan(&parser->rbuf);
+    return parser;
+}
+
+/**
+* Frames are scanned in place in the caller buffer when nothing is carried over, only the
+* unfinished tail is copied into the parser. Otherwise the new bytes are appended to the tail.
+**/
+ssize_t
+cstmp_parser_feed(cstmp_parser_t *parser, const u_char *buf, size_t len) {
+    cstmp_read_buf_t *rb;
+    cstmp_scan_t scan;
+    u_char *in, **pos, *last;
+    size_t frame_len, tail;
+    ssize_t nframes = 0;
+    int rc, buffered, delivered;
+
+    if (!parser || (!buf && len)) {
+        fprintf(stderr, "%s\n", "Invalid parser or buffer");
+        return -1;
+    }
+    if (parser->failed) {
+        return -1;
+    }
+    rb = &parser->rbuf;
+    if ((buffered = rb->start && rb->pos < rb->last)) {
+        if (len) {
+            if (!_cstmp_rbuf_reserve(rb, len)) {
+                goto PARSE_FAILED;
+            }
+            rb->last = cstmp_cpymem(rb->last, buf, len);
+        }
+        pos = &rb->pos;
+        last = rb->last;
+    } else {
+        if (len == 0) {
+            return 0;
+        }
+        in = (u_char*) buf;
+        pos = &in;
+        last = in + len;
+    }
+
+    while ((rc = _cstmp_frame_scan(&rb->scan, pos, last, &frame_len)) == CSTMP_SCAN_DONE) {
+        cstmp_reset_frame(parser->fr);
+        delivered = _cstmp_scan_deliver(&rb->scan, *pos, parser->fr);
+        *pos += frame_len;
+        _cstmp_rbuf_reset_scan(rb);
+        if (!delivered) {
+            goto PARSE_FAILED;
+        }
+        nframes++;
+        if (!parser->on_frame(parser->fr, parser->arg)) {
+            break;
+        }
+    }
+    if (rc == CSTMP_SCAN_ERROR) {
+        fprintf(stderr, "%s\n", "Error, malformed STOMP frame");
+        goto PARSE_FAILED;
+    }
+
+    if (buffered) {
+        _cstmp_rbuf_consumed(rb);
+    } else if ((tail = (size_t) (last - *pos)) > 0) {
+        /** a fresh read buffer resets the scan, the progress belongs to the tail being copied **/
+        scan = rb->scan;
+        if (!_cstmp_rbuf_reserve(rb, tail)) {
+            goto PARSE_FAILED;
+        }
+        rb->scan = scan;
+        rb->last = cstmp_cpymem(rb->last, *pos, tail);
+    }
+    return nframes;
+
+PARSE_FAILED:
+    parser->failed = 1;
+    return -1;
+}
+
+void
+cstmp_parser_reset(cstmp_parser_t *parser) {
+    if (parser) {
+        parser->rbuf.pos = parser->rbuf.last = parser->rbuf.start;
+        _cstmp_rbuf_reset_scan(&parser->rbuf);
+        parser->failed = 0;
+    }
+}
+
+void
+cstmp_parser_destroy(cstmp_parser_t *parser) {
+    if (parser) {
+        if (parser->rbuf.start)
+            __cstmp_free__(__stp_arg__, parser->rbuf.start);
+        if (parser->rbuf.scan.hidx.elts)
+            __cstmp_free__(__stp_arg__, parser->rbuf.scan.hidx.elts);
+        cstmp_destroy_frame(parser->fr);
+        __cstmp_free__(__stp_arg__, parser);
+    }
+}
+
+#define CSTMP_SPLICE_CHUNK  (64 * 1024)
+
+typedef int (*cstmp_chunk_handler_pt)(cstmp_frame_t *fr, const u_char *data, size_t len, void *arg);
+
+static int
+_cstmp_write_fd_chunk(cstmp_frame_t *fr, const u_char *data, size_t len, void *arg) {
+    int fd = *(int*) arg;
+    ssize_t n;
+    while (len) {
+        if ((n = write(fd, data, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error while writing frame body: %s\n", strerror(errno));
+            return 0;
+        }
+        data += n;
+        len -= (size_t) n;
+    }
+    return 1;
+}
+
+/** Move up to want bytes socket -> pipe -> fd, returns the bytes spliced, 0 on EOF, -1 with errno **/
+static ssize_t
+_cstmp_splice_body(int sock, int pipefd[2], int fd, size_t want) {
+    ssize_t n, m, out = 0;
+    if ((n = splice(sock, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE)) <= 0) {
+        return n;
+    }
+    while (out < n) {
+        if ((m = splice(pipefd[0], NULL, fd, NULL, (size_t) (n - out), SPLICE_F_MOVE)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /** the pipe must never keep bytes between calls **/
+            fprintf(stderr, "Error while splicing frame body: %s\n", strerror(errno));
+            return -2;
+        }
+        out += m;
+    }
+    return n;
+}
+
+/**
+* Streaming receive, the headers go into fr and the body is handed out in chunks as it arrives,
+* only the read buffer is used so memory stays bounded. With fd >= 0 the content-length part of
+* the body which is not buffered yet is spliced from the socket.
+**/
+static int
+_cstmp_recv_stream(cstmp_session_t *sess, cstmp_frame_t *fr, cstmp_chunk_handler_pt handler, void *arg,
+                   int fd, int tries) {
+    cstmp_read_buf_t *rb;
+    size_t frame_len, avail, take;
+    int pipefd[2] = { -1, -1 }, rc, success = CSTMP_RECV_AGAIN;
+    u_char *nul;
+    ssize_t n;
+
+    if (!sess || !fr || !handler) {
+        fprintf(stderr, "%s\n", "Invalid Frame type");
+        return CSTMP_RECV_ERROR;
+    }
+    rb = &sess->rbuf;
+    CSTMP_LOCK_READING;
+    if (rb->direct_fr) {
+        fprintf(stderr, "%s\n", "Error, partial frame in progress, resume with cstmp_recv_into");
+        FRAME_READ_RETURN(CSTMP_RECV_ERROR);
+    }
+
+    for (;;) {
+        if (rb->skip && rb->start) {
+            take = (size_t) (rb->last - rb->pos) < rb->skip ? (size_t) (rb->last - rb->pos) : rb->skip;
+            rb->pos += take;
+            rb->skip -= take;
+            _cstmp_rbuf_consumed(rb);
+        }
+        if (!rb->streaming) {
+            if (rb->start && !rb->skip && (rc = _cstmp_rbuf_scan(rb, &frame_len)) != CSTMP_SCAN_AGAIN) {
+                if (rc == CSTMP_SCAN_ERROR) {
+                    rb->pos = rb->last = rb->start;
+                    _cstmp_rbuf_reset_scan(rb);
+                    success = CSTMP_RECV_ERROR;
+                    break;
+                }
+                /** the whole frame is buffered already, one chunk **/
+                cstmp_reset_frame(fr);
+                if (!_cstmp_rbuf_deliver_head(rb, fr) ||
+                        (rb->scan.content_len && !handler(fr, rb->pos + rb->scan.body_start, (size_t) rb->scan.content_len, arg))) {
+                    success = CSTMP_RECV_ERROR;
+                } else {
+                    success = CSTMP_RECV_OK;
+                }
+                rb->pos += frame_len;
+                _cstmp_rbuf_reset_scan(rb);
+                _cstmp_rbuf_consumed(rb);
+                break;
+            }
+            if (rb->start && !rb->skip && rb->scan.state == CSTMP_SCAN_BODY) {
+                cstmp_reset_frame(fr);
+                if (!_cstmp_rbuf_deliver_head(rb, fr)) {
+                    success = CSTMP_RECV_ERROR;
+                    break;
+                }
+                rb->streaming = 1;
+                rb->stream_left = rb->scan.content_len;
+                rb->pos += rb->scan.body_start;
+                _cstmp_rbuf_reset_scan(rb);
+            }
+        }
+
+        if (rb->streaming && rb->start && rb->pos < rb->last) {
+            avail = (size_t) (rb->last - rb->pos);
+            if (rb->stream_left < 0) {
+                nul = memchr(rb->pos, '\0', avail);
+                take = nul ? (size_t) (nul - rb->pos) : avail;
+            } else {
+                take = avail < (size_t) rb->stream_left ? avail : (size_t) rb->stream_left;
+                nul = take < avail ? rb->pos + take : NULL;
+                rb->stream_left -= take;
+            }
+            if (take && rb->streaming == 1 && !handler(fr, rb->pos, take, arg)) {
+                /** aborted, the rest of the body is drained to stay in sync **/
+                rb->streaming = 2;
+            }
+            rb->pos += take;
+            if (nul) {
+                success = *rb->pos++ == '\0' && rb->streaming == 1 ? CSTMP_RECV_OK : CSTMP_RECV_ERROR;
+                rb->streaming = 0;
+                _cstmp_rbuf_consumed(rb);
+                break;
+            }
+            _cstmp_rbuf_consumed(rb);
+            continue;
+        }
+
+        if (rb->streaming == 1 && fd >= 0 && rb->stream_left > 0) {
+            if (pipefd[0] < 0 && pipe2(pipefd, O_CLOEXEC) < 0) {
+                fprintf(stderr, "Error: Unable to create splice pipe: %s\n", strerror(errno));
+                success = CSTMP_RECV_ERROR;
+                break;
+            }
+            n = _cstmp_splice_body(sess->sock, pipefd, fd,
+                                   rb->stream_left < CSTMP_SPLICE_CHUNK ? (size_t) rb->stream_left : CSTMP_SPLICE_CHUNK);
+            CSTMP_METRIC_ADD(sess, recv_calls, 1);
+            if (n > 0) {
+                CSTMP_METRIC_ADD(sess, bytes_recv, (uint64_t) n);
+                rb->stream_left -= n;
+                sess->hb_recvd = 1;
+                continue;
+            }
+            if (n == -2) {
+                success = CSTMP_RECV_ERROR;
+                break;
+            }
+        } else {
+            if (!_cstmp_rbuf_reserve(rb, 1)) {
+                success = CSTMP_RECV_ERROR;
+                break;
+            }
+            CSTMP_METRIC_ADD(sess, recv_calls, 1);
+            if ((n = recv(sess->sock, rb->last, (rb->start + rb->total_size) - rb->last, 0)) > 0) {
+                CSTMP_METRIC_ADD(sess, bytes_recv, (uint64_t) n);
+                rb->last += n;
+                sess->hb_recvd = 1;
+                continue;
+            }
+        }
+        if (n == 0) {
+            /** end of file **/
+            success = CSTMP_RECV_ERROR;
+            break;
+        }
+        if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "Error while process socket read/write: %s\n", strerror(errno));
+            success = CSTMP_RECV_ERROR;
+            break;
+        }
+        /** timeout or non-blocking, the stream resumes on the next call **/
+        if (errno != EINTR && (sess->nonblocking || tries-- <= 0)) {
+            break;
+        }
+    }
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    if (success == CSTMP_RECV_OK) {
+        CSTMP_METRIC_ADD(sess, frames_recv, 1);
+    }
+    FRAME_READ_RETURN(success);
+}
+
+int
+cstmp_recv_stream(cstmp_session_t *sess, cstmp_frame_t *fr,
+                  int (*on_chunk)(cstmp_frame_t *fr, const u_char *data, size_t len, void *arg), void *arg, int tries) {
+    return _cstmp_recv_stream(sess, fr, on_chunk, arg, -1, tries) == CSTMP_RECV_OK;
+}
+
+int
+cstmp_recv_to_fd(cstmp_session_t *sess, cstmp_frame_t *fr, int fd, int tries) {
+    return _cstmp_recv_stream(sess, fr, _cstmp_write_fd_chunk, &fd, fd, tries) == CSTMP_RECV_OK;
+}
+
+int
+cstmp_detach_body(cstmp_frame_t *fr, cstmp_frame_val_t *body_val) {
+    cstmp_frame_buf_t *body;
+    u_char *fresh;
+
+    body_val->data = NULL;
+    body_val->len = 0;
+    if (!fr) {
+        return 0;
+    }
+    body = &fr->body;
+
+    if (body->flags & CSTMP_BUF_LENT) {
+        /** already caller memory, just give it back **/
+        body_val->data = body->start;
+        body_val->len = cstmp_buf_size(body);
+        fr->body = fr->body_own;
+        fr->body.last = fr->body.start;
+        return 1;
+    }
+
+    if (body->flags & CSTMP_BUF_INLINE) {
+        /** inline body is small, caller gets its own copy **/
+        if ((fresh = __cstmp_alloc__(__stp_arg__, (cstmp_buf_size(body) + 1) * sizeof(u_char))) == NULL) {
+            fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+            return 0;
+        }
+        body_val->len = cstmp_buf_size(body);
+        body_val->data = fresh;
+        *cstmp_cpymem(fresh, body->start, body_val->len) = '\0';
+        body->last = body->start;
+        *body->start = '\0';
+        return 1;
+    }
+
+    /** grown body is handed over as is, the frame falls back to its inline buffer **/
+    body_val->data = body->start;
+    body_val->len = cstmp_buf_size(body);
+    _cstmp_frame_inline_body(fr);
+    return 1;
+}
+
+void
+cstmp_free_body(u_char *data) {
+    if (data) {
+        __cstmp_free__(__stp_arg__, data);
+    }
+}
+
+static int
+_cstmp_set_nonblocking(cstmp_session_t *sess, int on) {
+    int flags = fcntl(sess->sock, F_GETFL, 0);
+    flags = on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (flags < 0 || fcntl(sess->sock, F_SETFL, flags) != 0) {
+        fprintf(stderr, "Error setting non-blocking mode on socket: %s\n", strerror(errno));
+        return 0;
+    }
+    sess->nonblocking = on;
+    return 1;
+}
+
+/** heart-beat check period is twice the negotiated receive interval, to tolerate late beats **/
+#define CSTMP_HB_GRACE 2
+
+static int
+_cstmp_timerfd(int interval_ms) {
+    struct itimerspec its;
+    int tfd;
+    if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error: Unable to create timerfd: %s\n", strerror(errno));
+        return -1;
+    }
+    its.it_interval.tv_sec = its.it_value.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = its.it_value.tv_nsec = (interval_ms % 1000) * 1000000L;
+    if (timerfd_settime(tfd, 0, &its, NULL) < 0) {
+        fprintf(stderr, "Error: Unable to arm timerfd: %s\n", strerror(errno));
+        close(tfd);
+        return -1;
+    }
+    return tfd;
+}
+
+static void
+_cstmp_heartbeat_close(cstmp_session_t *sess) {
+    if (sess->hb_send_tfd >= 0) {
+        close(sess->hb_send_tfd);
+        sess->hb_send_tfd = -1;
+    }
+    if (sess->hb_recv_tfd >= 0) {
+        close(sess->hb_recv_tfd);
+        sess->hb_recv_tfd = -1;
+    }
+    sess->hb_send_ms = sess->hb_recv_ms = 0;
+}
+
+int
+cstmp_heartbeat_setup(cstmp_session_t *sess, cstmp_frame_t *connected, int cx, int cy) {
+    cstmp_frame_val_t hb;
+    long sx = 0, sy = 0;
+    char *end;
+
+    if (!sess || !connected) {
+        return 0;
+    }
+    if (cstmp_get_header(connected, "heart-beat", &hb)) {
+        sx = strtol((char*) hb.data, &end, 10);
+        if (*end == ',') {
+            sy = strtol(end + 1, NULL, 10);
+        }
+    }
+
+    /** STOMP 1.2: 0 on either side means no heart-beat in that direction **/
+    /** a re-CONNECT renegotiates, the timers of the last one go away **/
+    _cstmp_heartbeat_close(sess);
+    sess->hb_send_ms = (cx > 0 && sy > 0) ? (cx > sy ? cx : (int) sy) : 0;
+    sess->hb_recv_ms = (cy > 0 && sx > 0) ? (cy > sx ? cy : (int) sx) : 0;
+    sess->hb_sent = sess->hb_recvd = sess->hb_dead = 0;
+
+    if (sess->hb_send_ms > 0 && (sess->hb_send_tfd = _cstmp_timerfd(sess->hb_send_ms)) < 0) {
+        sess->hb_send_ms = 0;
+        return 0;
+    }
+    if (sess->hb_recv_ms > 0 && (sess->hb_recv_tfd = _cstmp_timerfd(sess->hb_recv_ms * CSTMP_HB_GRACE)) < 0) {
+        sess->hb_recv_ms = 0;
+        _cstmp_heartbeat_close(sess);
+        return 0;
+    }
+    return 1;
+}
+
+int
+cstmp_stomp_connect_hb(cstmp_session_t *sess, const char *login, const char *passcode, const char *vhost,
+                       int cx, int cy, int tries) {
+    cstmp_frame_t *fr;
+    char hb[32];
+    int success = 0;
+
+    if (!sess || (fr = cstmp_new_frame()) == NULL) {
+        return 0;
+    }
+    fr->cmd = "CONNECT";
+    cstmp_add_header(fr, "accept-version", "1.2");
+    cstmp_add_header(fr, "host", vhost ? vhost : "/");
+    if (login)
+        cstmp_add_header(fr, "login", login);
+    if (passcode)
+        cstmp_add_header(fr, "passcode", passcode);
+    sprintf(hb, "%d,%d", cx, cy);
+    cstmp_add_header(fr, "heart-beat", hb);
+
+    if (cstmp_send(sess, fr, tries) && cstmp_recv(sess, fr, tries)) {
+        if (fr->cmd_id == CSTMP_CMD_CONNECTED) {
+            success = cstmp_heartbeat_setup(sess, fr, cx, cy);
+        } else {
+            fprintf(stderr, "STOMP connect refused: %.*s\n", (int) cstmp_buf_size((&fr->body)), fr->body.start);
+        }
+    }
+    cstmp_destroy_frame(fr);
+    return success;
+}
+
+static int _cstmp_writer_queue_raw(cstmp_writer_t *w, u_char *data, size_t len);
+
+/** Send timer tick, an EOL goes out only when nothing was written since the last tick **/
+static void
+_cstmp_heartbeat_send_tick(cstmp_session_t *sess) {
+    struct iovec iov;
+    uint64_t expired;
+    if (read(sess->hb_send_tfd, &expired, sizeof(expired)) < 0) {
+        return;
+    }
+    if (!__sync_lock_test_and_set(&sess->hb_sent, 0)) {
+        if (sess->writer) {
+            /** the writer thread may be in the middle of a frame, the EOL queues behind it **/
+            _cstmp_writer_queue_raw(sess->writer, LF, 1);
+        } else {
+            cstmp_set_iov(&iov, LF, 1);
+            CSTMP_LOCK_WRITING;
+            _cstmp_sendv(sess, &iov, 1, 0);
+            CSTMP_RELEASE_WRITING;
+        }
+        CSTMP_METRIC_ADD(sess, heartbeats_sent, 1);
+        sess->hb_sent = 0;
+    }
+}
+
+/** Check timer tick, returns 0 when nothing came in for the whole period, the link is dead **/
+static int
+_cstmp_heartbeat_recv_tick(cstmp_session_t *sess) {
+    uint64_t expired;
+    if (read(sess->hb_recv_tfd, &expired, sizeof(expired)) < 0) {
+        return 1;
+    }
+    if (!__sync_lock_test_and_set(&sess->hb_recvd, 0)) {
+        fprintf(stderr, "Heart-beat lost, no data in %d ms\n", sess->hb_recv_ms * CSTMP_HB_GRACE);
+        sess->hb_dead = 1;
+        return 0;
+    }
+    return 1;
+}
+
+int
+cstmp_heartbeat_alive(cstmp_session_t *sess) {
+    return sess && !sess->hb_dead;
+}
+
+/** Consume without SO_RCVTIMEO polling, sleep in poll until data or a heart-beat timer **/
+static void
+_cstmp_consume_heartbeat(cstmp_session_t *sess, cstmp_frame_t *fr, void (*callback)(cstmp_frame_t *), int *consuming) {
+    struct pollfd pfds[3];
+    int rc, npfd = 0, was_nonblocking = sess->nonblocking;
+
+    pfds[npfd].fd = sess->sock;
+    pfds[npfd++].events = POLLIN;
+    if (sess->hb_send_ms > 0) {
+        pfds[npfd].fd = sess->hb_send_tfd;
+        pfds[npfd++].events = POLLIN;
+    }
+    if (sess->hb_recv_ms > 0) {
+        pfds[npfd].fd = sess->hb_recv_tfd;
+        pfds[npfd++].events = POLLIN;
+    }
+
+    if (!was_nonblocking && !_cstmp_set_nonblocking(sess, 1)) {
+        return;
+    }
+    while (*consuming && !sess->hb_dead) {
+        rc = _cstmp_recv_frame(sess, fr, NULL, 0, 0);
+        if (rc == CSTMP_RECV_OK) {
+            callback(fr);
+            continue;
+        }
+        if (rc == CSTMP_RECV_ERROR) {
+            break;
+        }
+        if (poll(pfds, npfd, -1) < 0 && errno != EINTR) {
+            fprintf(stderr, "Error while waiting session events: %s\n", strerror(errno));
+            break;
+        }
+        for (rc = 1; rc < npfd; rc++) {
+            if (!(pfds[rc].revents & POLLIN)) {
+                continue;
+            }
+            if (pfds[rc].fd == sess->hb_send_tfd) {
+                _cstmp_heartbeat_send_tick(sess);
+            } else {
+                _cstmp_heartbeat_recv_tick(sess);
+            }
+        }
+    }
+    if (!was_nonblocking) {
+        _cstmp_set_nonblocking(sess, 0);
+    }
+}
+
+void
+cstmp_consume(cstmp_session_t *sess, cstmp_frame_t *fr, void (*callback)(cstmp_frame_t *), int *consuming) {
+    if (sess->hb_send_ms > 0 || sess->hb_recv_ms > 0) {
+        _cstmp_consume_heartbeat(sess, fr, callback, consuming);
+        return;
+    }
+    while (*consuming) {
+        if (cstmp_recv(sess, fr, 0)) {
+            callback(fr);
+        }
+    }
+}
+
+#define CSTMP_LOOP_MAX_EVENTS       64
+#define CSTMP_LOOP_FRAMES_PER_WAKE  64
+#define CSTMP_LOOP_HB_SEND          1
+#define CSTMP_LOOP_HB_RECV          2
+#define CSTMP_LOOP_HB_MASK          3
+
+static void _cstmp_loop_conn_close(cstmp_loop_t *loop, cstmp_loop_conn_t *conn);
+
+static void
+_cstmp_loop_conn_free(cstmp_loop_conn_t *conn) {
+    cstmp_destroy_frame(conn->fr);
+    if (conn->parser)
+        cstmp_parser_destroy(conn->parser);
+    cstmp_buf_free(&conn->out[0]);
+    cstmp_buf_free(&conn->out[1]);
+    __cstmp_free__(__stp_arg__, conn);
+}
+
+#ifdef CSTOMP_IO_URING
+
+static void
+_cstmp_rbuf_swap(cstmp_read_buf_t *a, cstmp_read_buf_t *b) {
+    cstmp_read_buf_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+#define CSTMP_URING_ENTRIES     256
+#define CSTMP_URING_BUFS        128 /* power of two */
+#define CSTMP_URING_BUF_SIZE    cstmp_def_read_buf_size
+#define CSTMP_URING_OUT_SIZE    cstmp_def_read_buf_size
+#define CSTMP_URING_BGID        0
+#define CSTMP_URING_SETTLE_MS   10
+#define CSTMP_URING_SETTLE_TRIES 100
+/** user_data is the registration with the operation in the low bits, heart-beat tags as epoll **/
+#define CSTMP_URING_RECV        0
+#define CSTMP_URING_SEND        4
+#define CSTMP_URING_CANCEL      5
+#define CSTMP_URING_BACKLOG     6
+#define CSTMP_URING_TAG_MASK    7
+#define CSTMP_URING_WAKE        ((uint64_t) 1) /* no registration lives at address 0 */
+
+typedef struct cstmp_uring_s {
+    int fd;
+    struct io_uring_params params;
+    u_char *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    uint16_t br_tail;
+    u_char *bufs;
+    int single_shot; /* kernel without multishot receive */
+} cstmp_uring_t;
+
+static void _cstmp_uring_destroy(cstmp_uring_t *u);
+
+/**
+* Submit what is queued, and with min_complete wait up to timeout_ms (-1 forever) for completions.
+* Timeout and signal are not errors.
+**/
+static int
+_cstmp_uring_enter(cstmp_uring_t *u, unsigned min_complete, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned submit, flags = 0;
+    void *argp = NULL;
+    long rc;
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (min_complete) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout_ms >= 0) {
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+            bzero(&arg, sizeof(arg));
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+            flags |= IORING_ENTER_EXT_ARG;
+            argp = &arg;
+        }
+    } else if (!submit) {
+        return 0;
+    }
+    rc = syscall(__NR_io_uring_enter, u->fd, submit, min_complete, flags, argp, argp ? sizeof(arg) : 0);
+    if (rc < 0 && errno != ETIME && errno != EINTR) {
+        return -1;
+    }
+    return 1;
+}
+
+/** Next free SQE, the queued ones are submitted first when the ring is full **/
+static struct io_uring_sqe*
+_cstmp_uring_sqe(cstmp_uring_t *u) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->params.sq_entries) {
+        if (_cstmp_uring_enter(u, 0, 0) < 0 ||
+                u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->params.sq_entries) {
+            fprintf(stderr, "Error: io_uring submission queue full: %s\n", strerror(errno));
+            return NULL;
+        }
+    }
+    idx = u->sq_local_tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    bzero(sqe, sizeof(struct io_uring_sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    return sqe;
+}
+
+static void
+_cstmp_uring_buf_put(cstmp_uring_t *u, uint16_t bid) {
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (CSTMP_URING_BUFS - 1)];
+    b->addr = (uint64_t) (uintptr_t) (u->bufs + (size_t) bid * CSTMP_URING_BUF_SIZE);
+    b->len = CSTMP_URING_BUF_SIZE;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static int
+_cstmp_uring_poll(cstmp_uring_t *u, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe;
+    if ((sqe = _cstmp_uring_sqe(u)) == NULL) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = user_data;
+    return 1;
+}
+
+/** Queue an operation of the registration, counted until its last completion **/
+static struct io_uring_sqe*
+_cstmp_uring_conn_sqe(cstmp_uring_t *u, cstmp_loop_conn_t *conn, int op, uintptr_t tag) {
+    struct io_uring_sqe *sqe;
+    if ((sqe = _cstmp_uring_sqe(u)) == NULL) {
+        return NULL;
+    }
+    sqe->opcode = (uint8_t) op;
+    sqe->fd = conn->sess->sock;
+    sqe->user_data = (uint64_t) ((uintptr_t) conn | tag);
+    conn->inflight++;
+    return sqe;
+}
+
+static int
+_cstmp_uring_arm_recv(cstmp_uring_t *u, cstmp_loop_conn_t *conn) {
+    struct io_uring_sqe *sqe;
+    if ((sqe = _cstmp_uring_conn_sqe(u, conn, IORING_OP_RECV, CSTMP_URING_RECV)) == NULL) {
+        return 0;
+    }
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = CSTMP_URING_BGID;
+    sqe->ioprio = u->single_shot ? 0 : IORING_RECV_MULTISHOT;
+    return 1;
+}
+
+static int
+_cstmp_uring_arm_poll(cstmp_uring_t *u, cstmp_loop_conn_t *conn, int fd, uintptr_t tag) {
+    struct io_uring_sqe *sqe;
+    if ((sqe = _cstmp_uring_conn_sqe(u, conn, IORING_OP_POLL_ADD, tag)) == NULL) {
+        return 0;
+    }
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    return 1;
+}
+
+static void
+_cstmp_uring_cancel(cstmp_uring_t *u, cstmp_loop_conn_t *conn, uintptr_t tag) {
+    struct io_uring_sqe *sqe;
+    if ((sqe = _cstmp_uring_conn_sqe(u, conn, IORING_OP_ASYNC_CANCEL, CSTMP_URING_CANCEL)) != NULL) {
+        sqe->fd = -1;
+        sqe->addr = (uint64_t) ((uintptr_t) conn | tag);
+    }
+}
+
+/** Put the rest of the in flight buffer on the wire **/
+static int
+_cstmp_uring_prep_send(cstmp_uring_t *u, cstmp_loop_conn_t *conn) {
+    cstmp_frame_buf_t *buf = &conn->out[!conn->out_fill];
+    struct io_uring_sqe *sqe;
+    if ((sqe = _cstmp_uring_conn_sqe(u, conn, IORING_OP_SEND, CSTMP_URING_SEND)) == NULL) {
+        return 0;
+    }
+    sqe->addr = (uint64_t) (uintptr_t) (buf->start + conn->out_sent);
+    sqe->len = (uint32_t) (cstmp_buf_size(buf) - conn->out_sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 1;
+}
+
+/** One send in flight per session keeps the order, frames queued meanwhile go out together next **/
+static int
+_cstmp_uring_flush(cstmp_uring_t *u, cstmp_loop_conn_t *conn) {
+    if (conn->send_inflight || cstmp_buf_size((&conn->out[conn->out_fill])) == 0) {
+        return 1;
+    }
+    conn->out_fill = !conn->out_fill;
+    conn->out_sent = 0;
+    conn->send_inflight = 1;
+    return _cstmp_uring_prep_send(u, conn);
+}
+
+static int
+_cstmp_uring_queue(cstmp_uring_t *u, cstmp_loop_conn_t *conn, const struct iovec *iov, size_t iovcnt) {
+    cstmp_frame_buf_t *buf = &conn->out[conn->out_fill];
+    size_t i, total = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (!_cstmp_buf_reserve(buf, cstmp_buf_size(buf) + total)) {
+        return 0;
+    }
+    for (i = 0; i < iovcnt; i++) {
+        buf->last = cstmp_cpymem(buf->last, iov[i].iov_base, iov[i].iov_len);
+    }
+    conn->sess->hb_sent = 1;
+    return _cstmp_uring_flush(u, conn);
+}
+
+static void
+_cstmp_uring_sent(cstmp_loop_t *loop, cstmp_loop_conn_t *conn, int res) {
+    cstmp_frame_buf_t *buf = &conn->out[!conn->out_fill];
+
+    if (res < 0) {
+        fprintf(stderr, "Error while process socket read/write: %s\n", strerror(-res));
+        _cstmp_loop_conn_close(loop, conn);
+        return;
+    }
+    CSTMP_METRIC_ADD(conn->sess, bytes_sent, (uint64_t) res);
+    if ((conn->out_sent += (size_t) res) < cstmp_buf_size(buf)) {
+        if (!_cstmp_uring_prep_send(loop->uring, conn)) {
+            _cstmp_loop_conn_close(loop, conn);
+        }
+        return;
+    }
+    buf->last = buf->start;
+    conn->send_inflight = 0;
+    if (!_cstmp_uring_flush(loop->uring, conn)) {
+        _cstmp_loop_conn_close(loop, conn);
+    }
+}
+
+static int
+_cstmp_uring_on_frame(cstmp_frame_t *fr, void *arg) {
+    cstmp_loop_conn_t *conn = arg;
+    if (!_cstmp_body_decode(conn->sess, fr)) {
+        _cstmp_loop_conn_close(conn->loop, conn);
+        return 0;
+    }
+    conn->on_frame(fr, conn->arg);
+    return !conn->closed;
+}
+
+/**
+* The chunk is appended to the parser buffer before parsing, so a cstmp_loop_del inside on_frame
+* can hand the bytes not parsed yet back to the session read buffer.
+**/
+static void
+_cstmp_uring_recv_data(cstmp_loop_t *loop, cstmp_loop_conn_t *conn, const u_char *data, size_t len) {
+    cstmp_read_buf_t *rb = &conn->parser->rbuf;
+
+    CSTMP_METRIC_ADD(conn->sess, bytes_recv, (uint64_t) len);
+    conn->sess->hb_recvd = 1;
+    if (!_cstmp_rbuf_reserve(rb, len)) {
+        _cstmp_loop_conn_close(loop, conn);
+        return;
+    }
+    rb->last = cstmp_cpymem(rb->last, data, len);
+    if (cstmp_parser_feed(conn->parser, NULL, 0) < 0 && !conn->closed) {
+        _cstmp_loop_conn_close(loop, conn);
+    }
+}
+
+/** The heart-beat EOL goes through the send queue too, a direct write could land inside a queued frame **/
+static int
+_cstmp_uring_heartbeat_send_tick(cstmp_uring_t *u, cstmp_loop_conn_t *conn) {
+    struct iovec iov;
+    uint64_t expired;
+    if (read(conn->sess->hb_send_tfd, &expired, sizeof(expired)) < 0 || __sync_lock_test_and_set(&conn->sess->hb_sent, 0)) {
+        return 1;
+    }
+    cstmp_set_iov(&iov, LF, 1);
+    CSTMP_METRIC_ADD(conn->sess, heartbeats_sent, 1);
+    return _cstmp_uring_queue(u, conn, &iov, 1);
+}
+
+/** Received before the cancel took effect, the session reads it next in blocking mode **/
+static void
+_cstmp_uring_recv_late(cstmp_session_t *sess, const u_char *data, size_t len) {
+    cstmp_read_buf_t *rb = &sess->rbuf;
+
+    CSTMP_METRIC_ADD(sess, bytes_recv, (uint64_t) len);
+    sess->hb_recvd = 1;
+    if (!_cstmp_rbuf_reserve(rb, len)) {
+        fprintf(stderr, "%s\n", "Err: No enough memory allocated, late received bytes dropped");
+        return;
+    }
+    rb->last = cstmp_cpymem(rb->last, data, len);
+}
+
+/** Last completion of an unwatched registration, it can go now **/
+static void
+_cstmp_uring_drained(cstmp_loop_t *loop, cstmp_loop_conn_t *conn) {
+    cstmp_loop_conn_t **pp;
+    if (conn->sess && conn->sess->loop_drain == conn) {
+        conn->sess->loop_drain = NULL;
+    }
+    for (pp = &loop->draining; *pp; pp = &(*pp)->next) {
+        if (*pp == conn) {
+            *pp = conn->next;
+            break;
+        }
+    }
+    conn->next = loop->garbage;
+    loop->garbage = conn;
+}
+
+static void
+_cstmp_uring_complete(cstmp_loop_t *loop, const struct io_uring_cqe *cqe) {
+    cstmp_uring_t *u = loop->uring;
+    cstmp_loop_conn_t *conn;
+    uintptr_t tag;
+    uint64_t wake;
+    uint16_t bid;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+
+    if (cqe->user_data == CSTMP_URING_WAKE) {
+        while (read(loop->wakefd, &wake, sizeof(wake)) > 0);
+        if (!more) {
+            _cstmp_uring_poll(u, loop->wakefd, CSTMP_URING_WAKE);
+        }
+        return;
+    }
+    tag = (uintptr_t) cqe->user_data & CSTMP_URING_TAG_MASK;
+    conn = (cstmp_loop_conn_t*) ((uintptr_t) cqe->user_data & ~(uintptr_t) CSTMP_URING_TAG_MASK);
+    if (!more) {
+        conn->inflight--;
+    }
+
+    if (tag == CSTMP_URING_RECV && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        bid = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe->res > 0) {
+            if (!conn->closed) {
+                _cstmp_uring_recv_data(loop, conn, u->bufs + (size_t) bid * CSTMP_URING_BUF_SIZE, (size_t) cqe->res);
+            } else if (conn->sess) {
+                _cstmp_uring_recv_late(conn->sess, u->bufs + (size_t) bid * CSTMP_URING_BUF_SIZE, (size_t) cqe->res);
+            }
+        }
+        _cstmp_uring_buf_put(u, bid);
+    }
+    if (conn->closed) {
+        if (conn->inflight == 0) {
+            _cstmp_uring_drained(loop, conn);
+        }
+        return;
+    }
+
+    switch (tag) {
+    case CSTMP_URING_RECV:
+        if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+            /** out of buffers, they come back as this round is consumed **/
+            if (!more && !_cstmp_uring_arm_recv(u, conn)) {
+                _cstmp_loop_conn_close(loop, conn);
+            }
+        } else if (cqe->res == -EINVAL && !u->single_shot) {
+            /** kernel before 6.0, no multishot receive **/
+            u->single_shot = 1;
+            if (!_cstmp_uring_arm_recv(u, conn)) {
+                _cstmp_loop_conn_close(loop, conn);
+            }
+        } else {
+            if (cqe->res < 0) {
+                fprintf(stderr, "Error while process socket read/write: %s\n", strerror(-cqe->res));
+            }
+            _cstmp_loop_conn_close(loop, conn);
+        }
+        break;
+    case CSTMP_URING_SEND:
+        _cstmp_uring_sent(loop, conn, cqe->res);
+        break;
+    case CSTMP_LOOP_HB_SEND:
+        if (!_cstmp_uring_heartbeat_send_tick(u, conn) ||
+                (!more && !_cstmp_uring_arm_poll(u, conn, conn->sess->hb_send_tfd, CSTMP_LOOP_HB_SEND))) {
+            _cstmp_loop_conn_close(loop, conn);
+        }
+        break;
+    case CSTMP_LOOP_HB_RECV:
+        if (!_cstmp_heartbeat_recv_tick(conn->sess) ||
+                (!more && !_cstmp_uring_arm_poll(u, conn, conn->sess->hb_recv_tfd, CSTMP_LOOP_HB_RECV))) {
+            _cstmp_loop_conn_close(loop, conn);
+        }
+        break;
+    case CSTMP_URING_BACKLOG:
+        if (cstmp_parser_feed(conn->parser, NULL, 0) < 0 && !conn->closed) {
+            _cstmp_loop_conn_close(loop, conn);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static cstmp_uring_t*
+_cstmp_uring_create(int wakefd) {
+    struct io_uring_buf_reg reg;
+    cstmp_uring_t *u;
+    size_t sq_size, cq_size;
+    uint16_t bid;
+
+    if ((u = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_uring_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(u, sizeof(cstmp_uring_t));
+    u->ring = u->bufs = MAP_FAILED;
+    u->sqes = MAP_FAILED;
+    u->br = MAP_FAILED;
+
+    if ((u->fd = (int) syscall(__NR_io_uring_setup, CSTMP_URING_ENTRIES, &u->params)) < 0) {
+        fprintf(stderr, "io_uring not available: %s\n", strerror(errno));
+        goto URING_FAILED;
+    }
+    if (!(u->params.features & IORING_FEAT_SINGLE_MMAP) || !(u->params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "%s\n", "io_uring too old, 5.11 features needed");
+        goto URING_FAILED;
+    }
+    sq_size = u->params.sq_off.array + u->params.sq_entries * sizeof(unsigned);
+    cq_size = u->params.cq_off.cqes + u->params.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    if ((u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                        IORING_OFF_SQ_RING)) == MAP_FAILED ||
+            (u->sqes = mmap(NULL, u->params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        fprintf(stderr, "Error: Unable to map io_uring: %s\n", strerror(errno));
+        goto URING_FAILED;
+    }
+    u->sq_head = (unsigned*) (u->ring + u->params.sq_off.head);
+    u->sq_tail = (unsigned*) (u->ring + u->params.sq_off.tail);
+    u->sq_mask = (unsigned*) (u->ring + u->params.sq_off.ring_mask);
+    u->sq_array = (unsigned*) (u->ring + u->params.sq_off.array);
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned*) (u->ring + u->params.cq_off.head);
+    u->cq_tail = (unsigned*) (u->ring + u->params.cq_off.tail);
+    u->cq_mask = (unsigned*) (u->ring + u->params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*) (u->ring + u->params.cq_off.cqes);
+
+    /** provided buffers, the kernel picks one per receive, 5.19+ **/
+    if ((u->br = mmap(NULL, CSTMP_URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED ||
+            (u->bufs = mmap(NULL, (size_t) CSTMP_URING_BUFS * CSTMP_URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Error: Unable to map io_uring buffers: %s\n", strerror(errno));
+        goto URING_FAILED;
+    }
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+    reg.ring_entries = CSTMP_URING_BUFS;
+    reg.bgid = CSTMP_URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        fprintf(stderr, "io_uring provided buffers not available: %s\n", strerror(errno));
+        goto URING_FAILED;
+    }
+    for (bid = 0; bid < CSTMP_URING_BUFS; bid++) {
+        _cstmp_uring_buf_put(u, bid);
+    }
+    if (!_cstmp_uring_poll(u, wakefd, CSTMP_URING_WAKE)) {
+        goto URING_FAILED;
+    }
+    return u;
+
+URING_FAILED:
+    _cstmp_uring_destroy(u);
+    return NULL;
+}
+
+static void
+_cstmp_uring_destroy(cstmp_uring_t *u) {
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->ring != MAP_FAILED)
+        munmap(u->ring, u->ring_size);
+    if (u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->params.sq_entries * sizeof(struct io_uring_sqe));
+    if (u->br != MAP_FAILED)
+        munmap(u->br, CSTMP_URING_BUFS * sizeof(struct io_uring_buf));
+    if (u->bufs != MAP_FAILED)
+        munmap(u->bufs, (size_t) CSTMP_URING_BUFS * CSTMP_URING_BUF_SIZE);
+    __cstmp_free__(__stp_arg__, u);
+}
+
+/** The session read buffer moves into the registration parser, already buffered frames are delivered first round **/
+static int
+_cstmp_uring_add(cstmp_loop_t *loop, cstmp_loop_conn_t *conn) {
+    cstmp_session_t *sess = conn->sess;
+    cstmp_uring_t *u = loop->uring;
+    struct io_uring_sqe *sqe;
+    int i;
+
+    if (sess->rbuf.direct_fr || sess->rbuf.skip || sess->rbuf.streaming) {
+        fprintf(stderr, "%s\n", "Error, partial frame in progress, finish it before adding the session");
+        return 0;
+    }
+    if ((conn->parser = cstmp_parser_create(_cstmp_uring_on_frame, conn)) == NULL) {
+        return 0;
+    }
+    for (i = 0; i < 2; i++) {
+        if ((conn->out[i].start = __cstmp_alloc__(__stp_arg__, CSTMP_URING_OUT_SIZE)) == NULL) {
+            fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+            return 0;
+        }
+        conn->out[i].last = conn->out[i].start;
+        conn->out[i].total_size = CSTMP_URING_OUT_SIZE;
+    }
+    conn->parser->fr->sess = sess;
+    if (!_cstmp_uring_arm_recv(u, conn)) {
+        return 0;
+    }
+    _cstmp_rbuf_swap(&sess->rbuf, &conn->parser->rbuf);
+
+    if ((sess->hb_send_ms > 0 && !_cstmp_uring_arm_poll(u, conn, sess->hb_send_tfd, CSTMP_LOOP_HB_SEND)) ||
+            (sess->hb_recv_ms > 0 && !_cstmp_uring_arm_poll(u, conn, sess->hb_recv_tfd, CSTMP_LOOP_HB_RECV))) {
+        fprintf(stderr, "%s\n", "Error: Unable to watch heart-beat timers");
+    }
+    if (conn->parser->rbuf.start && conn->parser->rbuf.pos < conn->parser->rbuf.last &&
+            (sqe = _cstmp_uring_conn_sqe(u, conn, IORING_OP_NOP, CSTMP_URING_BACKLOG)) != NULL) {
+        sqe->fd = -1;
+    }
+    return 1;
+}
+
+/** Cancel what is armed, the bytes not parsed yet go back to the session read buffer **/
+static void
+_cstmp_uring_del(cstmp_loop_t *loop, cstmp_loop_conn_t *conn) {
+    cstmp_session_t *sess = conn->sess;
+
+    _cstmp_uring_cancel(loop->uring, conn, CSTMP_URING_RECV);
+    if (sess->hb_send_ms > 0)
+        _cstmp_uring_cancel(loop->uring, conn, CSTMP_LOOP_HB_SEND);
+    if (sess->hb_recv_ms > 0)
+        _cstmp_uring_cancel(loop->uring, conn, CSTMP_LOOP_HB_RECV);
+    _cstmp_rbuf_swap(&sess->rbuf, &conn->parser->rbuf);
+}
+
+static int
+_cstmp_uring_reap(cstmp_loop_t *loop) {
+    cstmp_uring_t *u = loop->uring;
+    struct io_uring_cqe cqe;
+    unsigned head;
+    int n = 0, dispatching = loop->dispatching;
+
+    loop->dispatching = 1;
+    head = *u->cq_head;
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        cqe = u->cqes[head & *u->cq_mask];
+        __atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+        _cstmp_uring_complete(loop, &cqe);
+        n++;
+    }
+    loop->dispatching = dispatching;
+    return n;
+}
+
+static int
+_cstmp_uring_unsettled(cstmp_loop_t *loop) {
+    cstmp_loop_conn_t *conn;
+    for (conn = loop->draining; conn; conn = conn->next) {
+        if (conn->sess) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+* Wait for the cancels of the unwatched sessions, so the bytes received meanwhile are in their
+* read buffer by the time the caller goes on with blocking reads.
+**/
+static int
+_cstmp_uring_settle(cstmp_loop_t *loop) {
+    int i;
+    for (i = 0; i < CSTMP_URING_SETTLE_TRIES && _cstmp_uring_unsettled(loop); i++) {
+        if (_cstmp_uring_enter(loop->uring, 1, CSTMP_URING_SETTLE_MS) < 0) {
+            fprintf(stderr, "Error while waiting session events: %s\n", strerror(errno));
+            return 0;
+        }
+        _cstmp_uring_reap(loop);
+    }
+    return 1;
+}
+
+static int
+_cstmp_uring_run_once(cstmp_loop_t *loop, int timeout_ms) {
+    int n;
+
+    if (_cstmp_uring_enter(loop->uring, timeout_ms != 0, timeout_ms) < 0) {
+        fprintf(stderr, "Error while waiting session events: %s\n", strerror(errno));
+        return -1;
+    }
+    n = _cstmp_uring_reap(loop);
+    /** re-arms and sends queued by this round go in now, not on the next wait **/
+    if (_cstmp_uring_enter(loop->uring, 0, 0) < 0 || !_cstmp_uring_settle(loop)) {
+        fprintf(stderr, "Error while submitting session events: %s\n", strerror(errno));
+        return -1;
+    }
+    return n;
+}
+
+#endif
+
+cstmp_loop_t*
+cstmp_loop_create() {
+    return cstmp_loop_create_backend(CSTMP_LOOP_EPOLL);
+}
+
+cstmp_loop_t*
+cstmp_loop_create_backend(cstmp_loop_backend_t backend) {
+    struct epoll_event ev;
+    cstmp_loop_t *loop = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_loop_t));
+    if (loop == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    loop->nconns = 0;
+    loop->stopped = 0;
+    loop->dispatching = 0;
+    loop->garbage = NULL;
+    loop->uring = NULL;
+    loop->draining = NULL;
+    loop->epfd = -1;
+    if ((loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error: Unable to create eventfd: %s\n", strerror(errno));
+        __cstmp_free__(__stp_arg__, loop);
+        return NULL;
+    }
+    if (backend == CSTMP_LOOP_URING) {
+#ifdef CSTOMP_IO_URING
+        if ((loop->uring = _cstmp_uring_create(loop->wakefd)) != NULL) {
+            return loop;
+        }
+#endif
+        fprintf(stderr, "%s\n", "io_uring backend not available, falling back to epoll");
+    }
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error: Unable to create epoll: %s\n", strerror(errno));
+        close(loop->wakefd);
+        __cstmp_free__(__stp_arg__, loop);
+        return NULL;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; /* wake up */
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+    return loop;
+}
+
+cstmp_loop_backend_t
+cstmp_loop_backend(cstmp_loop_t *loop) {
+    return loop && loop->uring ? CSTMP_LOOP_URING : CSTMP_LOOP_EPOLL;
+}
+
+int
+cstmp_loop_add(cstmp_loop_t *loop, cstmp_session_t *sess,
+               void (*on_frame)(cstmp_frame_t *fr, void *arg),
+               void (*on_close)(cstmp_session_t *sess, void *arg), void *arg) {
+    struct epoll_event ev;
+    cstmp_loop_conn_t *conn;
+
+    if (!loop || !sess || !on_frame || sess->loop_conn || sess->loop_drain) {
+        fprintf(stderr, "%s\n", "Invalid loop registration");
+        return 0;
+    }
+    if ((conn = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_loop_conn_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return 0;
+    }
+    if ((conn->fr = cstmp_new_frame()) == NULL) {
+        __cstmp_free__(__stp_arg__, conn);
+        return 0;
+    }
+    conn->fr->sess = sess;
+    conn->sess = sess;
+    conn->loop = loop;
+    conn->on_frame = on_frame;
+    conn->on_close = on_close;
+    conn->arg = arg;
+    conn->closed = 0;
+    conn->next = NULL;
+    conn->parser = NULL;
+    bzero(conn->out, sizeof(conn->out));
+    conn->out_fill = 0;
+    conn->out_sent = 0;
+    conn->send_inflight = 0;
+    conn->inflight = 0;
+
+#ifdef CSTOMP_IO_URING
+    if (loop->uring) {
+        if (!_cstmp_uring_add(loop, conn)) {
+            goto ADD_FAILED;
+        }
+        sess->loop_conn = conn;
+        __sync_fetch_and_add(&loop->nconns, 1);
+        return 1;
+    }
+#endif
+    if (!_cstmp_set_nonblocking(sess, 1)) {
+        goto ADD_FAILED;
+    }
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sess->sock, &ev) < 0) {
+        fprintf(stderr, "Error: Unable to watch session socket: %s\n", strerror(errno));
+        _cstmp_set_nonblocking(sess, 0);
+        goto ADD_FAILED;
+    }
+    /** heart-beat timers share the registration, told apart by the low pointer bits **/
+    if (sess->hb_send_ms > 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = (void*) ((uintptr_t) conn | CSTMP_LOOP_HB_SEND);
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sess->hb_send_tfd, &ev);
+    }
+    if (sess->hb_recv_ms > 0) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = (void*) ((uintptr_t) conn | CSTMP_LOOP_HB_RECV);
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sess->hb_recv_tfd, &ev);
+    }
+    sess->loop_conn = conn;
+    __sync_fetch_and_add(&loop->nconns, 1);
+    return 1;
+
+ADD_FAILED:
+    _cstmp_loop_conn_free(conn);
+    return 0;
+}
+
+/** Unwatch the session, back to blocking mode. Inside a callback the registration is freed after the dispatch round **/
+int
+cstmp_loop_del(cstmp_loop_t *loop, cstmp_session_t *sess) {
+    cstmp_loop_conn_t *conn;
+    if (!loop || !sess || (conn = sess->loop_conn) == NULL || conn->loop != loop) {
+        return 0;
+    }
+#ifdef CSTOMP_IO_URING
+    if (loop->uring) {
+        _cstmp_uring_del(loop, conn);
+    } else
+#endif
+    {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sess->sock, NULL);
+        if (sess->hb_send_ms > 0)
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sess->hb_send_tfd, NULL);
+        if (sess->hb_recv_ms > 0)
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sess->hb_recv_tfd, NULL);
+        _cstmp_set_nonblocking(sess, 0);
+    }
+    sess->loop_conn = NULL;
+    conn->closed = 1;
+    __sync_fetch_and_sub(&loop->nconns, 1);
+    if (conn->inflight) {
+        /** ring operations still point to it, freed on the last completion **/
+        sess->loop_drain = conn;
+        conn->next = loop->draining;
+        loop->draining = conn;
+#ifdef CSTOMP_IO_URING
+        if (!loop->dispatching) {
+            _cstmp_uring_settle(loop);
+        }
+#endif
+    } else if (loop->dispatching) {
+        conn->next = loop->garbage;
+        loop->garbage = conn;
+    } else {
+        _cstmp_loop_conn_free(conn);
+    }
+    return 1;
+}
+
+static void
+_cstmp_loop_conn_close(cstmp_loop_t *loop, cstmp_loop_conn_t *conn) {
+    cstmp_session_t *sess = conn->sess;
+    void (*on_close)(cstmp_session_t *sess, void *arg) = conn->on_close;
+    void *arg = conn->arg;
+    cstmp_loop_del(loop, sess);
+    if (on_close) {
+        on_close(sess, arg);
+    }
+}
+
+/** Deliver every complete frame in the socket, bounded per wake up so one busy session does not starve others **/
+static void
+_cstmp_loop_conn_read(cstmp_loop_t *loop, cstmp_loop_conn_t *conn) {
+    int i, rc;
+    for (i = 0; i < CSTMP_LOOP_FRAMES_PER_WAKE && !conn->closed; i++) {
+        rc = _cstmp_recv_frame(conn->sess, conn->fr, NULL, 0, 0);
+        if (rc == CSTMP_RECV_OK) {
+            conn->on_frame(conn->fr, conn->arg);
+        } else {
+            if (rc == CSTMP_RECV_ERROR) {
+                _cstmp_loop_conn_close(loop, conn);
+            }
+            break;
+        }
+    }
+}
+
+int
+cstmp_loop_run_once(cstmp_loop_t *loop, int timeout_ms) {
+    struct epoll_event events[CSTMP_LOOP_MAX_EVENTS];
+    cstmp_loop_conn_t *conn;
+    uint64_t wake;
+    uintptr_t tag;
+    int i, n;
+
+#ifdef CSTOMP_IO_URING
+    if (loop->uring) {
+        n = _cstmp_uring_run_once(loop, timeout_ms);
+        goto LOOP_COLLECT;
+    }
+#endif
+    if ((n = epoll_wait(loop->epfd, events, CSTMP_LOOP_MAX_EVENTS, timeout_ms)) < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        fprintf(stderr, "Error while waiting session events: %s\n", strerror(errno));
+        return -1;
+    }
+
+    loop->dispatching = 1;
+    for (i = 0; i < n; i++) {
+        if ((conn = events[i].data.ptr) == NULL) {
+            while (read(loop->wakefd, &wake, sizeof(wake)) > 0);
+            continue;
+        }
+        tag = (uintptr_t) conn & CSTMP_LOOP_HB_MASK;
+        conn = (cstmp_loop_conn_t*) ((uintptr_t) conn & ~(uintptr_t) CSTMP_LOOP_HB_MASK);
+        if (conn->closed) {
+            continue;
+        }
+        if (tag == CSTMP_LOOP_HB_SEND) {
+            _cstmp_heartbeat_send_tick(conn->sess);
+            continue;
+        }
+        if (tag == CSTMP_LOOP_HB_RECV) {
+            if (!_cstmp_heartbeat_recv_tick(conn->sess)) {
+                _cstmp_loop_conn_close(loop, conn);
+            }
+            continue;
+        }
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            /** a hang up still gets the buffered frames before the close **/
+            _cstmp_loop_conn_read(loop, conn);
+        }
+    }
+    loop->dispatching = 0;
+
+#ifdef CSTOMP_IO_URING
+LOOP_COLLECT:
+#endif
+    while ((conn = loop->garbage) != NULL) {
+        loop->garbage = conn->next;
+        _cstmp_loop_conn_free(conn);
+    }
+    return n;
+}
+
+int
+cstmp_loop_run(cstmp_loop_t *loop) {
+    while (!loop->stopped) {
+        if (cstmp_loop_run_once(loop, -1) < 0) {
+            return 0;
+        }
+    }
+    loop->stopped = 0;
+    return 1;
+}
+
+void
+cstmp_loop_stop(cstmp_loop_t *loop) {
+    uint64_t one = 1;
+    loop->stopped = 1;
+    if (write(loop->wakefd, &one, sizeof(one)) < 0) {
+        fprintf(stderr, "Error while waking up loop: %s\n", strerror(errno));
+    }
+}
+
+/** The sessions are not disconnected, only unwatched **/
+void
+cstmp_loop_destroy(cstmp_loop_t *loop) {
+    cstmp_loop_conn_t *conn;
+    if (loop) {
+#ifdef CSTOMP_IO_URING
+        if (loop->uring) {
+            /** closing the ring drops whatever is still in flight **/
+            _cstmp_uring_destroy(loop->uring);
+            while ((conn = loop->draining) != NULL) {
+                loop->draining = conn->next;
+                if (conn->sess && conn->sess->loop_drain == conn)
+                    conn->sess->loop_drain = NULL;
+                _cstmp_loop_conn_free(conn);
+            }
+        }
+#endif
+        while ((conn = loop->garbage) != NULL) {
+            loop->garbage = conn->next;
+            _cstmp_loop_conn_free(conn);
+        }
+        if (loop->epfd >= 0)
+            close(loop->epfd);
+        close(loop->wakefd);
+        __cstmp_free__(__stp_arg__, loop);
+    }
+}
+
+int
+cstmp_loop_send(cstmp_loop_t *loop, cstmp_session_t *sess, cstmp_frame_t *fr) {
+#ifdef CSTOMP_IO_URING
+    struct iovec iov[C_STMP_FRAME_IOV_MAX];
+    cstmp_loop_conn_t *conn;
+    cstmp_codec_ctx_t *held;
+    cstmp_frame_t wire;
+    int queued;
+#endif
+    if (!loop || !sess || !fr) {
+        fprintf(stderr, "%s\n", "Invalid loop, session or frame");
+        return 0;
+    }
+#ifdef CSTOMP_IO_URING
+    if (loop->uring) {
+        if ((conn = sess->loop_conn) == NULL || conn->loop != loop) {
+            fprintf(stderr, "%s\n", "Session is not watched by this loop");
+            return 0;
+        }
+        if (fr->body_file.fd >= 0) {
+            fprintf(stderr, "%s\n", "File body frames can not be queued, use cstmp_send");
+            return 0;
+        }
+        fr = _cstmp_codec_wire(sess, fr, &wire, &held);
+        queued = _cstmp_uring_queue(loop->uring, conn, iov, _cstmp_frame_to_iov(fr, iov, NULL));
+        _cstmp_codec_done(held);
+        if (!queued) {
+            return 0;
+        }
+        CSTMP_METRIC_ADD(sess, frames_sent, 1);
+        return 1;
+    }
+#endif
+    return cstmp_send(sess, fr, 1);
+}
+
+/** receipt ids are "cstmp-<seq>", the slot of a seq is seq % window **/
+#define CSTMP_RECEIPT_PREFIX    "cstmp-"
+
+cstmp_publisher_t*
+cstmp_publisher_create(cstmp_session_t *sess, size_t window,
+                       void (*on_complete)(uint64_t seq, int success, void *user_data, cstmp_frame_t *reply)) {
+    cstmp_publisher_t *pub;
+    if (!sess || !window || !on_complete) {
+        fprintf(stderr, "%s\n", "Invalid publisher arguments");
+        return NULL;
+    }
+    if ((pub = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_publisher_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    if ((pub->slots = __cstmp_alloc__(__stp_arg__, window * sizeof(cstmp_receipt_slot_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        __cstmp_free__(__stp_arg__, pub);
+        return NULL;
+    }
+    if ((pub->rfr = cstmp_new_frame()) == NULL) {
+        __cstmp_free__(__stp_arg__, pub->slots);
+        __cstmp_free__(__stp_arg__, pub);
+        return NULL;
+    }
+    bzero(pub->slots, window * sizeof(cstmp_receipt_slot_t));
+    pub->sess = sess;
+    pub->window = window;
+    pub->next_seq = 1;
+    pub->outstanding = 0;
+    pub->on_complete = on_complete;
+    pthread_mutex_init(&pub->lock, NULL);
+    return pub;
+}
+
+void
+cstmp_publisher_destroy(cstmp_publisher_t *pub) {
+    if (pub) {
+        pthread_mutex_destroy(&pub->lock);
+        cstmp_destroy_frame(pub->rfr);
+        __cstmp_free__(__stp_arg__, pub->slots);
+        __cstmp_free__(__stp_arg__, pub);
+    }
+}
+
+static void
+_cstmp_publisher_complete(cstmp_publisher_t *pub, cstmp_receipt_slot_t *slot, int success, cstmp_frame_t *reply) {
+    uint64_t seq = slot->seq;
+    void *user_data = slot->user_data;
+    slot->used = 0;
+    pub->outstanding--;
+    pthread_mutex_unlock(&pub->lock);
+    pub->on_complete(seq, success, user_data, reply);
+    pthread_mutex_lock(&pub->lock);
+}
+
+/** Complete the publish matching a RECEIPT or ERROR frame, returns 1 when the frame belonged to this publisher **/
+int
+cstmp_publisher_handle(cstmp_publisher_t *pub, cstmp_frame_t *fr) {
+    cstmp_frame_val_t rid;
+    cstmp_receipt_slot_t *slot;
+    uint64_t seq;
+    size_t i;
+    int is_error;
+
+    is_error = fr->cmd_id == CSTMP_CMD_ERROR;
+    if (!is_error && fr->cmd_id != CSTMP_CMD_RECEIPT) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pub->lock);
+    if (cstmp_get_header_by_id(fr, CSTMP_HDR_RECEIPT_ID, &rid) && rid.len > sizeof(CSTMP_RECEIPT_PREFIX) - 1 &&
+            memcmp(rid.data, CSTMP_RECEIPT_PREFIX, sizeof(CSTMP_RECEIPT_PREFIX) - 1) == 0) {
+        seq = strtoull((char*) rid.data + sizeof(CSTMP_RECEIPT_PREFIX) - 1, NULL, 10);
+        slot = &pub->slots[seq % pub->window];
+        if (slot->used && slot->seq == seq) {
+            _cstmp_publisher_complete(pub, slot, !is_error, fr);
+            pthread_mutex_unlock(&pub->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&pub->lock);
+        return 0;
+    }
+    if (is_error) {
+        /** connection level error, broker is closing, nothing in flight will be confirmed **/
+        for (i = 0; i < pub->window && pub->outstanding; i++) {
+            if (pub->slots[i].used) {
+                _cstmp_publisher_complete(pub, &pub->slots[i], 0, fr);
+            }
+        }
+        pthread_mutex_unlock(&pub->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&pub->lock);
+    return 0;
+}
+
+/** Read one frame from the session and complete its receipt, for publishers not driven by a cstmp_loop_t **/
+int
+cstmp_publisher_poll(cstmp_publisher_t *pub, int tries) {
+    if (!cstmp_recv(pub->sess, pub->rfr, tries)) {
+        return 0;
+    }
+    if (!cstmp_publisher_handle(pub, pub->rfr)) {
+        fprintf(stderr, "Unexpected %s frame on publisher session ignored\n", pub->rfr->cmd);
+    }
+    return 1;
+}
+
+int
+cstmp_publish_async(cstmp_publisher_t *pub, cstmp_frame_t *fr, void *user_data, int tries) {
+    u_char receipt_line[64];
+    cstmp_frame_val_t extra;
+    cstmp_receipt_slot_t *slot;
+    cstmp_session_t *sess;
+    uint64_t seq;
+    int success;
+
+    if (!pub || !fr) {
+        fprintf(stderr, "%s\n", "Invalid Frame or publisher type");
+        return 0;
+    }
+    sess = pub->sess;
+
+    pthread_mutex_lock(&pub->lock);
+    while (pub->slots[pub->next_seq % pub->window].used) {
+        /** window is full, wait for the oldest receipt **/
+        pthread_mutex_unlock(&pub->lock);
+        if (sess->nonblocking || !cstmp_publisher_poll(pub, tries)) {
+            return 0;
+        }
+        pthread_mutex_lock(&pub->lock);
+    }
+    seq = pub->next_seq++;
+    slot = &pub->slots[seq % pub->window];
+    slot->seq = seq;
+    slot->user_data = user_data;
+    slot->used = 1;
+    pub->outstanding++;
+    pthread_mutex_unlock(&pub->lock);
+
+    extra.data = receipt_line;
+    extra.len = (size_t) sprintf((char*) receipt_line, "receipt:" CSTMP_RECEIPT_PREFIX "%llu\n", (unsigned long long) seq);
+
+    CSTMP_LOCK_WRITING;
+    success = _cstmp_send_frame(sess, fr, &extra, tries);
+    CSTMP_RELEASE_WRITING;
+
+    if (!success) {
+        pthread_mutex_lock(&pub->lock);
+        if (slot->used && slot->seq == seq) {
+            slot->used = 0;
+            pub->outstanding--;
+        }
+        pthread_mutex_unlock(&pub->lock);
+        return 0;
+    }
+    return 1;
+}
+
+/** Wait until every outstanding publish is confirmed or failed **/
+int
+cstmp_publisher_flush(cstmp_publisher_t *pub, int tries) {
+    while (__sync_fetch_and_add(&pub->outstanding, 0)) {
+        if (!cstmp_publisher_poll(pub, tries)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#define CSTMP_DISPATCH_PARTS_PER_WORKER  4
+#define CSTMP_DISPATCH_BATCH             16
+
+static void
+_cstmp_dispatcher_wake(cstmp_dispatcher_t *d) {
+    __sync_add_and_fetch(&d->gen, 1);
+    if (__sync_fetch_and_add(&d->nidle, 0)) {
+        pthread_mutex_lock(&d->idle_lock);
+        pthread_cond_signal(&d->idle_cond);
+        pthread_mutex_unlock(&d->idle_lock);
+    }
+}
+
+/** Drain a claimed partition for one batch, the claim is dropped after so others can take it over **/
+static void
+_cstmp_dispatcher_drain(cstmp_dispatcher_t *d, cstmp_dispatch_part_t *part) {
+    cstmp_frame_t *fr;
+    size_t n;
+    int left;
+
+    for (n = 0; n < CSTMP_DISPATCH_BATCH; n++) {
+        pthread_mutex_lock(&part->lock);
+        if (part->count == 0) {
+            pthread_mutex_unlock(&part->lock);
+            break;
+        }
+        fr = part->ring[part->head];
+        part->head = (part->head + 1) % d->depth;
+        __atomic_sub_fetch(&part->count, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&part->not_full);
+        pthread_mutex_unlock(&part->lock);
+
+        d->handler(fr, d->arg);
+        cstmp_frame_pool_release(d->pool, fr);
+        __sync_sub_and_fetch(&d->pending, 1);
+    }
+
+    pthread_mutex_lock(&part->lock);
+    left = part->count != 0;
+    __sync_lock_release(&part->active);
+    pthread_mutex_unlock(&part->lock);
+    if (left) {
+        _cstmp_dispatcher_wake(d);
+    }
+}
+
+typedef struct {
+    cstmp_dispatcher_t *d;
+    size_t index;
+} cstmp_dispatch_worker_arg_t;
+
+static void*
+_cstmp_dispatcher_worker(void *arg) {
+    cstmp_dispatcher_t *d = ((cstmp_dispatch_worker_arg_t*) arg)->d;
+    size_t index = ((cstmp_dispatch_worker_arg_t*) arg)->index, k, gen;
+    cstmp_dispatch_part_t *part;
+    int found;
+
+    __cstmp_free__(__stp_arg__, arg);
+
+    for (;;) {
+        gen = __sync_fetch_and_add(&d->gen, 0);
+        found = 0;
+        /** own partitions come first in the scan, the rest is stealing **/
+        for (k = 0; k < d->nparts; k++) {
+            part = &d->parts[(index + k / CSTMP_DISPATCH_PARTS_PER_WORKER + (k % CSTMP_DISPATCH_PARTS_PER_WORKER) * d->nworkers) % d->nparts];
+            /** unlocked peek, a stale count only costs one more scan **/
+            if (__atomic_load_n(&part->count, __ATOMIC_RELAXED) && !__sync_lock_test_and_set(&part->active, 1)) {
+                _cstmp_dispatcher_drain(d, part);
+                found = 1;
+            }
+        }
+        if (found) {
+            continue;
+        }
+        if (d->stopping && __sync_fetch_and_add(&d->pending, 0) == 0) {
+            break;
+        }
+        pthread_mutex_lock(&d->idle_lock);
+        __sync_add_and_fetch(&d->nidle, 1);
+        while (gen == __sync_fetch_and_add(&d->gen, 0) && !d->stopping) {
+            pthread_cond_wait(&d->idle_cond, &d->idle_lock);
+        }
+        __sync_sub_and_fetch(&d->nidle, 1);
+        pthread_mutex_unlock(&d->idle_lock);
+    }
+    return NULL;
+}
+
+static void
+_cstmp_dispatcher_free(cstmp_dispatcher_t *d) {
+    size_t i;
+    if (d->parts) {
+        for (i = 0; i < d->nparts; i++) {
+            if (d->parts[i].ring) {
+                pthread_mutex_destroy(&d->parts[i].lock);
+                pthread_cond_destroy(&d->parts[i].not_full);
+                __cstmp_free__(__stp_arg__, d->parts[i].ring);
+            }
+        }
+        __cstmp_free__(__stp_arg__, d->parts);
+    }
+    if (d->workers)
+        __cstmp_free__(__stp_arg__, d->workers);
+    if (d->key)
+        __cstmp_free__(__stp_arg__, d->key);
+    if (d->pool)
+        cstmp_frame_pool_destroy(d->pool);
+    pthread_mutex_destroy(&d->idle_lock);
+    pthread_cond_destroy(&d->idle_cond);
+    __cstmp_free__(__stp_arg__, d);
+}
+
+cstmp_dispatcher_t*
+cstmp_dispatcher_create(size_t nworkers, size_t depth, const char *key_header, int pin_cpus,
+                        void (*handler)(cstmp_frame_t *fr, void *arg), void *arg) {
+    cstmp_dispatcher_t *d;
+    cstmp_dispatch_worker_arg_t *warg;
+    cpu_set_t cpus;
+    long ncpu;
+    size_t i;
+
+    if (!nworkers || !depth || !handler) {
+        fprintf(stderr, "%s\n", "Invalid dispatcher arguments");
+        return NULL;
+    }
+    if ((d = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_dispatcher_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(d, sizeof(cstmp_dispatcher_t));
+    pthread_mutex_init(&d->idle_lock, NULL);
+    pthread_cond_init(&d->idle_cond, NULL);
+    d->nworkers = nworkers;
+    d->nparts = nworkers * CSTMP_DISPATCH_PARTS_PER_WORKER;
+    d->depth = depth;
+    d->handler = handler;
+    d->arg = arg;
+
+    if (key_header) {
+        d->key_len = strlen(key_header);
+        if ((d->key = __cstmp_alloc__(__stp_arg__, d->key_len + 1)) == NULL) {
+            goto CREATE_FAILED;
+        }
+        memcpy(d->key, key_header, d->key_len + 1);
+        d->key_id = cstmp_header_id((u_char*) key_header, d->key_len);
+    }
+    /** frames in queues plus one being handled per worker and the reader one **/
+    if ((d->pool = cstmp_frame_pool_create(d->nparts * depth + nworkers + 1, 0)) == NULL ||
+            (d->parts = __cstmp_alloc__(__stp_arg__, d->nparts * sizeof(cstmp_dispatch_part_t))) == NULL ||
+            (d->workers = __cstmp_alloc__(__stp_arg__, nworkers * sizeof(pthread_t))) == NULL) {
+        goto CREATE_FAILED;
+    }
+    bzero(d->parts, d->nparts * sizeof(cstmp_dispatch_part_t));
+    for (i = 0; i < d->nparts; i++) {
+        if ((d->parts[i].ring = __cstmp_alloc__(__stp_arg__, depth * sizeof(cstmp_frame_t*))) == NULL) {
+            goto CREATE_FAILED;
+        }
+        pthread_mutex_init(&d->parts[i].lock, NULL);
+        pthread_cond_init(&d->parts[i].not_full, NULL);
+    }
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 0; i < nworkers; i++) {
+        if ((warg = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_dispatch_worker_arg_t))) == NULL) {
+            goto START_FAILED;
+        }
+        warg->d = d;
+        warg->index = i;
+        if (pthread_create(&d->workers[i], NULL, _cstmp_dispatcher_worker, warg) != 0) {
+            __cstmp_free__(__stp_arg__, warg);
+            goto START_FAILED;
+        }
+        if (pin_cpus && ncpu > 0) {
+            CPU_ZERO(&cpus);
+            CPU_SET(i % ncpu, &cpus);
+            if (pthread_setaffinity_np(d->workers[i], sizeof(cpu_set_t), &cpus) != 0) {
+                fprintf(stderr, "Unable to pin dispatcher worker %zu\n", i);
+            }
+        }
+    }
+    return d;
+
+START_FAILED:
+    fprintf(stderr, "%s\n", "Error: Unable to start dispatcher workers");
+    d->nworkers = i;
+    cstmp_dispatcher_destroy(d);
+    return NULL;
+CREATE_FAILED:
+    fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+    _cstmp_dispatcher_free(d);
+    return NULL;
+}
+
+cstmp_frame_t*
+cstmp_dispatcher_acquire(cstmp_dispatcher_t *d) {
+    return cstmp_frame_pool_acquire(d->pool);
+}
+
+int
+cstmp_dispatcher_submit(cstmp_dispatcher_t *d, cstmp_frame_t *fr) {
+    cstmp_dispatch_part_t *part;
+    cstmp_frame_val_t val;
+    size_t slot;
+
+    if (!d || !fr) {
+        return 0;
+    }
+    if (d->key && (d->key_id ? cstmp_get_header_by_id(fr, d->key_id, &val) :
+                   cstmp_get_header_and_len(fr, d->key, d->key_len, &val))) {
+        slot = cstmp_hash_key(val.data, val.len) % d->nparts;
+    } else {
+        slot = __sync_fetch_and_add(&d->rr, 1) % d->nparts;
+    }
+    part = &d->parts[slot];
+
+    pthread_mutex_lock(&part->lock);
+    while (part->count == d->depth) {
+        /** back pressure to the reader **/
+        pthread_cond_wait(&part->not_full, &part->lock);
+    }
+    part->ring[(part->head + part->count) % d->depth] = fr;
+    __atomic_add_fetch(&part->count, 1, __ATOMIC_RELAXED);
+    __sync_add_and_fetch(&d->pending, 1);
+    pthread_mutex_unlock(&part->lock);
+
+    _cstmp_dispatcher_wake(d);
+    return 1;
+}
+
+void
+cstmp_dispatch_consume(cstmp_session_t *sess, cstmp_dispatcher_t *d, int *consuming) {
+    cstmp_frame_t *fr = NULL;
+    while (*consuming) {
+        if (fr == NULL && (fr = cstmp_dispatcher_acquire(d)) == NULL) {
+            break;
+        }
+        if (cstmp_recv(sess, fr, 0)) {
+            fr->sess = sess;
+            cstmp_dispatcher_submit(d, fr);
+            fr = NULL;
+        }
+    }
+    if (fr) {
+        cstmp_frame_pool_release(d->pool, fr);
+    }
+}
+
+void
+cstmp_dispatcher_destroy(cstmp_dispatcher_t *d) {
+    size_t i;
+    if (d) {
+        pthread_mutex_lock(&d->idle_lock);
+        d->stopping = 1;
+        pthread_cond_broadcast(&d->idle_cond);
+        pthread_mutex_unlock(&d->idle_lock);
+        for (i = 0; i < d->nworkers; i++) {
+            pthread_join(d->workers[i], NULL);
+        }
+        _cstmp_dispatcher_free(d);
+    }
+}
+
+/**
+* STOMP CONNECT over n sessions, all CONNECT frames go out before the first CONNECTED is read so the
+* broker round trips overlap. ok[i] is set for the sessions connected, the failed ones are left open
+* for the caller to dispose, returns how many connected.
+**/
+static size_t
+_cstmp_stomp_connect_all(cstmp_session_t **sessions, u_char *ok, size_t n, const char *login, const char *passcode, const char *vhost, int tries) {
+    cstmp_frame_t *fr;
+    size_t i, nconnected = 0;
+
+    for (i = 0; i < n; i++) {
+        ok[i] = 0;
+    }
+    if ((fr = cstmp_new_frame()) == NULL) {
+        return 0;
+    }
+    fr->cmd = "CONNECT";
+    cstmp_add_header(fr, "accept-version", "1.2");
+    cstmp_add_header(fr, "host", vhost ? vhost : "/");
+    if (login)
+        cstmp_add_header(fr, "login", login);
+    if (passcode)
+        cstmp_add_header(fr, "passcode", passcode);
+
+    for (i = 0; i < n; i++) {
+        ok[i] = sessions[i] && cstmp_send(sessions[i], fr, tries);
+    }
+    for (i = 0; i < n; i++) {
+        if (!ok[i]) {
+            continue;
+        }
+        ok[i] = 0;
+        if (cstmp_recv(sessions[i], fr, tries)) {
+            if (fr->cmd_id == CSTMP_CMD_CONNECTED) {
+                ok[i] = 1;
+                nconnected++;
+                continue;
+            }
+            fprintf(stderr, "STOMP connect refused: %.*s\n", (int) cstmp_buf_size((&fr->body)), fr->body.start);
+        }
+    }
+    cstmp_destroy_frame(fr);
+    return nconnected;
+}
+
+/** CONNECT and wait for CONNECTED, login/passcode/vhost are optional **/
+int
+cstmp_stomp_connect(cstmp_session_t *sess, const char *login, const char *passcode, const char *vhost, int tries) {
+    u_char ok;
+    return sess && _cstmp_stomp_connect_all(&sess, &ok, 1, login, passcode, vhost, tries) == 1;
+}
+
+enum {
+    CSTMP_POOL_FREE = 0,
+    CSTMP_POOL_BUSY,
+    CSTMP_POOL_BROKEN,
+};
+
+static cstmp_session_t*
+_cstmp_pool_open(cstmp_pool_t *pool) {
+    cstmp_session_t *sess;
+    if ((sess = cstmp_connect_t(pool->host, pool->port, pool->send_timeout, pool->recv_timeout)) == NULL) {
+        return NULL;
+    }
+    if (!cstmp_stomp_connect(sess, pool->login, pool->passcode, pool->vhost, 1)) {
+        cstmp_disconnect(sess);
+        return NULL;
+    }
+    return sess;
+}
+
+/** Background replacement of broken sessions, retry every second while the broker is away **/
+static void*
+_cstmp_pool_keeper(void *arg) {
+    cstmp_pool_t *pool = arg;
+    cstmp_session_t *sess;
+    struct timespec ts;
+    size_t i, broken;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stopping) {
+        broken = 0;
+        for (i = 0; i < pool->size; i++) {
+            if (__sync_fetch_and_add(&pool->slots[i].state, 0) != CSTMP_POOL_BROKEN) {
+                continue;
+            }
+            pthread_mutex_unlock(&pool->lock);
+            if (pool->slots[i].sess) {
+                cstmp_disconnect(pool->slots[i].sess);
+                pool->slots[i].sess = NULL;
+            }
+            sess = _cstmp_pool_open(pool);
+            pthread_mutex_lock(&pool->lock);
+            if (sess) {
+                sess->pool_slot = (int) i;
+                pool->slots[i].sess = sess;
+                __sync_lock_release(&pool->slots[i].state);
+                pthread_cond_broadcast(&pool->avail);
+            } else {
+                broken++;
+            }
+        }
+        if (broken) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&pool->repair, &pool->lock, &ts);
+        } else if (!pool->stopping && !pool->nbroken) {
+            pthread_cond_wait(&pool->repair, &pool->lock);
+        }
+        pool->nbroken = 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static char*
+_cstmp_strdup(const char *str) {
+    size_t len;
+    char *dup;
+    if (!str) {
+        return NULL;
+    }
+    len = strlen(str) + 1;
+    if ((dup = __cstmp_alloc__(__stp_arg__, len)) != NULL) {
+        memcpy(dup, str, len);
+    }
+    return dup;
+}
+
+static void
+_cstmp_pool_free(cstmp_pool_t *pool) {
+    size_t i;
+    for (i = 0; i < pool->size; i++) {
+        if (pool->slots[i].sess) {
+            cstmp_disconnect(pool->slots[i].sess);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->avail);
+    pthread_cond_destroy(&pool->repair);
+    if (pool->host) __cstmp_free__(__stp_arg__, pool->host);
+    if (pool->login) __cstmp_free__(__stp_arg__, pool->login);
+    if (pool->passcode) __cstmp_free__(__stp_arg__, pool->passcode);
+    if (pool->vhost) __cstmp_free__(__stp_arg__, pool->vhost);
+    __cstmp_free__(__stp_arg__, pool->slots);
+    __cstmp_free__(__stp_arg__, pool);
+}
+
+cstmp_pool_t*
+cstmp_pool_create(const char *hostname, int port, const char *login, const char *passcode, const char *vhost,
+                  size_t size, int send_timeout, int recv_timeout) {
+    cstmp_pool_t *pool;
+    cstmp_session_t **sessions;
+    u_char *ok;
+    size_t i;
+
+    if (!hostname || !size) {
+        fprintf(stderr, "%s\n", "Invalid pool arguments");
+        return NULL;
+    }
+    if ((pool = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_pool_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(pool, sizeof(cstmp_pool_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->avail, NULL);
+    pthread_cond_init(&pool->repair, NULL);
+    pool->port = port;
+    pool->send_timeout = send_timeout;
+    pool->recv_timeout = recv_timeout;
+    if ((pool->slots = __cstmp_alloc__(__stp_arg__, size * sizeof(cstmp_pool_slot_t))) == NULL ||
+            (pool->host = _cstmp_strdup(hostname)) == NULL ||
+            (login && (pool->login = _cstmp_strdup(login)) == NULL) ||
+            (passcode && (pool->passcode = _cstmp_strdup(passcode)) == NULL) ||
+            (vhost && (pool->vhost = _cstmp_strdup(vhost)) == NULL)) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        _cstmp_pool_free(pool);
+        return NULL;
+    }
+    bzero(pool->slots, size * sizeof(cstmp_pool_slot_t));
+    pool->size = size;
+
+    /** warm up all at once, the connects race and the CONNECT handshakes overlap **/
+    if ((sessions = __cstmp_alloc__(__stp_arg__, size * (sizeof(cstmp_session_t*) + 1))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        _cstmp_pool_free(pool);
+        return NULL;
+    }
+    ok = (u_char*) (sessions + size);
+    cstmp_connect_bulk(hostname, port, sessions, size, send_timeout, recv_timeout, send_timeout);
+    _cstmp_stomp_connect_all(sessions, ok, size, login, passcode, vhost, 1);
+    for (i = 0; i < size; i++) {
+        if (sessions[i] && !ok[i]) {
+            cstmp_disconnect(sessions[i]);
+            sessions[i] = NULL;
+        }
+    }
+    for (i = 0; i < size; i++) {
+        if ((pool->slots[i].sess = sessions[i]) == NULL) {
+            fprintf(stderr, "Error: unable to open pooled session to %s:%d\n", hostname, port);
+            for (; i < size; i++) {
+                pool->slots[i].sess = sessions[i];
+            }
+            __cstmp_free__(__stp_arg__, sessions);
+            _cstmp_pool_free(pool);
+            return NULL;
+        }
+        pool->slots[i].sess->pool_slot = (int) i;
+        pool->slots[i].state = CSTMP_POOL_FREE;
+    }
+    __cstmp_free__(__stp_arg__, sessions);
+
+    if (pthread_create(&pool->keeper, NULL, _cstmp_pool_keeper, pool) != 0) {
+        fprintf(stderr, "%s\n", "Error: Unable to start pool keeper");
+        _cstmp_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/** Claim a free slot with CAS, start from a per-thread spot so threads do not fight for the same slot **/
+static cstmp_session_t*
+_cstmp_pool_try_checkout(cstmp_pool_t *pool) {
+    static __thread size_t hint;
+    size_t i, k;
+    for (k = 0; k < pool->size; k++) {
+        i = (hint + k) % pool->size;
+        if (pool->slots[i].state == CSTMP_POOL_FREE &&
+                __sync_bool_compare_and_swap(&pool->slots[i].state, CSTMP_POOL_FREE, CSTMP_POOL_BUSY)) {
+            hint = i;
+            return pool->slots[i].sess;
+        }
+    }
+    return NULL;
+}
+
+cstmp_session_t*
+cstmp_pool_checkout(cstmp_pool_t *pool, int timeout_ms) {
+    cstmp_session_t *sess;
+    struct timespec ts;
+
+    if ((sess = _cstmp_pool_try_checkout(pool)) != NULL || timeout_ms == 0) {
+        return sess;
+    }
+
+    /** slow path, all busy or broken **/
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&pool->lock);
+    __sync_add_and_fetch(&pool->waiters, 1);
+    while ((sess = _cstmp_pool_try_checkout(pool)) == NULL && !pool->stopping) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&pool->avail, &pool->lock);
+        } else if (pthread_cond_timedwait(&pool->avail, &pool->lock, &ts) != 0) {
+            sess = _cstmp_pool_try_checkout(pool);
+            break;
+        }
+    }
+    __sync_sub_and_fetch(&pool->waiters, 1);
+    pthread_mutex_unlock(&pool->lock);
+    return sess;
+}
+
+void
+cstmp_pool_checkin(cstmp_pool_t *pool, cstmp_session_t *sess, int broken) {
+    cstmp_pool_slot_t *slot;
+
+    if (!pool || !sess || sess->pool_slot < 0 || (size_t) sess->pool_slot >= pool->size) {
+        fprintf(stderr, "%s\n", "Invalid pooled session");
+        return;
+    }
+    slot = &pool->slots[sess->pool_slot];
+    if (broken) {
+        __sync_lock_test_and_set(&slot->state, CSTMP_POOL_BROKEN);
+        pthread_mutex_lock(&pool->lock);
+        pool->nbroken++;
+        pthread_cond_signal(&pool->repair);
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    __sync_lock_release(&slot->state);
+    if (__sync_fetch_and_add(&pool->waiters, 0)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->avail);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/** Every session should be checked in **/
+void
+cstmp_pool_destroy(cstmp_pool_t *pool) {
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = 1;
+        pthread_cond_broadcast(&pool->repair);
+        pthread_cond_broadcast(&pool->avail);
+        pthread_mutex_unlock(&pool->lock);
+        pthread_join(pool->keeper, NULL);
+        _cstmp_pool_free(pool);
+    }
+}
+
+/**
+* Vyukov intrusive MPSC queue, push is one atomic exchange. Pop only by the writer thread,
+* it returns NULL while a producer is between its exchange and the link.
+**/
+static void
+_cstmp_wq_push(cstmp_writer_t *w, cstmp_wnode_t *node) {
+    cstmp_wnode_t *prev;
+    __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&w->head, node, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+static cstmp_wnode_t*
+_cstmp_wq_pop(cstmp_writer_t *w) {
+    cstmp_wnode_t *tail = w->tail, *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &w->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        w->tail = tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        w->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    _cstmp_wq_push(w, &w->stub);
+    if ((next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE)) != NULL) {
+        w->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static int
+_cstmp_wq_empty(cstmp_writer_t *w) {
+    return w->tail == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) && w->tail == &w->stub;
+}
+
+#define cstmp_wnode_data(n) ((u_char*) ((n) + 1))
+#define CSTMP_WRITER_MAX_BYTES  (256 * 1024)
+
+static void
+_cstmp_writer_release(cstmp_writer_t *w, cstmp_wnode_t **nodes, size_t n, int ok) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        if (nodes[i]->barrier) {
+            /** the barrier node lives on the flushing thread stack, do not touch it after done **/
+            pthread_mutex_lock(&w->lock);
+            nodes[i]->barrier->ok = ok && !w->failed;
+            nodes[i]->barrier->done = 1;
+            pthread_cond_broadcast(&w->done);
+            pthread_mutex_unlock(&w->lock);
+        } else {
+            __cstmp_free__(__stp_arg__, nodes[i]);
+        }
+    }
+}
+
+/** Drain the queue, pending frames go out in one gathered write up to IOV_MAX frames or CSTMP_WRITER_MAX_BYTES **/
+static void*
+_cstmp_writer_thread(void *arg) {
+    cstmp_session_t *sess = arg;
+    cstmp_writer_t *w = sess->writer;
+    struct iovec iov[IOV_MAX];
+    cstmp_wnode_t *nodes[IOV_MAX], *node;
+    size_t n, niov, bytes;
+    int ok;
+
+    for (;;) {
+        n = niov = bytes = 0;
+        while (n < IOV_MAX && bytes < CSTMP_WRITER_MAX_BYTES && (node = _cstmp_wq_pop(w)) != NULL) {
+            nodes[n++] = node;
+            if (node->len) {
+                cstmp_set_iov(&iov[niov], cstmp_wnode_data(node), node->len);
+                niov++;
+                bytes += node->len;
+            }
+        }
+        if (n) {
+            ok = 1;
+            if (niov && !w->failed) {
+                CSTMP_LOCK_WRITING;
+                ok = _cstmp_sendv(sess, iov, niov, 0x7fffffff);
+                CSTMP_RELEASE_WRITING;
+                if (!ok) {
+                    __sync_lock_test_and_set(&w->failed, 1);
+                }
+            }
+            _cstmp_writer_release(w, nodes, n, ok);
+            continue;
+        }
+
+        if (!_cstmp_wq_empty(w)) {
+            /** a producer is linking its node **/
+            sched_yield();
+            continue;
+        }
+        pthread_mutex_lock(&w->lock);
+        __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (_cstmp_wq_empty(w) && !w->stopping) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        __sync_lock_release(&w->sleeping);
+        if (w->stopping && _cstmp_wq_empty(w)) {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+static void
+_cstmp_writer_enqueue(cstmp_writer_t *w, cstmp_wnode_t *node) {
+    _cstmp_wq_push(w, node);
+    if (__sync_fetch_and_add(&w->sleeping, 0)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/** Queue bytes already in wire format **/
+static int
+_cstmp_writer_queue_raw(cstmp_writer_t *w, u_char *data, size_t len) {
+    cstmp_wnode_t *node;
+    if ((node = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_wnode_t) + len)) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return 0;
+    }
+    node->len = len;
+    node->barrier = NULL;
+    memcpy(cstmp_wnode_data(node), data, len);
+    _cstmp_writer_enqueue(w, node);
+    return 1;
+}
+
+int
+cstmp_writer_start(cstmp_session_t *sess) {
+    cstmp_writer_t *w;
+    if (!sess || sess->writer) {
+        return 0;
+    }
+    if ((w = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_writer_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return 0;
+    }
+    bzero(w, sizeof(cstmp_writer_t));
+    w->head = w->tail = &w->stub;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    pthread_cond_init(&w->done, NULL);
+    sess->writer = w;
+    if (pthread_create(&w->thread, NULL, _cstmp_writer_thread, sess) != 0) {
+        fprintf(stderr, "%s\n", "Error: Unable to start session writer");
+        sess->writer = NULL;
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->wake);
+        pthread_cond_destroy(&w->done);
+        __cstmp_free__(__stp_arg__, w);
+        return 0;
+    }
+    return 1;
+}
+
+int
+cstmp_send_queued(cstmp_session_t *sess, cstmp_frame_t *fr) {
+    struct iovec iov[C_STMP_FRAME_IOV_MAX];
+    cstmp_codec_ctx_t *held;
+    cstmp_frame_t wire;
+    cstmp_writer_t *w;
+    cstmp_wnode_t *node;
+    size_t i, n, len = 0;
+    u_char *p;
+
+    if (!sess || !fr || (w = sess->writer) == NULL || fr->body_file.fd >= 0) {
+        fprintf(stderr, "%s\n", "Invalid Frame or session writer");
+        return 0;
+    }
+    if (w->failed) {
+        return 0;
+    }
+    fr = _cstmp_codec_wire(sess, fr, &wire, &held);
+    n = _cstmp_frame_to_iov(fr, iov, NULL);
+    for (i = 0; i < n; i++) {
+        len += iov[i].iov_len;
+    }
+    if ((node = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_wnode_t) + len)) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        _cstmp_codec_done(held);
+        return 0;
+    }
+    node->len = len;
+    node->barrier = NULL;
+    for (p = cstmp_wnode_data(node), i = 0; i < n; i++) {
+        p = cstmp_cpymem(p, iov[i].iov_base, iov[i].iov_len);
+    }
+    _cstmp_codec_done(held);
+    _cstmp_writer_enqueue(w, node);
+    CSTMP_METRIC_ADD(sess, frames_sent, 1);
+    return 1;
+}
+
+/** Wait until every frame this thread queued before is written, 0 if the writer hit an IO error **/
+int
+cstmp_writer_flush(cstmp_session_t *sess) {
+    cstmp_writer_t *w;
+    cstmp_wbarrier_t barrier;
+    cstmp_wnode_t node;
+
+    if (!sess || (w = sess->writer) == NULL) {
+        return 0;
+    }
+    barrier.done = barrier.ok = 0;
+    node.len = 0;
+    node.barrier = &barrier;
+    _cstmp_writer_enqueue(w, &node);
+
+    pthread_mutex_lock(&w->lock);
+    while (!barrier.done) {
+        pthread_cond_wait(&w->done, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return barrier.ok;
+}
+
+/** Queued frames are written before the writer exits **/
+void
+cstmp_writer_stop(cstmp_session_t *sess) {
+    cstmp_writer_t *w;
+    if (sess && (w = sess->writer) != NULL) {
+        pthread_mutex_lock(&w->lock);
+        w->stopping = 1;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->wake);
+        pthread_cond_destroy(&w->done);
+        __cstmp_free__(__stp_arg__, w);
+        sess->writer = NULL;
+    }
+}
+
+
+/** transaction ids are "cstmp-tx-<batch id>" **/
+#define CSTMP_TX_PREFIX     "cstmp-tx-"
+
+static int
+_cstmp_batcher_control(cstmp_batcher_t *b, const char *cmd, int with_receipt, int tries) {
+    u_char line[96];
+    cstmp_frame_val_t extra;
+    struct iovec iov[4];
+    cstmp_session_t *sess = b->sess;
+    int success;
+
+    extra.data = line;
+    extra.len = (size_t) sprintf((char*) line, "transaction:" CSTMP_TX_PREFIX "%llu\n", (unsigned long long) b->batch_id);
+    if (with_receipt) {
+        extra.len += (size_t) sprintf((char*) line + extra.len, "receipt:" CSTMP_TX_PREFIX "%llu\n",
+                                      (unsigned long long) b->batch_id);
+    }
+    cstmp_set_iov(&iov[0], cmd, strlen(cmd));
+    cstmp_set_iov(&iov[1], LF, 1);
+    cstmp_set_iov(&iov[2], extra.data, extra.len);
+    cstmp_set_iov(&iov[3], "\n\0\n", 3); /* blank line and frame end */
+    CSTMP_LOCK_WRITING;
+    success = _cstmp_sendv_frames(sess, iov, 4, 1, tries);
+    CSTMP_RELEASE_WRITING;
+    return success;
+}
+
+/** Wait the COMMIT receipt, an ERROR frame means the broker rejected the batch **/
+static int
+_cstmp_batcher_confirm(cstmp_batcher_t *b, int tries) {
+    cstmp_frame_val_t rid;
+    for (;;) {
+        if (!cstmp_recv(b->sess, b->rfr, tries)) {
+            return 0;
+        }
+        if (b->rfr->cmd_id == CSTMP_CMD_ERROR) {
+            fprintf(stderr, "Batch %llu rejected: %.*s\n", (unsigned long long) b->batch_id,
+                    (int) cstmp_buf_size((&b->rfr->body)), b->rfr->body.start);
+            return 0;
+        }
+        if (b->rfr->cmd_id == CSTMP_CMD_RECEIPT && cstmp_get_header_by_id(b->rfr, CSTMP_HDR_RECEIPT_ID, &rid) &&
+                rid.len > sizeof(CSTMP_TX_PREFIX) - 1 &&
+                strtoull((char*) rid.data + sizeof(CSTMP_TX_PREFIX) - 1, NULL, 10) == b->batch_id) {
+            return 1;
+        }
+        fprintf(stderr, "Unexpected %s frame on batching session ignored\n", b->rfr->cmd);
+    }
+}
+
+/** End the open batch, lock held. COMMIT, or ABORT when a send in it failed **/
+static int
+_cstmp_batcher_end(cstmp_batcher_t *b, int tries) {
+    int success;
+    if (!b->in_tx) {
+        return 1;
+    }
+    b->in_tx = 0;
+    if (b->failed) {
+        _cstmp_batcher_control(b, "ABORT", 0, tries);
+        success = 0;
+    } else {
+        success = _cstmp_batcher_control(b, "COMMIT", b->confirm, tries) && (!b->confirm || _cstmp_batcher_confirm(b, tries));
+    }
+    if (b->on_batch) {
+        b->on_batch(b->batch_id, b->nmsgs, success, b->arg);
+    }
+    return success;
+}
+
+/** Commit on deadline, a batch which is not reaching the count or size still goes out in time **/
+static void*
+_cstmp_batcher_timer(void *arg) {
+    cstmp_batcher_t *b = arg;
+    uint64_t batch_id;
+    pthread_mutex_lock(&b->lock);
+    while (!b->stopping) {
+        if (!b->in_tx) {
+            pthread_cond_wait(&b->cond, &b->lock);
+            continue;
+        }
+        batch_id = b->batch_id;
+        if (pthread_cond_timedwait(&b->cond, &b->lock, &b->deadline) == ETIMEDOUT && b->in_tx && b->batch_id == batch_id) {
+            _cstmp_batcher_end(b, b->tries);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+cstmp_batcher_t*
+cstmp_batcher_create(cstmp_session_t *sess, size_t max_msgs, size_t max_bytes, int max_delay_ms, int confirm, int tries,
+                     void (*on_batch)(uint64_t batch_id, size_t nmsgs, int success, void *arg), void *arg) {
+    cstmp_batcher_t *b;
+
+    if (!sess || (!max_msgs && !max_bytes && max_delay_ms <= 0)) {
+        fprintf(stderr, "%s\n", "Invalid batcher session or limits");
+        return NULL;
+    }
+    if ((b = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_batcher_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(b, sizeof(cstmp_batcher_t));
+    b->sess = sess;
+    b->max_msgs = max_msgs;
+    b->max_bytes = max_bytes;
+    b->max_delay_ms = max_delay_ms;
+    b->confirm = confirm;
+    b->tries = tries;
+    b->on_batch = on_batch;
+    b->arg = arg;
+    if (confirm && (b->rfr = cstmp_new_frame()) == NULL) {
+        __cstmp_free__(__stp_arg__, b);
+        return NULL;
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    if (max_delay_ms > 0 && pthread_create(&b->timer, NULL, _cstmp_batcher_timer, b) != 0) {
+        fprintf(stderr, "%s\n", "Error: Unable to start batch timer");
+        b->max_delay_ms = 0;
+        cstmp_batcher_destroy(b);
+        return NULL;
+    }
+    return b;
+}
+
+int
+cstmp_batcher_send(cstmp_batcher_t *b, cstmp_frame_t *fr, int tries) {
+    u_char tx_line[64];
+    cstmp_frame_val_t extra;
+    cstmp_session_t *sess;
+    int success = 1;
+
+    if (!b || !fr) {
+        fprintf(stderr, "%s\n", "Invalid Frame or batcher type");
+        return 0;
+    }
+    sess = b->sess;
+
+    pthread_mutex_lock(&b->lock);
+    if (!b->in_tx) {
+        b->batch_id++;
+        b->nmsgs = b->nbytes = 0;
+        b->failed = 0;
+        if (!_cstmp_batcher_control(b, "BEGIN", 0, tries)) {
+            if (b->on_batch) {
+                b->on_batch(b->batch_id, 0, 0, b->arg);
+            }
+            pthread_mutex_unlock(&b->lock);
+            return 0;
+        }
+        b->in_tx = 1;
+        if (b->max_delay_ms > 0) {
+            clock_gettime(CLOCK_REALTIME, &b->deadline);
+            b->deadline.tv_sec += b->max_delay_ms / 1000;
+            b->deadline.tv_nsec += (b->max_delay_ms % 1000) * 1000000L;
+            if (b->deadline.tv_nsec >= 1000000000L) {
+                b->deadline.tv_sec++;
+                b->deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_signal(&b->cond);
+        }
+    }
+
+    extra.data = tx_line;
+    extra.len = (size_t) sprintf((char*) tx_line, "transaction:" CSTMP_TX_PREFIX "%llu\n", (unsigned long long) b->batch_id);
+    CSTMP_LOCK_WRITING;
+    if (!_cstmp_send_frame(sess, fr, &extra, tries)) {
+        b->failed = 1;
+        success = 0;
+    }
+    CSTMP_RELEASE_WRITING;
+    b->nmsgs++;
+    b->nbytes += fr->body_file.fd >= 0 ? fr->body_file.len : cstmp_buf_size((&fr->body));
+
+    if (b->failed || (b->max_msgs && b->nmsgs >= b->max_msgs) || (b->max_bytes && b->nbytes >= b->max_bytes)) {
+        _cstmp_batcher_end(b, tries);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return success;
+}
+
+/** Commit the open batch now, 1 if there was none **/
+int
+cstmp_batcher_flush(cstmp_batcher_t *b, int tries) {
+    int success;
+    if (!b) {
+        return 0;
+    }
+    pthread_mutex_lock(&b->lock);
+    success = _cstmp_batcher_end(b, tries);
+    pthread_mutex_unlock(&b->lock);
+    return success;
+}
+
+/** The open batch is committed first, the session is not disconnected **/
+void
+cstmp_batcher_destroy(cstmp_batcher_t *b) {
+    if (b) {
+        pthread_mutex_lock(&b->lock);
+        _cstmp_batcher_end(b, b->tries);
+        b->stopping = 1;
+        pthread_cond_signal(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+        if (b->max_delay_ms > 0) {
+            pthread_join(b->timer, NULL);
+        }
+        pthread_mutex_destroy(&b->lock);
+        pthread_cond_destroy(&b->cond);
+        if (b->rfr) {
+            cstmp_destroy_frame(b->rfr);
+        }
+        __cstmp_free__(__stp_arg__, b);
+    }
+}
+
+#define CSTMP_ACK_BUF_SIZE  1024
+
+/** Identification header lines of a MESSAGE, "id" from the ack header (1.2), else message-id and subscription (1.1) **/
+static int
+_cstmp_ack_lines(cstmp_frame_t *fr, cstmp_frame_buf_t *buf) {
+    cstmp_frame_val_t id, sub;
+    size_t need;
+
+    if (cstmp_get_header_by_id(fr, CSTMP_HDR_ACK, &id)) {
+        if (!_cstmp_buf_reserve(buf, cstmp_buf_size(buf) + sizeof("id:\n") + id.len)) {
+            return 0;
+        }
+        buf->last = cstmp_cpymem(buf->last, "id:", sizeof("id:") - 1);
+        buf->last = cstmp_cpymem(buf->last, id.data, id.len);
+        *buf->last++ = LF_CHAR;
+        return 1;
+    }
+    if (!cstmp_get_header_by_id(fr, CSTMP_HDR_MESSAGE_ID, &id)) {
+        fprintf(stderr, "%s\n", "Error, frame to acknowledge has neither ack nor message-id header");
+        return 0;
+    }
+    cstmp_get_header_by_id(fr, CSTMP_HDR_SUBSCRIPTION, &sub);
+    need = sizeof("message-id:\n") + id.len + sizeof("subscription:\n") + sub.len;
+    if (!_cstmp_buf_reserve(buf, cstmp_buf_size(buf) + need)) {
+        return 0;
+    }
+    buf->last = cstmp_cpymem(buf->last, "message-id:", sizeof("message-id:") - 1);
+    buf->last = cstmp_cpymem(buf->last, id.data, id.len);
+    *buf->last++ = LF_CHAR;
+    if (sub.len) {
+        buf->last = cstmp_cpymem(buf->last, "subscription:", sizeof("subscription:") - 1);
+        buf->last = cstmp_cpymem(buf->last, sub.data, sub.len);
+        *buf->last++ = LF_CHAR;
+    }
+    return 1;
+}
+
+/** Wrap header lines [lines, lines+len) into a frame appended to the out buffer **/
+static int
+_cstmp_acker_append(cstmp_acker_t *acker, const char *cmd, const u_char *lines, size_t len) {
+    cstmp_frame_buf_t *out = &acker->out;
+    size_t cmd_len = strlen(cmd);
+    if (!_cstmp_buf_reserve(out, cstmp_buf_size(out) + cmd_len + len + 4)) {
+        return 0;
+    }
+    out->last = cstmp_cpymem(out->last, cmd, cmd_len);
+    *out->last++ = LF_CHAR;
+    out->last = cstmp_cpymem(out->last, lines, len);
+    out->last = cstmp_cpymem(out->last, "\n\0\n", 3);
+    return 1;
+}
+
+/** lock held, the newest cumulative ACK goes into the out buffer **/
+static int
+_cstmp_acker_stage_last(cstmp_acker_t *acker) {
+    cstmp_frame_buf_t *last = &acker->last_ack;
+    if (cstmp_buf_size(last) == 0) {
+        return 1;
+    }
+    if (!_cstmp_acker_append(acker, "ACK", last->start, cstmp_buf_size(last))) {
+        return 0;
+    }
+    last->last = last->start;
+    return 1;
+}
+
+/** lock held, the timer flushes max_delay_ms from now **/
+static void
+_cstmp_acker_arm(cstmp_acker_t *acker) {
+    clock_gettime(CLOCK_REALTIME, &acker->deadline);
+    acker->deadline.tv_sec += acker->max_delay_ms / 1000;
+    acker->deadline.tv_nsec += (acker->max_delay_ms % 1000) * 1000000L;
+    if (acker->deadline.tv_nsec >= 1000000000L) {
+        acker->deadline.tv_sec++;
+        acker->deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_signal(&acker->cond);
+}
+
+/** lock held, on failure the unsent bytes stay in out and the acks stay pending **/
+static int
+_cstmp_acker_flush(cstmp_acker_t *acker, int tries) {
+    cstmp_session_t *sess = acker->sess;
+    struct iovec iov;
+    size_t sent, nframes = 0;
+    u_char *p;
+
+    if (!_cstmp_acker_stage_last(acker)) {
+        return 0;
+    }
+    if (cstmp_buf_size((&acker->out)) == 0) {
+        acker->npending = 0;
+        return 1;
+    }
+    /** a frame cut by a failed flush is counted once, when its end goes out **/
+    for (p = acker->out.start; (p = memchr(p, '\0', (size_t) (acker->out.last - p))) != NULL; p++) {
+        nframes++;
+    }
+    cstmp_set_iov(&iov, acker->out.start, cstmp_buf_size((&acker->out)));
+    CSTMP_LOCK_WRITING;
+    if (_cstmp_sendv_frames(sess, &iov, 1, nframes, tries)) {
+        CSTMP_RELEASE_WRITING;
+        acker->out.last = acker->out.start;
+        acker->npending = 0;
+        return 1;
+    }
+    CSTMP_RELEASE_WRITING;
+    /** _cstmp_sendv left iov at what was not written, the next flush carries on from there **/
+    sent = (size_t) ((u_char*) iov.iov_base - acker->out.start);
+    memmove(acker->out.start, iov.iov_base, iov.iov_len);
+    acker->out.last -= sent;
+    fprintf(stderr, "Error, %zu bytes of acknowledgements kept for the next flush\n", cstmp_buf_size((&acker->out)));
+    if (acker->max_delay_ms > 0) {
+        _cstmp_acker_arm(acker);
+    }
+    return 0;
+}
+
+static void*
+_cstmp_acker_timer(void *arg) {
+    cstmp_acker_t *acker = arg;
+    pthread_mutex_lock(&acker->lock);
+    while (!acker->stopping) {
+        if (!acker->npending) {
+            pthread_cond_wait(&acker->cond, &acker->lock);
+        } else if (pthread_cond_timedwait(&acker->cond, &acker->lock, &acker->deadline) == ETIMEDOUT && acker->npending) {
+            _cstmp_acker_flush(acker, acker->tries);
+        }
+    }
+    pthread_mutex_unlock(&acker->lock);
+    return NULL;
+}
+
+cstmp_acker_t*
+cstmp_acker_create(cstmp_session_t *sess, cstmp_ack_mode_t mode, size_t max_pending, int max_delay_ms, int tries) {
+    cstmp_acker_t *acker;
+
+    if (!sess || (mode != CSTMP_ACK_CLIENT && mode != CSTMP_ACK_CLIENT_INDIVIDUAL)) {
+        fprintf(stderr, "%s\n", "Invalid acker session or mode");
+        return NULL;
+    }
+    if ((acker = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_acker_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(acker, sizeof(cstmp_acker_t));
+    acker->sess = sess;
+    acker->mode = mode;
+    acker->max_pending = max_pending ? max_pending : 1;
+    acker->max_delay_ms = max_delay_ms;
+    acker->tries = tries;
+    if ((acker->out.start = __cstmp_alloc__(__stp_arg__, CSTMP_ACK_BUF_SIZE)) == NULL ||
+            (acker->last_ack.start = __cstmp_alloc__(__stp_arg__, cstmp_def_header_size)) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        cstmp_buf_free((&acker->out));
+        __cstmp_free__(__stp_arg__, acker);
+        return NULL;
+    }
+    acker->out.last = acker->out.start;
+    acker->out.total_size = CSTMP_ACK_BUF_SIZE;
+    acker->last_ack.last = acker->last_ack.start;
+    acker->last_ack.total_size = cstmp_def_header_size;
+    pthread_mutex_init(&acker->lock, NULL);
+    pthread_cond_init(&acker->cond, NULL);
+    if (max_delay_ms > 0 && pthread_create(&acker->timer, NULL, _cstmp_acker_timer, acker) != 0) {
+        fprintf(stderr, "%s\n", "Error: Unable to start ack timer");
+        acker->max_delay_ms = 0;
+        cstmp_acker_destroy(acker);
+        return NULL;
+    }
+    return acker;
+}
+
+static int
+_cstmp_acker_add(cstmp_acker_t *acker, cstmp_frame_t *fr, int nack) {
+    cstmp_frame_buf_t *last;
+    size_t mark;
+    int success = 1;
+
+    if (!acker || !fr) {
+        fprintf(stderr, "%s\n", "Invalid Frame or acker type");
+        return 0;
+    }
+    last = &acker->last_ack;
+
+    pthread_mutex_lock(&acker->lock);
+    if (acker->mode == CSTMP_ACK_CLIENT && !nack) {
+        /** cumulative, the newest id replaces the pending one, which stays if this one is unusable **/
+        mark = cstmp_buf_size(last);
+        if ((success = _cstmp_ack_lines(fr, last))) {
+            memmove(last->start, last->start + mark, cstmp_buf_size(last) - mark);
+            last->last -= mark;
+        } else {
+            last->last = last->start + mark;
+        }
+    } else {
+        /** NACK in client mode goes after the ACK of what came before it **/
+        if (acker->mode == CSTMP_ACK_CLIENT && !_cstmp_acker_stage_last(acker)) {
+            success = 0;
+        } else {
+            mark = cstmp_buf_size((&acker->out));
+            last->last = last->start;
+            success = _cstmp_ack_lines(fr, last) &&
+                      _cstmp_acker_append(acker, nack ? "NACK" : "ACK", last->start, cstmp_buf_size(last));
+            last->last = last->start;
+            if (!success) {
+                acker->out.last = acker->out.start + mark;
+            }
+        }
+    }
+    if (success && ++acker->npending == 1 && acker->max_delay_ms > 0) {
+        _cstmp_acker_arm(acker);
+    }
+    if (success && acker->npending >= acker->max_pending) {
+        success = _cstmp_acker_flush(acker, acker->tries);
+    }
+    pthread_mutex_unlock(&acker->lock);
+    return success;
+}
+
+int
+cstmp_acker_ack(cstmp_acker_t *acker, cstmp_frame_t *fr) {
+    return _cstmp_acker_add(acker, fr, 0);
+}
+
+int
+cstmp_acker_nack(cstmp_acker_t *acker, cstmp_frame_t *fr) {
+    return _cstmp_acker_add(acker, fr, 1);
+}
+
+int
+cstmp_acker_flush(cstmp_acker_t *acker, int tries) {
+    int success;
+    if (!acker) {
+        return 0;
+    }
+    pthread_mutex_lock(&acker->lock);
+    success = _cstmp_acker_flush(acker, tries);
+    pthread_mutex_unlock(&acker->lock);
+    return success;
+}
+
+/** Pending acknowledgements are flushed first **/
+void
+cstmp_acker_destroy(cstmp_acker_t *acker) {
+    if (acker) {
+        pthread_mutex_lock(&acker->lock);
+        _cstmp_acker_flush(acker, acker->tries);
+        acker->stopping = 1;
+        pthread_cond_signal(&acker->cond);
+        pthread_mutex_unlock(&acker->lock);
+        if (acker->max_delay_ms > 0) {
+            pthread_join(acker->timer, NULL);
+        }
+        pthread_mutex_destroy(&acker->lock);
+        pthread_cond_destroy(&acker->cond);
+        cstmp_buf_free((&acker->out));
+        cstmp_buf_free((&acker->last_ack));
+        __cstmp_free__(__stp_arg__, acker);
+    }
+}
+
+#define CSTMP_PREFETCH_WINDOW_MIN   16
+#define CSTMP_PREFETCH_WAIT_HIGH    20 /* % of the window waiting for broker, credit too small */
+#define CSTMP_PREFETCH_WAIT_LOW     2  /* % of the window, the broker is ahead of the handler */
+#define CSTMP_PREFETCH_STREAK       2  /* windows in a row before the credit changes */
+
+static int
+_cstmp_subscription_send(cstmp_subscription_t *sub, int tries) {
+    cstmp_frame_t *fr;
+    char prefetch[32];
+    int success;
+
+    if ((fr = cstmp_new_frame()) == NULL) {
+        return 0;
+    }
+    /** a paced subscription keeps the broker credit at max, the acks hold it back **/
+    sprintf(prefetch, "%zu", sub->paced ? sub->max_prefetch : sub->prefetch);
+    cstmp_set_cmd(fr, CSTMP_CMD_SUBSCRIBE);
+    cstmp_add_header(fr, "id", sub->id);
+    cstmp_add_header(fr, "destination", sub->destination);
+    cstmp_add_header(fr, "ack", sub->ack);
+    /** ActiveMQ and RabbitMQ names, a broker ignores the one it does not know **/
+    cstmp_add_header(fr, "activemq.prefetchSize", prefetch);
+    cstmp_add_header(fr, "prefetch-count", prefetch);
+    success = cstmp_send(sub->sess, fr, tries);
+    cstmp_destroy_frame(fr);
+    return success;
+}
+
+static int
+_cstmp_subscription_unsubscribe(cstmp_subscription_t *sub, int tries) {
+    cstmp_frame_t *fr;
+    int success;
+
+    if ((fr = cstmp_new_frame()) == NULL) {
+        return 0;
+    }
+    cstmp_set_cmd(fr, CSTMP_CMD_UNSUBSCRIBE);
+    cstmp_add_header(fr, "id", sub->id);
+    success = cstmp_send(sub->sess, fr, tries);
+    cstmp_destroy_frame(fr);
+    return success;
+}
+
+cstmp_subscription_t*
+cstmp_subscribe_adaptive(cstmp_session_t *sess, const char *destination, const char *id, const char *ack,
+                         size_t min_prefetch, size_t max_prefetch, size_t max_bytes, int tries) {
+    cstmp_subscription_t *sub;
+
+    if (!sess || !destination || !id || !min_prefetch || max_prefetch < min_prefetch) {
+        fprintf(stderr, "%s\n", "Invalid subscription session or prefetch range");
+        return NULL;
+    }
+    if ((sub = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_subscription_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return NULL;
+    }
+    bzero(sub, sizeof(cstmp_subscription_t));
+    sub->sess = sess;
+    sub->min_prefetch = sub->prefetch = min_prefetch;
+    sub->max_prefetch = max_prefetch;
+    sub->max_bytes = max_bytes;
+    if ((sub->id = _cstmp_strdup(id)) == NULL || (sub->destination = _cstmp_strdup(destination)) == NULL ||
+            (sub->ack = _cstmp_strdup(ack ? ack : "auto")) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        goto SUBSCRIBE_FAILED;
+    }
+    sub->paced = strcmp(sub->ack, "auto") != 0;
+    if (!_cstmp_subscription_send(sub, tries)) {
+        goto SUBSCRIBE_FAILED;
+    }
+    return sub;
+
+SUBSCRIBE_FAILED:
+    if (sub->id)
+        __cstmp_free__(__stp_arg__, sub->id);
+    if (sub->destination)
+        __cstmp_free__(__stp_arg__, sub->destination);
+    if (sub->ack)
+        __cstmp_free__(__stp_arg__, sub->ack);
+    __cstmp_free__(__stp_arg__, sub);
+    return NULL;
+}
+
+/** Holding back max_prefetch - prefetch acks leaves the broker prefetch messages to send **/
+static void
+_cstmp_subscription_pace(cstmp_subscription_t *sub) {
+    cstmp_acker_t *acker = sub->acker;
+    if (acker && sub->paced) {
+        pthread_mutex_lock(&acker->lock);
+        acker->max_pending = sub->max_prefetch - sub->prefetch + 1;
+        pthread_mutex_unlock(&acker->lock);
+    }
+}
+
+void
+cstmp_subscription_set_acker(cstmp_subscription_t *sub, cstmp_acker_t *acker) {
+    if (sub) {
+        sub->acker = acker;
+        _cstmp_subscription_pace(sub);
+    }
+}
+
+/**
+* New credit from the last window. Paced by the acker for the client modes, messages not acked yet are
+* not redelivered that way, an auto subscription is changed by UNSUBSCRIBE and SUBSCRIBE with the same id.
+**/
+static void
+_cstmp_subscription_adjust(cstmp_subscription_t *sub) {
+    uint64_t total = sub->win_wait_ns + sub->win_handle_ns;
+    size_t target = sub->prefetch, mem_cap;
+
+    if (total == 0) {
+        return;
+    }
+    if (sub->win_wait_ns * 100 > total * CSTMP_PREFETCH_WAIT_HIGH) {
+        sub->streak = sub->streak > 0 ? sub->streak + 1 : 1;
+    } else if (sub->win_wait_ns * 100 < total * CSTMP_PREFETCH_WAIT_LOW) {
+        sub->streak = sub->streak < 0 ? sub->streak - 1 : -1;
+    } else {
+        sub->streak = 0;
+    }
+    if (sub->streak >= CSTMP_PREFETCH_STREAK) {
+        target = sub->prefetch * 2;
+        sub->streak = 0;
+    } else if (sub->streak <= -CSTMP_PREFETCH_STREAK) {
+        target = sub->prefetch / 2;
+        sub->streak = 0;
+    }
+    if (sub->max_bytes && sub->avg_size) {
+        mem_cap = sub->max_bytes / sub->avg_size;
+        if (target > mem_cap) {
+            target = mem_cap;
+        }
+    }
+    if (target > sub->max_prefetch) {
+        target = sub->max_prefetch;
+    }
+    if (target < sub->min_prefetch) {
+        target = sub->min_prefetch;
+    }
+    if (target == sub->prefetch) {
+        return;
+    }
+    sub->prefetch = target;
+    if (sub->paced) {
+        _cstmp_subscription_pace(sub);
+        return;
+    }
+    if (_cstmp_subscription_unsubscribe(sub, 0) && _cstmp_subscription_send(sub, 0)) {
+        sub->resubscribes++;
+    }
+}
+
+/** cstmp_consume with the wait and handler time measured per window for the prefetch adjustment **/
+void
+cstmp_subscription_consume(cstmp_subscription_t *sub, cstmp_frame_t *fr, void (*callback)(cstmp_frame_t *), int *consuming) {
+    uint64_t t0, t1, t2;
+    size_t size;
+
+    t0 = _cstmp_now_ns();
+    while (*consuming) {
+        if (!cstmp_recv(sub->sess, fr, 0)) {
+            continue;
+        }
+        t1 = _cstmp_now_ns();
+        callback(fr);
+        t2 = _cstmp_now_ns();
+
+        size = cstmp_buf_size((&fr->body)) + cstmp_buf_size((&fr->headers));
+        sub->avg_size = sub->avg_size ? sub->avg_size - sub->avg_size / 8 + size / 8 : size;
+        sub->avg_handle_ns = sub->avg_handle_ns ? sub->avg_handle_ns - sub->avg_handle_ns / 8 + (t2 - t1) / 8 : t2 - t1;
+        sub->win_wait_ns += t1 - t0;
+        sub->win_handle_ns += t2 - t1;
+        if (++sub->win_msgs >= (sub->prefetch > CSTMP_PREFETCH_WINDOW_MIN ? sub->prefetch : CSTMP_PREFETCH_WINDOW_MIN)) {
+            _cstmp_subscription_adjust(sub);
+            sub->win_msgs = 0;
+            sub->win_wait_ns = sub->win_handle_ns = 0;
+        }
+        t0 = t2;
+    }
+}
+
+/** UNSUBSCRIBE and free, the session stays **/
+void
+cstmp_subscription_destroy(cstmp_subscription_t *sub, int tries) {
+    if (sub) {
+        if (sub->acker) {
+            cstmp_acker_flush(sub->acker, tries);
+        }
+        _cstmp_subscription_unsubscribe(sub, tries);
+        __cstmp_free__(__stp_arg__, sub->id);
+        __cstmp_free__(__stp_arg__, sub->destination);
+        __cstmp_free__(__stp_arg__, sub->ack);
+        __cstmp_free__(__stp_arg__, sub);
+    }
+}
+
+int
+cstmp_metrics_enable(cstmp_session_t *sess) {
+    cstmp_metrics_t *m;
+    if (!sess) {
+        return 0;
+    }
+    if (sess->metrics) {
+        return 1;
+    }
+    if ((m = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_metrics_t))) == NULL) {
+        fprintf( stderr, "%s\n", "Err: No enough memory allocated");
+        return 0;
+    }
+    bzero(m, sizeof(cstmp_metrics_t));
+    /** enable before any concurrent use of the session, the pointer is not swapped later **/
+    __atomic_store_n(&sess->metrics, m, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void
+_cstmp_hist_copy(cstmp_hist_t *dst, cstmp_hist_t *src) {
+    size_t i;
+    for (i = 0; i < CSTMP_HIST_BUCKETS; i++) {
+        dst->counts[i] = __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+    }
+    dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+/** Consistent per value, not across values, good enough for monitoring **/
+int
+cstmp_metrics_snapshot(cstmp_session_t *sess, cstmp_metrics_t *out) {
+    cstmp_metrics_t *m;
+    if (!sess || !out || (m = sess->metrics) == NULL) {
+        return 0;
+    }
+    out->frames_sent = __atomic_load_n(&m->frames_sent, __ATOMIC_RELAXED);
+    out->frames_recv = __atomic_load_n(&m->frames_recv, __ATOMIC_RELAXED);
+    out->bytes_sent = __atomic_load_n(&m->bytes_sent, __ATOMIC_RELAXED);
+    out->bytes_recv = __atomic_load_n(&m->bytes_recv, __ATOMIC_RELAXED);
+    out->send_calls = __atomic_load_n(&m->send_calls, __ATOMIC_RELAXED);
+    out->recv_calls = __atomic_load_n(&m->recv_calls, __ATOMIC_RELAXED);
+    out->send_retries = __atomic_load_n(&m->send_retries, __ATOMIC_RELAXED);
+    out->recv_timeouts = __atomic_load_n(&m->recv_timeouts, __ATOMIC_RELAXED);
+    out->rbuf_grows = __atomic_load_n(&sess->rbuf.grows, __ATOMIC_RELAXED);
+    out->buf_grows = __atomic_load_n(&_cstmp_buf_grows, __ATOMIC_RELAXED);
+    out->body_bytes_raw = __atomic_load_n(&m->body_bytes_raw, __ATOMIC_RELAXED);
+    out->body_bytes_encoded = __atomic_load_n(&m->body_bytes_encoded, __ATOMIC_RELAXED);
+    out->heartbeats_sent = __atomic_load_n(&m->heartbeats_sent, __ATOMIC_RELAXED);
+    _cstmp_hist_copy(&out->send_ns, &m->send_ns);
+    _cstmp_hist_copy(&out->recv_ns, &m->recv_ns);
+    _cstmp_hist_copy(&out->frame_bytes, &m->frame_bytes);
+    return 1;
+}
+
+uint64_t
+cstmp_hist_percentile(const cstmp_hist_t *h, double q) {
+    uint64_t rank, seen = 0, upper;
+    size_t i;
+    if (!h || h->count == 0) {
+        return 0;
+    }
+    rank = (uint64_t) (q * (double) h->count);
+    rank = rank < 1 ? 1 : rank > h->count ? h->count : rank;
+    for (i = 0; i < CSTMP_HIST_BUCKETS; i++) {
+        if ((seen += h->counts[i]) >= rank) {
+            upper = _cstmp_hist_upper(i);
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+#define cstmp_prom_printf(...) \
+if (len < size) len += (size_t) snprintf(buf + len, size - len, __VA_ARGS__)
+
+static size_t
+_cstmp_prom_hist(char *buf, size_t size, size_t len, const char *name, const char *label, const cstmp_hist_t *h) {
+    static const double qs[] = { 0.5, 0.99, 0.999 };
+    size_t i;
+    cstmp_prom_printf("# TYPE cstomp_%s summary\n", name);
+    for (i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+        cstmp_prom_printf("cstomp_%s{session=\"%s\",quantile=\"%g\"} %llu\n", name, label, qs[i],
+                          (unsigned long long) cstmp_hist_percentile(h, qs[i]));
+    }
+    cstmp_prom_printf("cstomp_%s_sum{session=\"%s\"} %llu\n", name, label, (unsigned long long) h->sum);
+    cstmp_prom_printf("cstomp_%s_count{session=\"%s\"} %llu\n", name, label, (unsigned long long) h->count);
+    return len;
+}
+
+/**
+* Prometheus text exposition of the session metrics, label goes to the session label.
+* Returns the text length, a value >= size means buf was too small. buf is NUL terminated when size > 0.
+**/
+size_t
+cstmp_metrics_prometheus(cstmp_session_t *sess, const char *label, char *buf, size_t size) {
+    cstmp_metrics_t *m;
+    size_t len = 0;
+    const struct {
+        const char *name;
+        size_t off;
+    } *c, counters[] = {
+        { "frames_sent_total", offsetof(cstmp_metrics_t, frames_sent) },
+        { "frames_received_total", offsetof(cstmp_metrics_t, frames_recv) },
+        { "bytes_sent_total", offsetof(cstmp_metrics_t, bytes_sent) },
+        { "bytes_received_total", offsetof(cstmp_metrics_t, bytes_recv) },
+        { "send_calls_total", offsetof(cstmp_metrics_t, send_calls) },
+        { "recv_calls_total", offsetof(cstmp_metrics_t, recv_calls) },
+        { "send_retries_total", offsetof(cstmp_metrics_t, send_retries) },
+        { "recv_timeouts_total", offsetof(cstmp_metrics_t, recv_timeouts) },
+        { "read_buffer_grows_total", offsetof(cstmp_metrics_t, rbuf_grows) },
+        { "frame_buffer_grows_total", offsetof(cstmp_metrics_t, buf_grows) },
+        { "body_bytes_raw_total", offsetof(cstmp_metrics_t, body_bytes_raw) },
+        { "body_bytes_encoded_total", offsetof(cstmp_metrics_t, body_bytes_encoded) },
+        { "heartbeats_sent_total", offsetof(cstmp_metrics_t, heartbeats_sent) },
+        { NULL, 0 }
+    };
+
+    if (size) {
+        *buf = '\0';
+    }
+    if (!sess || !sess->metrics || (m = __cstmp_alloc__(__stp_arg__, sizeof(cstmp_metrics_t))) == NULL) {
+        return 0;
+    }
+    label = label ? label : "";
+    cstmp_metrics_snapshot(sess, m);
+    for (c = counters; c->name; c++) {
+        cstmp_prom_printf("# TYPE cstomp_%s counter\ncstomp_%s{session=\"%s\"} %llu\n", c->name, c->name, label,
+                          (unsigned long long) *(uint64_t*) ((u_char*) m + c->off));
+    }
+    len = _cstmp_prom_hist(buf, size, len, "send_latency_ns", label, &m->send_ns);
+    len = _cstmp_prom_hist(buf, size, len, "recv_latency_ns", label, &m->recv_ns);
+    len = _cstmp_prom_hist(buf, size, len, "frame_bytes", label, &m->frame_bytes);
+    __cstmp_free__(__stp_arg__, m);
+    return len;
+}
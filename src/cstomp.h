@@ -2,6 +2,8 @@
 #define CSTOMP_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <poll.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -41,38 +43,504 @@ typedef struct cstmp_frame_val_s {
     size_t len;
 } cstmp_frame_val_t;
 
+#define CSTMP_BUF_LENT      0x01 /* memory belongs to caller, never freed or grown by library */
+#define CSTMP_BUF_INLINE    0x02 /* memory is part of the frame allocation */
+
 typedef struct cstmp_frame_buf_s {
     u_char *start;
     u_char *last;
     size_t total_size;
+    int flags;
 } cstmp_frame_buf_t;
 
+/**
+* Header index entry, offsets are relative to the header block start so the table can be copied
+* together with the block. The value offset points into the escape buffer once it has been decoded.
+**/
+#define CSTMP_HDR_ESCAPED   0x01
+#define CSTMP_HDR_DECODED   0x02
+
+/** Well known header keys, interned while indexing so lookup is an integer compare **/
+typedef enum {
+    CSTMP_HDR_OTHER = 0,
+    CSTMP_HDR_DESTINATION,
+    CSTMP_HDR_CONTENT_LENGTH,
+    CSTMP_HDR_CONTENT_TYPE,
+    CSTMP_HDR_MESSAGE_ID,
+    CSTMP_HDR_SUBSCRIPTION,
+    CSTMP_HDR_ACK,
+    CSTMP_HDR_RECEIPT_ID
+} cstmp_header_id_t;
+
+#define CSTMP_HDR_IDS (CSTMP_HDR_RECEIPT_ID + 1)
+
+typedef struct cstmp_header_s {
+    uint32_t hash;
+    uint32_t key_off;
+    uint32_t key_len;
+    uint32_t val_off;
+    uint32_t val_len;
+    uint16_t flags;
+    uint16_t id; /* cstmp_header_id_t */
+} cstmp_header_t;
+
+typedef struct cstmp_header_index_s {
+    cstmp_header_t *elts;
+    size_t nelts;
+    size_t nalloc;
+    size_t indexed; /* bytes of header block already indexed */
+    uint32_t *slots; /* open addressing on hash, elts index + 1, filled on lookup */
+    size_t nslots; /* power of two, at least twice nelts */
+    size_t nhashed; /* elts already in slots and by_id */
+    uint32_t by_id[CSTMP_HDR_IDS]; /* first elt of each well known key, index + 1 */
+} cstmp_header_index_t;
+
+/**
+* Outbound queue, producers push serialized frames with one atomic exchange (MPSC, lock free),
+* a dedicated writer thread drains and combines them into large writes.
+**/
+typedef struct cstmp_wbarrier_s {
+    int done;
+    int ok;
+} cstmp_wbarrier_t;
+
+typedef struct cstmp_wnode_s {
+    struct cstmp_wnode_s *next;
+    size_t len;
+    cstmp_wbarrier_t *barrier; /* flush marker when not NULL */
+} cstmp_wnode_t;
+
+typedef struct cstmp_writer_s {
+    cstmp_wnode_t *head; /* producers side */
+    cstmp_wnode_t *tail; /* writer side */
+    cstmp_wnode_t stub;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    /*Atomic*/int sleeping;
+    /*Atomic*/int failed;
+    int stopping;
+} cstmp_writer_t;
+
+/**
+* Resumable frame scanner state, every offset is relative to the first unparsed byte, so the
+* pending bytes can be moved or copied elsewhere and scanning goes on where it stopped.
+**/
+typedef struct cstmp_scan_s {
+    int state;
+    size_t off;
+    size_t cmd_len;
+    size_t hdr_start;
+    size_t hdr_end;
+    size_t body_start;
+    long content_len;
+    cstmp_header_index_t hidx;
+} cstmp_scan_t;
+
+/**
+* Per session read buffer, bytes between pos and last are received but not yet parsed.
+* scan keeps the frame boundary progress, so a timeout in the middle of a frame does not lose any byte.
+**/
+typedef struct cstmp_read_buf_s {
+    u_char *start;
+    u_char *pos;
+    u_char *last;
+    size_t total_size;
+    cstmp_scan_t scan;
+    struct cstmp_frame_s *direct_fr; /* frame receiving a large body straight from socket */
+    size_t skip;
+    int streaming; /* body of the current frame is being streamed */
+    long stream_left; /* body bytes still to stream, -1 until the NUL */
+    size_t grows;
+} cstmp_read_buf_t;
+
+/**
+* Session metrics, counters are relaxed atomics, histograms are log-linear (HDR style, 8 sub buckets
+* per power of two, ~12% precision). Enabled per session with cstmp_metrics_enable, NULL costs nothing.
+**/
+#define CSTMP_HIST_SUB_BITS 3
+#define CSTMP_HIST_BUCKETS  (64 << CSTMP_HIST_SUB_BITS)
+
+typedef struct cstmp_hist_s {
+    uint64_t counts[CSTMP_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} cstmp_hist_t;
+
+typedef struct cstmp_metrics_s {
+    uint64_t frames_sent;
+    uint64_t frames_recv;
+    uint64_t bytes_sent;
+    uint64_t bytes_recv;
+    uint64_t send_calls; /* sendmsg / sendfile */
+    uint64_t recv_calls; /* recv / splice */
+    uint64_t send_retries; /* EAGAIN or timeout retried from tries */
+    uint64_t recv_timeouts;
+    uint64_t rbuf_grows; /* read buffer doubled */
+    uint64_t buf_grows; /* frame buffer regrowths, process wide */
+    uint64_t body_bytes_raw; /* bodies compressed on send, before */
+    uint64_t body_bytes_encoded; /* and after */
+    uint64_t heartbeats_sent; /* EOL only, not in frames_sent */
+    cstmp_hist_t send_ns;
+    cstmp_hist_t recv_ns;
+    cstmp_hist_t frame_bytes;
+} cstmp_metrics_t;
+
+/**
+* Body compression codecs, built in with CSTOMP_WITH_LZ4 / CSTOMP_WITH_ZSTD (CMake detects the libraries).
+* The compressed body goes with content-encoding and original-length headers, content-length is the wire size.
+**/
+typedef enum {
+    CSTMP_CODEC_NONE = 0,
+    CSTMP_CODEC_LZ4,
+    CSTMP_CODEC_ZSTD
+} cstmp_codec_t;
+
 typedef struct cstmp_session_s {
     int sock;
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr; /* IPv4 or IPv6 peer, cstmp_new_session connects to it again */
+    socklen_t addrlen;
     int send_timeout;
     int recv_timeout;
+    cstmp_read_buf_t rbuf;
+    int nonblocking;
+    void *loop_conn; /* registration in a cstmp_loop_t */
+    void *loop_drain; /* io_uring registration unwatched, its last received bytes still to come */
+    int pool_slot; /* index in a cstmp_pool_t, -1 if not pooled */
+    cstmp_writer_t *writer;
+    int hb_send_ms; /* negotiated heart-beat, 0 for none */
+    int hb_recv_ms;
+    int hb_send_tfd;
+    int hb_recv_tfd;
+    /*Atomic*/int hb_sent; /* written since last send tick */
+    /*Atomic*/int hb_recvd; /* received since last check tick */
+    int hb_dead;
+    cstmp_metrics_t *metrics;
+    struct cstmp_codec_s *codec; /* body compression state, created on first use */
 #ifdef CSTOMP_READ_WRITE_SHR_LOCK    
     /*Atomic*/int read_lock;
     /*Atomic*/int write_lock;
 #endif    
 } cstmp_session_t;
 
+/** Frame commands, same order as the command table, CSTMP_CMD_UNKNOWN for empty or invalid **/
+typedef enum {
+    CSTMP_CMD_UNKNOWN = 0,
+    CSTMP_CMD_SEND,
+    CSTMP_CMD_SUBSCRIBE,
+    CSTMP_CMD_UNSUBSCRIBE,
+    CSTMP_CMD_BEGIN,
+    CSTMP_CMD_COMMIT,
+    CSTMP_CMD_ABORT,
+    CSTMP_CMD_ACK,
+    CSTMP_CMD_NACK,
+    CSTMP_CMD_DISCONNECT,
+    CSTMP_CMD_CONNECT,
+    CSTMP_CMD_STOMP,
+    CSTMP_CMD_CONNECTED,
+    CSTMP_CMD_MESSAGE,
+    CSTMP_CMD_RECEIPT,
+    CSTMP_CMD_ERROR
+} cstmp_cmd_t;
+
+/** Outgoing body sent with sendfile from fd, fd is -1 when the body is in memory **/
+typedef struct cstmp_body_file_s {
+    int fd;
+    off_t offset;
+    size_t len;
+} cstmp_body_file_t;
+
 typedef struct cstmp_frame_s {
     u_char *cmd;
+    cstmp_cmd_t cmd_id; /* decoded on receive, set by cstmp_set_cmd */
     cstmp_frame_buf_t headers;
     cstmp_frame_buf_t body;
     cstmp_session_t *sess;
+    cstmp_header_index_t hidx;
+    cstmp_frame_buf_t hdr_esc; /* lazily decoded header values */
+    cstmp_frame_buf_t body_own; /* own body buffer while body is lent */
+    cstmp_body_file_t body_file;
 } cstmp_frame_t;
 
+/**
+* Push parser, bytes from any source (socket, event loop, capture file, memory) go in with
+* cstmp_parser_feed and every complete frame is handed to on_frame. A partial frame and its
+* scan progress are kept until the next feed, only that tail is ever copied.
+**/
+typedef int (*cstmp_parser_handler_pt)(cstmp_frame_t *fr, void *arg);
+
+typedef struct cstmp_parser_s {
+    cstmp_read_buf_t rbuf; /* partial frame carried over between feeds */
+    cstmp_frame_t *fr; /* reused for every frame handed to on_frame */
+    cstmp_parser_handler_pt on_frame;
+    void *arg;
+    int failed;
+} cstmp_parser_t;
+
+/**
+* Frame template, command and fixed headers serialized once, only the declared variable
+* headers, content-length and body are filled per message.
+**/
+typedef struct cstmp_template_s {
+    u_char *head; /* "CMD\nk:v\n..." */
+    size_t head_len;
+    cstmp_frame_val_t *var_keys; /* "key:" of each variable header */
+    size_t nvars;
+} cstmp_template_t;
+
+/**
+* Frame pool, each thread keeps a small cache of free frames and only touches the shared list
+* (under mutex) in batches. Frames whose buffers grew past trim_size are trimmed back on release.
+**/
+#define CSTMP_FRAME_POOL_TLS_CACHE 32
+
+typedef struct cstmp_frame_pool_cache_s {
+    struct cstmp_frame_pool_s *pool;
+    cstmp_frame_t *frames[CSTMP_FRAME_POOL_TLS_CACHE];
+    size_t count;
+    struct cstmp_frame_pool_cache_s *prev, *next;
+} cstmp_frame_pool_cache_t;
+
+typedef struct cstmp_frame_pool_s {
+    pthread_key_t tls_key;
+    pthread_mutex_t lock;
+    cstmp_frame_t **shared;
+    size_t nshared;
+    size_t max_cached;
+    size_t trim_size;
+    cstmp_frame_pool_cache_t *caches;
+} cstmp_frame_pool_t;
+
+/**
+* epoll reactor, one thread drives many sessions. Run one loop per thread (or core) and spread
+* the sessions over them, the callback get the session frame with fr->sess set, the frame is reused after return.
+**/
+typedef struct cstmp_loop_conn_s {
+    struct cstmp_loop_s *loop;
+    cstmp_session_t *sess;
+    cstmp_frame_t *fr;
+    void (*on_frame)(cstmp_frame_t *fr, void *arg);
+    void (*on_close)(cstmp_session_t *sess, void *arg);
+    void *arg;
+    int closed;
+    struct cstmp_loop_conn_s *next;
+    /* io_uring backend only */
+    cstmp_parser_t *parser; /* received bytes come from the ring, the session read buffer is swapped in */
+    cstmp_frame_buf_t out[2]; /* out[!out_fill] is in flight, the other one collects the next frames */
+    int out_fill;
+    size_t out_sent;
+    int send_inflight;
+    int inflight; /* ring operations still pointing to this registration */
+} cstmp_loop_conn_t;
+
+/**
+* CSTMP_LOOP_URING shares one io_uring between the sessions of the loop, multishot receives into
+* provided buffers and sends of every session submitted in one batch per round. It needs a build
+* with CSTOMP_IO_URING and kernel 5.19+, otherwise the loop is created on epoll.
+**/
+typedef enum {
+    CSTMP_LOOP_EPOLL = 0,
+    CSTMP_LOOP_URING
+} cstmp_loop_backend_t;
+
+typedef struct cstmp_loop_s {
+    int epfd;
+    int wakefd;
+    /*Atomic*/int stopped;
+    int dispatching;
+    /*Atomic*/size_t nconns;
+    cstmp_loop_conn_t *garbage;
+    struct cstmp_uring_s *uring; /* NULL on epoll */
+    cstmp_loop_conn_t *draining; /* io_uring, unwatched but completions still pending */
+} cstmp_loop_t;
+
+/**
+* Pipelined publishing, every publish gets a receipt header and waits in a bounded window until
+* the matching RECEIPT (success) or ERROR (failure) comes back.
+**/
+typedef struct cstmp_receipt_slot_s {
+    uint64_t seq;
+    void *user_data;
+    int used;
+} cstmp_receipt_slot_t;
+
+typedef struct cstmp_publisher_s {
+    cstmp_session_t *sess;
+    pthread_mutex_t lock;
+    cstmp_receipt_slot_t *slots;
+    size_t window;
+    uint64_t next_seq;
+    size_t outstanding;
+    cstmp_frame_t *rfr;
+    void (*on_complete)(uint64_t seq, int success, void *user_data, cstmp_frame_t *reply);
+} cstmp_publisher_t;
+
+/**
+* Parallel dispatch, frames are hashed by a header value into partitions. A partition is drained by
+* one worker at a time, so frames of one key keep their order, idle workers take over any partition
+* not being drained. Each partition queue holds at most depth frames, a full queue blocks the reader.
+**/
+typedef struct cstmp_dispatch_part_s {
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    cstmp_frame_t **ring;
+    size_t head;
+    size_t count;
+    /*Atomic*/int active;
+} cstmp_dispatch_part_t;
+
+typedef struct cstmp_dispatcher_s {
+    cstmp_dispatch_part_t *parts;
+    size_t nparts;
+    size_t depth;
+    pthread_t *workers;
+    size_t nworkers;
+    char *key;
+    size_t key_len;
+    cstmp_header_id_t key_id;
+    cstmp_frame_pool_t *pool;
+    void (*handler)(cstmp_frame_t *fr, void *arg);
+    void *arg;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    /*Atomic*/size_t nidle;
+    /*Atomic*/size_t gen;
+    /*Atomic*/size_t pending;
+    /*Atomic*/size_t rr;
+    /*Atomic*/int stopping;
+} cstmp_dispatcher_t;
+
+/**
+* Pool of connected sessions (STOMP CONNECT done) to one broker. Checkout claims a free slot with CAS,
+* a session checked in as broken is reconnected by the pool keeper thread in background.
+**/
+typedef struct cstmp_pool_slot_s {
+    cstmp_session_t *sess;
+    /*Atomic*/int state;
+} cstmp_pool_slot_t;
+
+typedef struct cstmp_pool_s {
+    cstmp_pool_slot_t *slots;
+    size_t size;
+    char *host;
+    int port;
+    char *login;
+    char *passcode;
+    char *vhost;
+    int send_timeout;
+    int recv_timeout;
+    pthread_t keeper;
+    pthread_mutex_t lock;
+    pthread_cond_t avail;
+    pthread_cond_t repair;
+    size_t nbroken;
+    /*Atomic*/size_t waiters;
+    int stopping;
+} cstmp_pool_t;
+
+/**
+* Transactional batching, SENDs are wrapped in BEGIN/COMMIT automatically, the batch is committed
+* when it reaches max_msgs, max_bytes of body or max_delay_ms since the BEGIN.
+**/
+typedef struct cstmp_batcher_s {
+    cstmp_session_t *sess;
+    size_t max_msgs;
+    size_t max_bytes;
+    int max_delay_ms;
+    int confirm; /* COMMIT with receipt, wait for it */
+    int tries; /* for the commits not made by a caller: deadline and destroy */
+    void (*on_batch)(uint64_t batch_id, size_t nmsgs, int success, void *arg);
+    void *arg;
+    cstmp_frame_t *rfr;
+    pthread_t timer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t batch_id; /* current or last transaction */
+    int in_tx;
+    int failed; /* a send in the batch failed, it is aborted */
+    size_t nmsgs;
+    size_t nbytes;
+    struct timespec deadline;
+    int stopping;
+} cstmp_batcher_t;
+
+/**
+* ACK coalescing for a subscription. client mode keeps only the newest ack id (cumulative ACK),
+* client-individual mode buffers every ACK/NACK frame, both go out as one write on flush.
+**/
+typedef enum {
+    CSTMP_ACK_CLIENT = 0,
+    CSTMP_ACK_CLIENT_INDIVIDUAL
+} cstmp_ack_mode_t;
+
+typedef struct cstmp_acker_s {
+    cstmp_session_t *sess;
+    cstmp_ack_mode_t mode;
+    size_t max_pending;
+    int max_delay_ms;
+    int tries; /* for the flushes on max_pending, deadline and destroy */
+    pthread_t timer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cstmp_frame_buf_t out; /* serialized ACK/NACK frames, what a failed flush did not send stays */
+    cstmp_frame_buf_t last_ack; /* client mode, header lines of the newest ack */
+    size_t npending;
+    struct timespec deadline;
+    int stopping;
+} cstmp_acker_t;
+
+/**
+* Subscription with adaptive prefetch, the credit (activemq.prefetchSize / prefetch-count) is raised while
+* the consumer waits on the broker and lowered while the handler is the bottleneck, never above
+* max_bytes worth of messages. An auto subscription is adjusted by resubscribing. client and client-individual
+* ones subscribe with max_prefetch once and are paced by the acker instead: it holds back up to
+* max_prefetch - prefetch acks, so at most prefetch messages are on their way. A change needs the same
+* trend over two windows in a row.
+**/
+typedef struct cstmp_subscription_s {
+    cstmp_session_t *sess;
+    char *id;
+    char *destination;
+    char *ack;
+    cstmp_acker_t *acker; /* client modes, its flush size carries the credit */
+    int paced; /* client or client-individual, no resubscribe */
+    int streak; /* windows in a row asking for more (> 0) or less (< 0) credit */
+    size_t min_prefetch;
+    size_t max_prefetch;
+    size_t max_bytes;
+    size_t prefetch; /* current credit */
+    size_t avg_size; /* moving average of body size */
+    uint64_t avg_handle_ns; /* moving average of handler latency */
+    size_t win_msgs;
+    uint64_t win_wait_ns; /* waiting for the broker */
+    uint64_t win_handle_ns; /* in the handler */
+    size_t resubscribes;
+} cstmp_subscription_t;
 
 /** Extra malloc and free customization **/
 extern void cstmp_set_malloc_management(void* (*stp_alloc)(void* arg, size_t sz), void (*stp_free)(void* arg, void* ptr), void* arg );
 
 extern cstmp_session_t* cstmp_connect(const char *hostname, int port );
 extern cstmp_session_t* cstmp_connect_t(const char *hostname, int port, int send_timeout, int recv_timeout );
+
+/** getaddrinfo (IPv6 too), the candidate addresses are raced with non-blocking connects until connect_timeout ms, 0 for no limit **/
+extern cstmp_session_t* cstmp_connect_tc(const char *hostname, int port, int send_timeout, int recv_timeout, int connect_timeout);
+
+/** Open n sessions concurrently for warm-up, sessions[i] is NULL for the ones failed, returns how many connected **/
+extern size_t cstmp_connect_bulk(const char *hostname, int port, cstmp_session_t **sessions, size_t n,
+                                 int send_timeout, int recv_timeout, int connect_timeout);
+
+/** Resolved addresses are cached per host and port, 30 seconds by default, 0 to disable **/
+extern void cstmp_set_addr_cache_ttl(int ttl_ms);
+
+extern void cstmp_addr_cache_flush();
 extern cstmp_session_t* cstmp_new_session( cstmp_session_t* curr_sess );
 
+/** Wrap a connected socket (e.g. accepted by a server), cstmp_disconnect closes it **/
+extern cstmp_session_t* cstmp_session_from_fd(int fd, int send_timeout, int recv_timeout);
+
 
 /** Do take note that if you disc the session, some other frame instance might using it**/
 extern void cstmp_disconnect(cstmp_session_t* stp_sess);
@@ -82,6 +550,16 @@ extern cstmp_frame_t* cstmp_new_frame();
 
 extern void cstmp_destroy_frame(cstmp_frame_t *fr);
 
+/** max_cached bounds the frames kept by shared list, trim_size bounds each cached frame buffer (0 for default) **/
+extern cstmp_frame_pool_t* cstmp_frame_pool_create(size_t max_cached, size_t trim_size);
+
+extern cstmp_frame_t* cstmp_frame_pool_acquire(cstmp_frame_pool_t *pool);
+
+extern void cstmp_frame_pool_release(cstmp_frame_pool_t *pool, cstmp_frame_t *fr);
+
+/** All frames should be released and other threads using the pool are done **/
+extern void cstmp_frame_pool_destroy(cstmp_frame_pool_t *pool);
+
 extern int cstmp_add_header_str(cstmp_frame_t *fr, const u_char *keyval);
 
 extern int cstmp_add_header_str_and_len(cstmp_frame_t *fr, u_char *keyval, size_t keyval_len);
@@ -94,8 +572,20 @@ extern int cstmp_add_body_content_and_len(cstmp_frame_t *fr, u_char* content, si
 
 extern u_char* cstmp_get_cmd(cstmp_frame_t *fr);
 
+/** Command as enum, frames built by assigning fr->cmd directly are decoded on first call **/
+extern cstmp_cmd_t cstmp_get_cmd_id(cstmp_frame_t *fr);
+
+/** Set both fr->cmd and fr->cmd_id **/
+extern void cstmp_set_cmd(cstmp_frame_t *fr, cstmp_cmd_t cmd_id);
+
+/** Lookup by interned key, no hashing or string compare **/
+extern int cstmp_get_header_by_id(cstmp_frame_t *fr, cstmp_header_id_t id, cstmp_frame_val_t *hdr_val);
+
+/** Exact key lookup, the first header wins when repeated, STOMP 1.2 value escapes are decoded on demand **/
 extern int cstmp_get_header(cstmp_frame_t *fr, const u_char *key, cstmp_frame_val_t *hdr_val);
 
+extern int cstmp_get_header_and_len(cstmp_frame_t *fr, const u_char *key, size_t key_len, cstmp_frame_val_t *hdr_val);
+
 extern void cstmp_get_body(cstmp_frame_t *fr, cstmp_frame_val_t *body_val);
 
 extern void cstmp_dump_frame_raw(cstmp_frame_t *fr);
@@ -108,8 +598,259 @@ extern int cstmp_send_direct(cstmp_session_t *sess, const u_char *frame_str, int
 
 extern int cstmp_send(cstmp_session_t *sess, cstmp_frame_t *fr, int tries);
 
+/** Send n frames with one gathered write, all or nothing from the caller point of view **/
+extern int cstmp_send_batch(cstmp_session_t *sess, cstmp_frame_t **frames, size_t n, int tries);
+
 extern int cstmp_recv(cstmp_session_t *sess, cstmp_frame_t *fr, int tries);
 
+/**
+* Receive the body straight into caller memory, it is used when body length + 1 (NUL) fits in body_buf_size,
+* otherwise the frame own buffer is used. The lending ends on the next reset of the frame.
+* A large body with content-length is read from socket without passing the session read buffer,
+* if it times out halfway, call again with the same frame to resume.
+**/
+extern int cstmp_recv_into(cstmp_session_t *sess, cstmp_frame_t *fr, u_char *body_buf, size_t body_buf_size, int tries);
+
+/** Move the body out of the frame, the frame gets a fresh buffer. Release with cstmp_free_body unless it was lent memory **/
+extern int cstmp_detach_body(cstmp_frame_t *fr, cstmp_frame_val_t *body_val);
+
+extern void cstmp_free_body(u_char *data);
+
 extern void cstmp_consume(cstmp_session_t *sess, cstmp_frame_t *fr, void (*callback)(cstmp_frame_t *), int *consuming);
 
+extern cstmp_loop_t* cstmp_loop_create();
+
+/** Falls back to epoll when the requested backend is not available, see cstmp_loop_backend **/
+extern cstmp_loop_t* cstmp_loop_create_backend(cstmp_loop_backend_t backend);
+
+extern cstmp_loop_backend_t cstmp_loop_backend(cstmp_loop_t *loop);
+
+/** Session goes to non-blocking mode, on_close (optional) is called on peer close or socket error, after unwatched **/
+extern int cstmp_loop_add(cstmp_loop_t *loop, cstmp_session_t *sess,
+                          void (*on_frame)(cstmp_frame_t *fr, void *arg),
+                          void (*on_close)(cstmp_session_t *sess, void *arg), void *arg);
+
+/** Back to blocking mode, with io_uring the bytes already taken from the socket are left in the session read buffer **/
+extern int cstmp_loop_del(cstmp_loop_t *loop, cstmp_session_t *sess);
+
+/** Returns number of events handled, -1 on error **/
+extern int cstmp_loop_run_once(cstmp_loop_t *loop, int timeout_ms);
+
+/** Block and dispatch until cstmp_loop_stop **/
+extern int cstmp_loop_run(cstmp_loop_t *loop);
+
+/**
+* Send from the loop thread. On io_uring the frame is copied and goes out with the next round
+* submission, do not mix with cstmp_send on the same session. On epoll it is cstmp_send.
+**/
+extern int cstmp_loop_send(cstmp_loop_t *loop, cstmp_session_t *sess, cstmp_frame_t *fr);
+
+/** Thread safe, wake up the loop and let cstmp_loop_run return **/
+extern void cstmp_loop_stop(cstmp_loop_t *loop);
+
+extern void cstmp_loop_destroy(cstmp_loop_t *loop);
+
+/** on_complete is called once per publish with the RECEIPT or ERROR frame, outside the publisher lock **/
+extern cstmp_publisher_t* cstmp_publisher_create(cstmp_session_t *sess, size_t window,
+        void (*on_complete)(uint64_t seq, int success, void *user_data, cstmp_frame_t *reply));
+
+extern void cstmp_publisher_destroy(cstmp_publisher_t *pub);
+
+/**
+* Send with an automatic receipt, the frame is not modified and can be reused after return.
+* When the window is full a blocking session reads receipts first, a loop driven session returns 0.
+**/
+extern int cstmp_publish_async(cstmp_publisher_t *pub, cstmp_frame_t *fr, void *user_data, int tries);
+
+/** Feed frames received elsewhere (e.g. cstmp_loop_t callback), returns 1 if it completed a publish **/
+extern int cstmp_publisher_handle(cstmp_publisher_t *pub, cstmp_frame_t *fr);
+
+extern int cstmp_publisher_poll(cstmp_publisher_t *pub, int tries);
+
+extern int cstmp_publisher_flush(cstmp_publisher_t *pub, int tries);
+
+/**
+* key_header NULL or a frame without it spread frames round robin (no ordering).
+* pin_cpus non zero binds worker i to cpu i % online cpus.
+**/
+extern cstmp_dispatcher_t* cstmp_dispatcher_create(size_t nworkers, size_t depth, const char *key_header, int pin_cpus,
+        void (*handler)(cstmp_frame_t *fr, void *arg), void *arg);
+
+/** Frame for the reader, from the dispatcher frame pool **/
+extern cstmp_frame_t* cstmp_dispatcher_acquire(cstmp_dispatcher_t *d);
+
+/** Ownership of fr goes to the dispatcher, it is released to the pool after the handler returns **/
+extern int cstmp_dispatcher_submit(cstmp_dispatcher_t *d, cstmp_frame_t *fr);
+
+/** Like cstmp_consume, but the callback runs on the dispatcher workers **/
+extern void cstmp_dispatch_consume(cstmp_session_t *sess, cstmp_dispatcher_t *d, int *consuming);
+
+/** Queued frames are handled before the workers exit **/
+extern void cstmp_dispatcher_destroy(cstmp_dispatcher_t *d);
+
+/** Send CONNECT (STOMP 1.2) and wait for CONNECTED, login, passcode and vhost can be NULL **/
+extern int cstmp_stomp_connect(cstmp_session_t *sess, const char *login, const char *passcode, const char *vhost, int tries);
+
+/** Open size sessions up front, all or nothing **/
+extern cstmp_pool_t* cstmp_pool_create(const char *hostname, int port, const char *login, const char *passcode, const char *vhost,
+                                       size_t size, int send_timeout, int recv_timeout);
+
+/** timeout_ms 0 to not wait, -1 to wait forever, NULL when no session became free **/
+extern cstmp_session_t* cstmp_pool_checkout(cstmp_pool_t *pool, int timeout_ms);
+
+/** broken non zero if the session got an IO error, it will be replaced in background **/
+extern void cstmp_pool_checkin(cstmp_pool_t *pool, cstmp_session_t *sess, int broken);
+
+extern void cstmp_pool_destroy(cstmp_pool_t *pool);
+
+/**
+* Optional per session writer thread, once started use cstmp_send_queued instead of cstmp_send on this session.
+* cstmp_disconnect stops it.
+**/
+extern int cstmp_writer_start(cstmp_session_t *sess);
+
+/** Serialize and queue the frame without waiting, the frame can be reused right after **/
+extern int cstmp_send_queued(cstmp_session_t *sess, cstmp_frame_t *fr);
+
+/** Barrier, returns when the frames queued by this thread so far are on the wire **/
+extern int cstmp_writer_flush(cstmp_session_t *sess);
+
+extern void cstmp_writer_stop(cstmp_session_t *sess);
+
+/**
+* Heart-beat from the CONNECTED frame, cx,cy are the values this client sent in CONNECT heart-beat header.
+* Once set, cstmp_consume sleeps in poll until data or a timer, no short recv_timeout needed.
+**/
+extern int cstmp_heartbeat_setup(cstmp_session_t *sess, cstmp_frame_t *connected, int cx, int cy);
+
+/** cstmp_stomp_connect with heart-beat:cx,cy negotiation **/
+extern int cstmp_stomp_connect_hb(cstmp_session_t *sess, const char *login, const char *passcode, const char *vhost,
+                                  int cx, int cy, int tries);
+
+/** 0 once no data came in within the negotiated interval (with grace) **/
+extern int cstmp_heartbeat_alive(cstmp_session_t *sess);
+
+/**
+* Streaming receive for big bodies, headers land in fr and on_chunk gets the body piece by piece
+* as it arrives (return 0 to abort), memory stays at the read buffer size. A timed out call resumes
+* with the same frame and callback.
+**/
+extern int cstmp_recv_stream(cstmp_session_t *sess, cstmp_frame_t *fr,
+                             int (*on_chunk)(cstmp_frame_t *fr, const u_char *data, size_t len, void *arg), void *arg, int tries);
+
+/** Same as cstmp_recv_stream, the body is written to fd, content-length bodies are spliced from the socket **/
+extern int cstmp_recv_to_fd(cstmp_session_t *sess, cstmp_frame_t *fr, int fd, int tries);
+
+/**
+* Body from a file, cstmp_send puts the content-length header and sendfile the range [offset, offset+len)
+* after the headers, nothing is copied in user space. fd must stay open until the frame is sent or reset.
+* Only cstmp_send and cstmp_publish_async take such frames.
+**/
+extern int cstmp_set_body_file(cstmp_frame_t *fr, int fd, off_t offset, size_t len);
+
+/** Body referring to caller memory (e.g. mmap'd), with content-length, the region is never written **/
+extern int cstmp_set_body_mapped(cstmp_frame_t *fr, const u_char *data, size_t len);
+
+/**
+* Template from a frame with the fixed command and headers, var_keys are the header names filled per message.
+* Do not put content-length in the frame, it is added on every send.
+**/
+extern cstmp_template_t* cstmp_template_create(cstmp_frame_t *fr, const char **var_keys, size_t nvars);
+
+/** One gathered write, vals follow var_keys order (data NULL to omit one), body is not copied **/
+extern int cstmp_template_send(cstmp_session_t *sess, cstmp_template_t *tpl, const cstmp_frame_val_t *vals,
+                               const u_char *body, size_t body_len, int tries);
+
+extern void cstmp_template_destroy(cstmp_template_t *tpl);
+
+/**
+* Batching publisher over a session, each SEND gets the transaction header of the open batch,
+* on_batch reports every batch result. With confirm the COMMIT waits for its receipt, so the session
+* should not be read by anybody else. 0 limits are not used, at least one is needed. tries is used for
+* the commits made by the deadline timer and cstmp_batcher_destroy.
+**/
+extern cstmp_batcher_t* cstmp_batcher_create(cstmp_session_t *sess, size_t max_msgs, size_t max_bytes, int max_delay_ms, int confirm, int tries,
+                                             void (*on_batch)(uint64_t batch_id, size_t nmsgs, int success, void *arg), void *arg);
+
+extern int cstmp_batcher_send(cstmp_batcher_t *b, cstmp_frame_t *fr, int tries);
+
+extern int cstmp_batcher_flush(cstmp_batcher_t *b, int tries);
+
+extern void cstmp_batcher_destroy(cstmp_batcher_t *b);
+
+/**
+* Acknowledgement manager for a client or client-individual subscription, flush on max_pending acks,
+* max_delay_ms after the first pending one (0 for none) or cstmp_acker_flush. A failed flush keeps the
+* acks it did not send for the next one.
+**/
+extern cstmp_acker_t* cstmp_acker_create(cstmp_session_t *sess, cstmp_ack_mode_t mode, size_t max_pending, int max_delay_ms, int tries);
+
+/** fr is the received MESSAGE, it can be reused right after. 0 is also a failed flush, the ack stays buffered then **/
+extern int cstmp_acker_ack(cstmp_acker_t *acker, cstmp_frame_t *fr);
+
+extern int cstmp_acker_nack(cstmp_acker_t *acker, cstmp_frame_t *fr);
+
+extern int cstmp_acker_flush(cstmp_acker_t *acker, int tries);
+
+extern void cstmp_acker_destroy(cstmp_acker_t *acker);
+
+/**
+* SUBSCRIBE with prefetch headers starting at min_prefetch, ack is "auto", "client" or "client-individual".
+* max_bytes (0 for none) bounds prefetch * average message size.
+**/
+extern cstmp_subscription_t* cstmp_subscribe_adaptive(cstmp_session_t *sess, const char *destination, const char *id, const char *ack,
+                                                      size_t min_prefetch, size_t max_prefetch, size_t max_bytes, int tries);
+
+/** Acker used by the handler of a client mode subscription, its max_pending is set by the credit from now on **/
+extern void cstmp_subscription_set_acker(cstmp_subscription_t *sub, cstmp_acker_t *acker);
+
+/** Same as cstmp_consume, and adjusts the prefetch once per window of messages **/
+extern void cstmp_subscription_consume(cstmp_subscription_t *sub, cstmp_frame_t *fr, void (*callback)(cstmp_frame_t *), int *consuming);
+
+extern void cstmp_subscription_destroy(cstmp_subscription_t *sub, int tries);
+
+/** Start collecting metrics, call it before the session is shared between threads **/
+extern int cstmp_metrics_enable(cstmp_session_t *sess);
+
+/** Copy of the current values into out, 0 if metrics are not enabled **/
+extern int cstmp_metrics_snapshot(cstmp_session_t *sess, cstmp_metrics_t *out);
+
+/** Lock free, histograms can be used outside sessions too, e.g. in benchmarks **/
+extern void cstmp_hist_record(cstmp_hist_t *h, uint64_t v);
+
+/** Value at quantile q (0..1), bucket upper bound, so at most ~12% over **/
+extern uint64_t cstmp_hist_percentile(const cstmp_hist_t *h, double q);
+
+extern size_t cstmp_metrics_prometheus(cstmp_session_t *sess, const char *label, char *buf, size_t size);
+
+/** on_frame returns 0 to stop, the rest of the bytes are kept for the next feed **/
+extern cstmp_parser_t* cstmp_parser_create(cstmp_parser_handler_pt on_frame, void *arg);
+
+/**
+* Returns the frames handed to on_frame, -1 on a malformed stream (then every feed fails until
+* cstmp_parser_reset). buf can be reused as soon as it returns, feed with len 0 to resume after a stop.
+**/
+extern ssize_t cstmp_parser_feed(cstmp_parser_t *parser, const u_char *buf, size_t len);
+
+/** Drop the partial frame and the error state **/
+extern void cstmp_parser_reset(cstmp_parser_t *parser);
+
+extern void cstmp_parser_destroy(cstmp_parser_t *parser);
+
+/** 1 when the codec is built in **/
+extern int cstmp_codec_available(cstmp_codec_t codec);
+
+/**
+* Every send path (cstmp_send, cstmp_send_batch, cstmp_template_send, cstmp_send_queued, cstmp_loop_send)
+* compresses bodies of min_size bytes or more, kept plain when it does not shrink them. File bodies are not.
+* level is the zstd level or the lz4 acceleration (0 for the default), dict (optional) must be the
+* same on both ends. Received bodies are decompressed by cstmp_recv whatever is set here, CSTMP_CODEC_NONE
+* stops compressing.
+**/
+extern int cstmp_set_compression(cstmp_session_t *sess, cstmp_codec_t codec, int level, size_t min_size,
+                                 const void *dict, size_t dict_len);
+
+/** on = 0 leaves received bodies encoded with their content-encoding, for relays forwarding frames as is **/
+extern int cstmp_set_body_decoding(cstmp_session_t *sess, int on);
+
 #endif
\ No newline at end of file